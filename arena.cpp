@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "arena.h"
+
+// --------------------------------
+
+struct ArenaOverflow
+{
+  ArenaOverflow* next;
+};
+
+Arena frame_arena;
+
+#ifdef RETRO_COUNT_ALLOCATIONS
+thread_local bool heap_counting = false;
+thread_local HeapCounts heap_counts;
+#endif
+
+// --------------------------------
+
+static void countHeapAllocation(size_t _bytes)
+{
+#ifdef RETRO_COUNT_ALLOCATIONS
+  if(!heap_counting) { return; }
+
+  ++heap_counts.allocations;
+  heap_counts.bytes += _bytes;
+#else
+  (void)_bytes;
+#endif
+}
+
+// --------------------------------
+
+void* arenaAlloc(Arena& _arena, size_t _bytes, size_t _align)
+{
+  const size_t offset = (_arena.used + _align - 1) & ~(_align - 1);
+
+  if(offset + _bytes <= _arena.capacity)
+  {
+    _arena.used = offset + _bytes;
+    return _arena.base + offset;
+  }
+
+  // The header is padded to max_align_t, so the block after it is aligned
+
+  const size_t header = (sizeof(ArenaOverflow) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+  ArenaOverflow* overflow = (ArenaOverflow*)malloc(header + _bytes);
+  if(!overflow) { return nullptr; }
+
+  countHeapAllocation(header + _bytes);
+
+  overflow->next = _arena.overflow;
+  _arena.overflow = overflow;
+
+  _arena.used = std::max(_arena.used, _arena.capacity) + _bytes + _align;
+  ++_arena.overflows;
+
+  return (uint8_t*)overflow + header;
+}
+
+// --------------------------------
+
+void resetArena(Arena& _arena)
+{
+  _arena.peak = std::max(_arena.peak, _arena.used);
+
+  if(_arena.overflow)
+  {
+    while(_arena.overflow)
+    {
+      ArenaOverflow* next = _arena.overflow->next;
+      free(_arena.overflow);
+      _arena.overflow = next;
+    }
+
+    size_t capacity = std::max(_arena.capacity, (size_t)4096);
+    while(capacity < _arena.used) { capacity *= 2; }
+
+    uint8_t* base = (uint8_t*)malloc(capacity);
+
+    if(base)
+    {
+      countHeapAllocation(capacity);
+
+      free(_arena.base);
+      _arena.base = base;
+      _arena.capacity = capacity;
+      ++_arena.grows;
+    }
+  }
+
+  _arena.used = 0;
+}
+
+// --------------------------------
+
+void destroyArena(Arena& _arena)
+{
+  resetArena(_arena);
+
+  free(_arena.base);
+
+  _arena.base = nullptr;
+  _arena.capacity = 0;
+}
+
+// --------------------------------
+
+void beginHeapCount()
+{
+#ifdef RETRO_COUNT_ALLOCATIONS
+  heap_counts.allocations = 0;
+  heap_counts.bytes = 0;
+  heap_counting = true;
+#endif
+}
+
+// --------------------------------
+
+HeapCounts endHeapCount()
+{
+  HeapCounts counts = { 0, 0 };
+
+#ifdef RETRO_COUNT_ALLOCATIONS
+  heap_counting = false;
+  counts = heap_counts;
+#endif
+
+  return counts;
+}
+
+// --------------------------------
+
+#ifdef RETRO_COUNT_ALLOCATIONS
+
+void* operator new(size_t _bytes)
+{
+  void* pointer = malloc(_bytes ? _bytes : 1);
+  if(!pointer) { throw std::bad_alloc(); }
+
+  countHeapAllocation(_bytes);
+
+  return pointer;
+}
+
+void* operator new[](size_t _bytes) { return operator new(_bytes); }
+
+void operator delete(void* _pointer) noexcept { free(_pointer); }
+void operator delete[](void* _pointer) noexcept { free(_pointer); }
+
+#endif
+
+// --------------------------------
@@ -0,0 +1,74 @@
+#ifndef _arena_h_
+#define _arena_h_
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// --------------------------------
+// Frame arena
+//
+// Scratch memory that lives until the end of the frame. Allocating bumps an
+// offset into one block and resetArena() lets go of everything at once, so
+// nothing is freed singly and no destructors run.
+//
+// A frame that needs more than the block gets the rest from overflow blocks
+// on the heap, and the next reset grows the block to what that frame used.
+// Once the frames settle the heap is not touched at all.
+
+struct ArenaOverflow;
+
+struct Arena
+{
+  uint8_t*       base;
+  size_t         capacity;
+  size_t         used;            // This frame, overflow included
+  size_t         peak;            // Most used by one frame
+  ArenaOverflow* overflow;        // This frame's overflow blocks, newest first
+  unsigned int   overflows;       // Allocations that did not fit, ever
+  unsigned int   grows;
+};
+
+// Used by the render thread only, reset at the end of update()
+
+extern Arena frame_arena;
+
+void* arenaAlloc(Arena& _arena, size_t _bytes, size_t _align = alignof(std::max_align_t));
+void resetArena(Arena& _arena);
+void destroyArena(Arena& _arena);
+
+// Uninitialised, _count may be 0
+
+template <typename T>
+T* arenaArray(Arena& _arena, size_t _count)
+{
+  static_assert(std::is_trivially_destructible<T>::value, "Arena arrays are never destroyed");
+
+  return (T*)arenaAlloc(_arena, _count * sizeof(T), alignof(T));
+}
+
+// --------------------------------
+// Heap allocation counts
+//
+// Built with RETRO_COUNT_ALLOCATIONS, operator new counts what the calling
+// thread allocates between beginHeapCount() and endHeapCount(), and so do
+// the arena's own heap blocks. Without it the counts stay 0 and cost
+// nothing. Direct malloc() calls are not seen.
+
+struct HeapCounts
+{
+  unsigned int allocations;
+  size_t       bytes;
+};
+
+const bool heap_counting_built =
+#ifdef RETRO_COUNT_ALLOCATIONS
+  true;
+#else
+  false;
+#endif
+
+void beginHeapCount();
+HeapCounts endHeapCount();
+
+#endif
@@ -0,0 +1,465 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+
+#include <SDL.h>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "audio.h"
+#include "ringbuffer.h"
+#include "trace.h"
+
+// --------------------------------
+
+enum EnvelopeStage
+{
+  envelope_off,
+  envelope_attack,
+  envelope_decay,
+  envelope_sustain,
+  envelope_release,
+};
+
+struct Voice
+{
+  uint32_t phase;
+  uint32_t noise;       // 23 bit LFSR
+  float    noise_value;
+  float    level;
+  int      stage;
+};
+
+struct SoundWrite
+{
+  uint8_t reg;
+  uint8_t value;
+};
+
+struct SoundChip
+{
+  int     sample_rate;
+  uint8_t registers[256];
+  Voice   voices[sound_voice_count];
+
+  float   voice_samples[sound_voice_count][sound_buffer_samples];
+
+  RingBuffer<SoundWrite, 1024> writes;
+};
+
+SoundChip sound_chip;
+
+struct Audio
+{
+  SDL_AudioDeviceID device;
+  int               buffer_samples;
+
+  Uint64            last_callback;
+  Uint64            underrun_ticks;
+
+  std::atomic<unsigned int> callbacks;
+  std::atomic<unsigned int> underruns;
+  std::atomic<unsigned int> dropped_writes;
+
+  TraceBuffer*      trace_buffer;           // Made here, the callback must not allocate
+};
+
+Audio audio;
+
+// Envelope stage times in milliseconds per nibble value, as on the SID
+
+const float envelope_times[16] =
+{
+  2, 8, 16, 24, 38, 56, 68, 80, 100, 250, 500, 800, 1000, 3000, 5000, 8000
+};
+
+// --------------------------------
+
+void initSoundChip(int _sample_rate)
+{
+  sound_chip.sample_rate = _sample_rate;
+
+  memset(sound_chip.registers, 0, sizeof(sound_chip.registers));
+  memset(sound_chip.voices, 0, sizeof(sound_chip.voices));
+
+  for(int i = 0; i < sound_voice_count; ++i) { sound_chip.voices[i].noise = 0x7FFFF8; }
+
+  initRingBuffer(sound_chip.writes);
+}
+
+// --------------------------------
+
+bool queueSoundWrite(uint8_t _register, uint8_t _value)
+{
+  SoundWrite write = { _register, _value };
+
+  if(pushRingBuffer(sound_chip.writes, write)) { return true; }
+
+  audio.dropped_writes.fetch_add(1, std::memory_order_relaxed);
+
+  return false;
+}
+
+// --------------------------------
+
+static void applySoundWrites()
+{
+  SoundWrite write;
+
+  while(popRingBuffer(sound_chip.writes, write))
+  {
+    const int voice_index = write.reg / sound_voice_registers;
+    const bool control = write.reg < sound_voice_count * sound_voice_registers && write.reg % sound_voice_registers == 7;
+
+    if(control)
+    {
+      const bool was_gated = sound_chip.registers[write.reg] & sound_control_gate;
+      const bool gated = write.value & sound_control_gate;
+      Voice& voice = sound_chip.voices[voice_index];
+
+      if(gated && !was_gated) { voice.stage = envelope_attack; }
+      if(!gated && was_gated && voice.stage != envelope_off) { voice.stage = envelope_release; }
+    }
+
+    sound_chip.registers[write.reg] = write.value;
+  }
+}
+
+// --------------------------------
+
+static void renderOscillator(Voice& _voice, const uint8_t* _registers, float* _out, int _count)
+{
+  const uint32_t frequency = _registers[0] | (_registers[1] << 8);
+  const uint32_t increment = (uint32_t)(((uint64_t)frequency << 32) / (4 * (uint64_t)sound_chip.sample_rate));
+  const uint8_t wave = _registers[2];
+
+  uint32_t phase = _voice.phase;
+
+  if(wave == sound_wave_square)
+  {
+    const uint32_t pulse = (uint32_t)_registers[3] << 24;
+
+    for(int i = 0; i < _count; ++i, phase += increment) { _out[i] = phase < pulse ? 1.0f : -1.0f; }
+  }
+  else if(wave == sound_wave_triangle)
+  {
+    for(int i = 0; i < _count; ++i, phase += increment) { _out[i] = 1.0f - 4.0f * fabsf(phase * (1.0f / 4294967296.0f) - 0.5f); }
+  }
+  else if(wave == sound_wave_sawtooth)
+  {
+    for(int i = 0; i < _count; ++i, phase += increment) { _out[i] = phase * (2.0f / 4294967296.0f) - 1.0f; }
+  }
+  else if(wave == sound_wave_noise)
+  {
+    // A new random value every period
+
+    for(int i = 0; i < _count; ++i)
+    {
+      const uint32_t next = phase + increment;
+
+      if(next < phase)
+      {
+        const uint32_t bit = ((_voice.noise >> 22) ^ (_voice.noise >> 17)) & 1;
+        _voice.noise = ((_voice.noise << 1) | bit) & 0x7FFFFF;
+        _voice.noise_value = (_voice.noise & 0xFF) * (2.0f / 255.0f) - 1.0f;
+      }
+
+      phase = next;
+      _out[i] = _voice.noise_value;
+    }
+  }
+  else
+  {
+    const uint8_t* table = &sound_chip.registers[sound_wavetables + (wave & 0x03) * sound_wavetable_size];
+
+    for(int i = 0; i < _count; ++i, phase += increment) { _out[i] = (int8_t)table[phase >> 27] * (1.0f / 128.0f); }
+  }
+
+  _voice.phase = phase;
+}
+
+// --------------------------------
+
+static void applyEnvelope(Voice& _voice, const uint8_t* _registers, float* _out, int _count)
+{
+  const float samples_per_ms = sound_chip.sample_rate / 1000.0f;
+
+  const float attack_step  = 1.0f / (envelope_times[_registers[4] & 0x0F] * samples_per_ms);
+  const float decay_step   = 1.0f / (envelope_times[_registers[4] >> 4] * samples_per_ms);
+  const float release_step = 1.0f / (envelope_times[_registers[5] & 0x0F] * samples_per_ms);
+  const float sustain      = (_registers[5] >> 4) * (1.0f / 15.0f);
+  const float volume       = _registers[6] * (1.0f / 255.0f);
+
+  float level = _voice.level;
+  int stage = _voice.stage;
+
+  for(int i = 0; i < _count; ++i)
+  {
+    switch(stage)
+    {
+      case envelope_attack:
+        level += attack_step;
+        if(level >= 1.0f) { level = 1.0f; stage = envelope_decay; }
+        break;
+
+      case envelope_decay:
+        level -= decay_step;
+        if(level <= sustain) { level = sustain; stage = envelope_sustain; }
+        break;
+
+      case envelope_release:
+        level -= release_step;
+        if(level <= 0.0f) { level = 0.0f; stage = envelope_off; }
+        break;
+    }
+
+    _out[i] *= level * volume;
+  }
+
+  _voice.level = level;
+  _voice.stage = stage;
+}
+
+// --------------------------------
+
+// Sums the voices and converts to 16 bit with saturation, 8 samples per
+// iteration where SIMD is available
+
+static void mixVoices(float* const* _voices, int _voice_count, float _gain, int16_t* _out, int _count)
+{
+  int i = 0;
+
+#if defined(__wasm_simd128__)
+  const v128_t gain = wasm_f32x4_splat(_gain * 32767.0f);
+
+  for(; i + 8 <= _count; i += 8)
+  {
+    v128_t low = wasm_f32x4_splat(0.0f);
+    v128_t high = wasm_f32x4_splat(0.0f);
+
+    for(int v = 0; v < _voice_count; ++v)
+    {
+      low = wasm_f32x4_add(low, wasm_v128_load(_voices[v] + i));
+      high = wasm_f32x4_add(high, wasm_v128_load(_voices[v] + i + 4));
+    }
+
+    const v128_t low_samples = wasm_i32x4_trunc_sat_f32x4(wasm_f32x4_mul(low, gain));
+    const v128_t high_samples = wasm_i32x4_trunc_sat_f32x4(wasm_f32x4_mul(high, gain));
+
+    wasm_v128_store(_out + i, wasm_i16x8_narrow_i32x4(low_samples, high_samples));
+  }
+#elif defined(__SSE2__)
+  const __m128 gain = _mm_set1_ps(_gain * 32767.0f);
+  const __m128 limit = _mm_set1_ps(32767.0f);
+  const __m128 negative_limit = _mm_set1_ps(-32768.0f);
+
+  for(; i + 8 <= _count; i += 8)
+  {
+    __m128 low = _mm_setzero_ps();
+    __m128 high = _mm_setzero_ps();
+
+    for(int v = 0; v < _voice_count; ++v)
+    {
+      low = _mm_add_ps(low, _mm_loadu_ps(_voices[v] + i));
+      high = _mm_add_ps(high, _mm_loadu_ps(_voices[v] + i + 4));
+    }
+
+    low = _mm_max_ps(_mm_min_ps(_mm_mul_ps(low, gain), limit), negative_limit);
+    high = _mm_max_ps(_mm_min_ps(_mm_mul_ps(high, gain), limit), negative_limit);
+
+    _mm_storeu_si128((__m128i*)(_out + i), _mm_packs_epi32(_mm_cvttps_epi32(low), _mm_cvttps_epi32(high)));
+  }
+#endif
+
+  for(; i < _count; ++i)
+  {
+    float sum = 0.0f;
+
+    for(int v = 0; v < _voice_count; ++v) { sum += _voices[v][i]; }
+
+    _out[i] = (int16_t)std::max(std::min(sum * _gain * 32767.0f, 32767.0f), -32768.0f);
+  }
+}
+
+// --------------------------------
+
+// Applies the queued register writes and renders _count mono samples
+
+void renderSound(int16_t* _samples, int _count)
+{
+  applySoundWrites();
+
+  // Full scale with 4 voices at full volume, louder mixes saturate
+
+  const float gain = sound_chip.registers[sound_master_volume] * (0.25f / 255.0f);
+
+  while(_count > 0)
+  {
+    const int block = std::min(_count, sound_buffer_samples);
+
+    float* active[sound_voice_count];
+    int active_count = 0;
+
+    for(int v = 0; v < sound_voice_count; ++v)
+    {
+      Voice& voice = sound_chip.voices[v];
+      if(voice.stage == envelope_off) { continue; }
+
+      const uint8_t* registers = &sound_chip.registers[v * sound_voice_registers];
+      float* out = sound_chip.voice_samples[v];
+
+      renderOscillator(voice, registers, out, block);
+      applyEnvelope(voice, registers, out, block);
+
+      active[active_count++] = out;
+    }
+
+    mixVoices(active, active_count, gain, _samples, block);
+
+    _samples += block;
+    _count -= block;
+  }
+}
+
+// --------------------------------
+
+// A callback more than a whole buffer late means the device ran out of the
+// buffer queued before it
+
+static void audioCallback(void*, Uint8* _stream, int _length)
+{
+  claimTraceBuffer(audio.trace_buffer);
+  TRACE_SCOPE("audioCallback");
+
+  const Uint64 now = SDL_GetPerformanceCounter();
+
+  if(audio.last_callback && now - audio.last_callback > audio.underrun_ticks)
+  {
+    audio.underruns.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  audio.last_callback = now;
+
+  renderSound((int16_t*)_stream, _length / sizeof(int16_t));
+
+  audio.callbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+// --------------------------------
+
+bool initAudio()
+{
+  if(SDL_InitSubSystem(SDL_INIT_AUDIO) != 0)
+  {
+    printf("Failed to initialize SDL audio:  %s\n", SDL_GetError());
+    return false;
+  }
+
+  SDL_AudioSpec desired;
+  SDL_AudioSpec obtained;
+
+  SDL_zero(desired);
+  desired.freq = sound_sample_rate;
+  desired.format = AUDIO_S16SYS;
+  desired.channels = 1;
+  desired.samples = sound_buffer_samples;
+  desired.callback = audioCallback;
+
+  audio.trace_buffer = reserveTraceBuffer("audio");
+
+  audio.device = SDL_OpenAudioDevice(nullptr, 0, &desired, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+
+  if(!audio.device)
+  {
+    printf("Failed to open audio device:  %s\n", SDL_GetError());
+    return false;
+  }
+
+  initSoundChip(obtained.freq);
+
+  audio.buffer_samples = obtained.samples;
+  audio.last_callback = 0;
+  audio.underrun_ticks = 2 * SDL_GetPerformanceFrequency() * obtained.samples / obtained.freq;
+
+  SDL_PauseAudioDevice(audio.device, 0);
+
+  printf("Audio: %d Hz, %d samples\n", obtained.freq, obtained.samples);
+
+  return true;
+}
+
+// --------------------------------
+
+void destroyAudio()
+{
+  if(audio.device) { SDL_CloseAudioDevice(audio.device); }
+  audio.device = 0;
+
+  // Freed by destroyTrace()
+
+  audio.trace_buffer = nullptr;
+}
+
+// --------------------------------
+
+AudioStats audioStats()
+{
+  AudioStats stats;
+
+  stats.sample_rate = sound_chip.sample_rate;
+  stats.buffer_samples = audio.buffer_samples;
+  stats.callbacks = audio.callbacks.load(std::memory_order_relaxed);
+  stats.underruns = audio.underruns.load(std::memory_order_relaxed);
+  stats.dropped_writes = audio.dropped_writes.load(std::memory_order_relaxed);
+
+  return stats;
+}
+
+// --------------------------------
+
+static void writeLE(FILE* _file, uint32_t _value, int _bytes)
+{
+  for(int i = 0; i < _bytes; ++i) { fputc((_value >> (i * 8)) & 0xFF, _file); }
+}
+
+// --------------------------------
+
+// 16 bit mono PCM
+
+bool writeWAV(const char* _filename, const int16_t* _samples, int _count, int _sample_rate)
+{
+  FILE* file = fopen(_filename, "wb");
+
+  if(!file)
+  {
+    printf("Failed to write %s\n", _filename);
+    return false;
+  }
+
+  const uint32_t data_bytes = _count * 2;
+
+  fwrite("RIFF", 1, 4, file);
+  writeLE(file, 36 + data_bytes, 4);
+  fwrite("WAVEfmt ", 1, 8, file);
+  writeLE(file, 16, 4);                 // Format chunk size
+  writeLE(file, 1, 2);                  // PCM
+  writeLE(file, 1, 2);                  // Channels
+  writeLE(file, _sample_rate, 4);
+  writeLE(file, _sample_rate * 2, 4);   // Bytes per second
+  writeLE(file, 2, 2);                  // Block align
+  writeLE(file, 16, 2);                 // Bits per sample
+  fwrite("data", 1, 4, file);
+  writeLE(file, data_bytes, 4);
+
+  for(int i = 0; i < _count; ++i) { writeLE(file, (uint16_t)_samples[i], 2); }
+
+  fclose(file);
+
+  return true;
+}
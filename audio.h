@@ -0,0 +1,69 @@
+#ifndef _audio_h_
+#define _audio_h_
+
+#include <cstdint>
+
+// --------------------------------
+// Sound chip
+//
+// 8 voices, each a square, triangle, sawtooth, noise or wavetable oscillator
+// with an ADSR envelope, synthesised in the SDL audio callback. Register
+// writes reach the callback through a lock-free ring, so it never locks or
+// allocates.
+//
+// Registers
+//
+// $00-$3F  8 voices of 8 bytes
+//          +0 +1  Frequency, 16 bit, in 1/4 Hz
+//          +2     Waveform, sound_wave_*
+//          +3     Pulse width of the square wave, 128 is 50%
+//          +4     Attack (low nibble), decay (high nibble)
+//          +5     Release (low nibble), sustain level (high nibble)
+//          +6     Volume
+//          +7     Control, bit 0 gate: attack and decay while set,
+//                 release when cleared
+// $40      Master volume
+// $80-$FF  4 wavetables of 32 signed samples
+
+const int sound_voice_count     = 8;
+const int sound_voice_registers = 8;
+const int sound_master_volume   = 0x40;
+const int sound_wavetables      = 0x80;
+const int sound_wavetable_size  = 32;
+
+const uint8_t sound_wave_square    = 0;
+const uint8_t sound_wave_triangle  = 1;
+const uint8_t sound_wave_sawtooth  = 2;
+const uint8_t sound_wave_noise     = 3;
+const uint8_t sound_wave_table     = 4;   // 4-7 select wavetable 0-3
+
+const uint8_t sound_control_gate = 0x01;
+
+const int sound_sample_rate    = 48000;
+const int sound_buffer_samples = 256;
+
+struct AudioStats
+{
+  int          sample_rate;
+  int          buffer_samples;
+  unsigned int callbacks;
+  unsigned int underruns;
+  unsigned int dropped_writes;
+};
+
+bool initAudio();
+void destroyAudio();
+
+// Producer side of the register ring, for a single thread
+
+bool queueSoundWrite(uint8_t _register, uint8_t _value);
+
+AudioStats audioStats();
+
+// Headless rendering, for when no audio device is open
+
+void initSoundChip(int _sample_rate);
+void renderSound(int16_t* _samples, int _count);
+bool writeWAV(const char* _filename, const int16_t* _samples, int _count, int _sample_rate);
+
+#endif
@@ -0,0 +1,192 @@
+#include <cstdio>
+#include <cstring>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten/fetch.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "bundle.h"
+#include "opengl.h"
+
+// --------------------------------
+
+// Checks the index against the loaded size, so entries can be used without
+// further bounds checks
+
+static Bundle* openBundleMemory(const uint8_t* _data, size_t _size, void* _source)
+{
+  if(_size < sizeof(BundleHeader)) { return nullptr; }
+
+  const BundleHeader* header = (const BundleHeader*)_data;
+
+  if(memcmp(header->magic, bundle_magic, sizeof(bundle_magic)) != 0 || header->version != bundle_version) { return nullptr; }
+  if(header->entry_count > (_size - sizeof(BundleHeader)) / sizeof(BundleEntry)) { return nullptr; }
+
+  const BundleEntry* entries = (const BundleEntry*)(_data + sizeof(BundleHeader));
+
+  for(uint32_t i = 0; i < header->entry_count; ++i)
+  {
+    const BundleEntry& entry = entries[i];
+
+    if(entry.name[sizeof(entry.name) - 1] != 0) { return nullptr; }
+    if(entry.offset > _size || entry.size > _size - entry.offset) { return nullptr; }
+  }
+
+  Bundle* bundle = new Bundle;
+
+  bundle->data = _data;
+  bundle->size = _size;
+  bundle->entries = entries;
+  bundle->entry_count = header->entry_count;
+  bundle->source = _source;
+
+  return bundle;
+}
+
+// --------------------------------
+
+#ifdef __EMSCRIPTEN__
+
+static BundleLoaded pending_bundle_loaded = nullptr;
+
+static void bundleFetched(emscripten_fetch_t* _fetch)
+{
+  Bundle* bundle = openBundleMemory((const uint8_t*)_fetch->data, _fetch->numBytes, _fetch);
+
+  if(!bundle)
+  {
+    printf("Invalid bundle %s\n", _fetch->url);
+    emscripten_fetch_close(_fetch);
+  }
+
+  pending_bundle_loaded(bundle);
+}
+
+// --------------------------------
+
+static void bundleFetchFailed(emscripten_fetch_t* _fetch)
+{
+  printf("Failed to load bundle %s, status %d\n", _fetch->url, _fetch->status);
+  emscripten_fetch_close(_fetch);
+
+  pending_bundle_loaded(nullptr);
+}
+
+#endif
+
+// --------------------------------
+
+void loadBundle(const char* _filename, BundleLoaded _loaded)
+{
+#ifdef __EMSCRIPTEN__
+  pending_bundle_loaded = _loaded;
+
+  emscripten_fetch_attr_t attributes;
+  emscripten_fetch_attr_init(&attributes);
+  strcpy(attributes.requestMethod, "GET");
+  attributes.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
+  attributes.onsuccess = bundleFetched;
+  attributes.onerror = bundleFetchFailed;
+
+  emscripten_fetch(&attributes, _filename);
+#else
+  Bundle* bundle = nullptr;
+
+  const int file = open(_filename, O_RDONLY);
+  struct stat status;
+
+  if(file >= 0 && fstat(file, &status) == 0 && status.st_size > 0)
+  {
+    void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+    if(data != MAP_FAILED)
+    {
+      bundle = openBundleMemory((const uint8_t*)data, status.st_size, nullptr);
+
+      if(!bundle)
+      {
+        printf("Invalid bundle %s\n", _filename);
+        munmap(data, status.st_size);
+      }
+    }
+  }
+  else
+  {
+    printf("Failed to load bundle %s\n", _filename);
+  }
+
+  if(file >= 0) { close(file); }
+
+  _loaded(bundle);
+#endif
+}
+
+// --------------------------------
+
+void closeBundle(Bundle* _bundle)
+{
+  if(!_bundle) { return; }
+
+#ifdef __EMSCRIPTEN__
+  emscripten_fetch_close((emscripten_fetch_t*)_bundle->source);
+#else
+  munmap((void*)_bundle->data, _bundle->size);
+#endif
+
+  delete _bundle;
+}
+
+// --------------------------------
+
+const BundleEntry* findBundleEntry(const Bundle& _bundle, const char* _name, uint32_t _type)
+{
+  for(uint32_t i = 0; i < _bundle.entry_count; ++i)
+  {
+    const BundleEntry& entry = _bundle.entries[i];
+    if(entry.type == _type && strcmp(entry.name, _name) == 0) { return &entry; }
+  }
+
+  return nullptr;
+}
+
+// --------------------------------
+
+// Uploads the texels straight from the bundle
+
+GLuint loadBundleTexture(GLenum _texture_unit, const Bundle& _bundle, const char* _name, GLint _filter)
+{
+  const BundleEntry* entry = findBundleEntry(_bundle, _name, bundle_texture);
+
+  if(!entry)
+  {
+    printf("Texture %s not in bundle\n", _name);
+    return 0;
+  }
+
+  GLenum format;
+  int channels;
+
+  switch(entry->format)
+  {
+    case GL_R8:    format = GL_RED;  channels = 1; break;
+    case GL_RGB8:  format = GL_RGB;  channels = 3; break;
+    case GL_RGBA8: format = GL_RGBA; channels = 4; break;
+
+    default:
+      printf("Texture %s has unsupported format 0x%X\n", _name, entry->format);
+      return 0;
+  }
+
+  if(entry->size < (uint32_t)entry->width * entry->height * channels)
+  {
+    printf("Texture %s is truncated\n", _name);
+    return 0;
+  }
+
+  return createTexture(_texture_unit, entry->width, entry->height, bundleData(_bundle, *entry), entry->format, format, GL_UNSIGNED_BYTE, _filter, _name);
+}
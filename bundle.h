@@ -0,0 +1,91 @@
+#ifndef _bundle_h_
+#define _bundle_h_
+
+#include <cstddef>
+#include <cstdint>
+#include <GLES3/gl3.h>
+
+// --------------------------------
+// Asset bundle
+//
+// One file holding every asset in the layout it is used in, so loading is a
+// single mmap natively or a single fetch on the web, and assets are used
+// straight from the loaded bytes. Built by the packer tool (see pack).
+//
+// Layout, little endian
+//
+//   BundleHeader
+//   BundleEntry[entry_count]
+//   Entry data, each aligned to bundle_alignment bytes
+//
+// Entry types
+//
+//   bundle_font        Font RAM, 256 8x8 glyphs in the font_bitmap layout
+//   bundle_glyph_font  PSF font for the glyph cache
+//   bundle_texture     width x height texels, rows top to bottom, format is
+//                      the GL internal format (GL_R8, GL_RGB8 or GL_RGBA8).
+//                      "font atlas" is the power on font as the VPU draws it.
+//   bundle_map         width x height cells, then as many attributes when
+//                      format is bundle_map_attributes
+//   bundle_palette     16 RGB entries
+
+const char bundle_magic[4] = { 'R', 'B', 'N', 'D' };
+const uint32_t bundle_version = 1;
+const uint32_t bundle_alignment = 16;
+
+const uint32_t bundle_font       = 1;
+const uint32_t bundle_glyph_font = 2;
+const uint32_t bundle_texture    = 3;
+const uint32_t bundle_map        = 4;
+const uint32_t bundle_palette    = 5;
+
+const uint32_t bundle_map_attributes = 1;
+
+struct BundleHeader
+{
+  char     magic[4];
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t reserved;
+};
+
+struct BundleEntry
+{
+  char     name[32];
+  uint32_t type;
+  uint32_t offset;            // From the start of the file
+  uint32_t size;
+  uint16_t width;
+  uint16_t height;
+  uint32_t format;
+  uint32_t reserved[3];
+};
+
+static_assert(sizeof(BundleHeader) == 16, "Bundle header layout");
+static_assert(sizeof(BundleEntry) == 64, "Bundle entry layout");
+
+struct Bundle
+{
+  const uint8_t*     data;
+  size_t             size;
+  const BundleEntry* entries;
+  uint32_t           entry_count;
+
+  void*              source;  // Fetch on the web, nullptr when mapped
+};
+
+// Called with nullptr when the bundle could not be loaded. Natively the
+// callback runs before loadBundle() returns, on the web once the fetch
+// completes.
+
+typedef void (*BundleLoaded)(Bundle* _bundle);
+
+void loadBundle(const char* _filename, BundleLoaded _loaded);
+void closeBundle(Bundle* _bundle);
+
+const BundleEntry* findBundleEntry(const Bundle& _bundle, const char* _name, uint32_t _type);
+inline const uint8_t* bundleData(const Bundle& _bundle, const BundleEntry& _entry) { return _bundle.data + _entry.offset; }
+
+GLuint loadBundleTexture(GLenum _texture_unit, const Bundle& _bundle, const char* _name, GLint _filter = GL_NEAREST);
+
+#endif
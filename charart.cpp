@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "charart.h"
+
+// --------------------------------
+
+// Luma weights out of 256
+
+const int luma_red   = 77;
+const int luma_green = 150;
+const int luma_blue  = 29;
+
+// The light pixels of a block and the colour sums of both halves
+
+struct BlockSplit
+{
+  uint64_t bits;
+  int      light[3];
+  int      total[3];
+};
+
+// --------------------------------
+
+static int nearestIndex(int _red, int _green, int _blue)
+{
+  return ((_red >> 3) << 10) | ((_green >> 3) << 5) | (_blue >> 3);
+}
+
+// --------------------------------
+
+void setCharArtFont(CharArt& _art, const uint8_t* _font_ram)
+{
+  int fewest = 65;
+
+  for(int glyph = 0; glyph < 256; ++glyph)
+  {
+    uint64_t bits = 0;
+
+    for(int row = 0; row < 8; ++row) { bits |= (uint64_t)_font_ram[glyph * 8 + row] << (row * 8); }
+
+    _art.glyphs[glyph] = bits;
+
+    const int count = __builtin_popcountll(bits);
+
+    if(count < fewest)
+    {
+      fewest = count;
+      _art.blank_glyph = glyph;
+    }
+  }
+}
+
+// --------------------------------
+
+// Fills the 5:5:5 lookup with the closest palette colour to the middle of
+// each cell
+
+void setCharArtPalette(CharArt& _art, const uint8_t* _palette)
+{
+  memcpy(_art.palette, _palette, sizeof(_art.palette));
+
+  for(int i = 0; i < 32768; ++i)
+  {
+    const int red = ((i >> 10) << 3) | 4;
+    const int green = (((i >> 5) & 31) << 3) | 4;
+    const int blue = ((i & 31) << 3) | 4;
+
+    int best = 0;
+    int best_distance = 1 << 30;
+
+    for(int c = 0; c < 16; ++c)
+    {
+      const int dr = red - _palette[c * 3 + 0];
+      const int dg = green - _palette[c * 3 + 1];
+      const int db = blue - _palette[c * 3 + 2];
+      const int distance = dr * dr + dg * dg + db * db;
+
+      if(distance < best_distance)
+      {
+        best = c;
+        best_distance = distance;
+      }
+    }
+
+    _art.nearest[i] = best;
+  }
+}
+
+// --------------------------------
+
+#if defined(__SSE2__) && !defined(__wasm_simd128__)
+
+static int sumLanes(__m128i _v)
+{
+  __m128i sum = _mm_madd_epi16(_v, _mm_set1_epi16(1));
+  sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+  sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+
+  return _mm_cvtsi128_si32(sum);
+}
+
+#endif
+
+// --------------------------------
+
+// Splits the 8x8 block at _red, _green, _blue (planes _pitch bytes wide)
+// around its mean luma. The sums of 8 rows fit in 16 bit lanes.
+
+static void splitBlock(const uint8_t* _red, const uint8_t* _green, const uint8_t* _blue, int _pitch, BlockSplit& _split)
+{
+#if defined(__wasm_simd128__)
+  v128_t red[8], green[8], blue[8], luma[8];
+  v128_t luma_sum = wasm_i16x8_splat(0);
+
+  for(int y = 0; y < 8; ++y)
+  {
+    red[y] = wasm_u16x8_load8x8(_red + y * _pitch);
+    green[y] = wasm_u16x8_load8x8(_green + y * _pitch);
+    blue[y] = wasm_u16x8_load8x8(_blue + y * _pitch);
+
+    luma[y] = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(
+        wasm_i16x8_mul(red[y], wasm_i16x8_splat(luma_red)),
+        wasm_i16x8_mul(green[y], wasm_i16x8_splat(luma_green))),
+        wasm_i16x8_mul(blue[y], wasm_i16x8_splat(luma_blue))), 8);
+
+    luma_sum = wasm_i16x8_add(luma_sum, luma[y]);
+  }
+
+  auto sumLanes = [](v128_t _v)
+  {
+    const v128_t sum = wasm_i32x4_dot_i16x8(_v, wasm_i16x8_splat(1));
+    return wasm_i32x4_extract_lane(sum, 0) + wasm_i32x4_extract_lane(sum, 1) + wasm_i32x4_extract_lane(sum, 2) + wasm_i32x4_extract_lane(sum, 3);
+  };
+
+  const v128_t mean = wasm_i16x8_splat(sumLanes(luma_sum) / 64);
+
+  v128_t light_red = wasm_i16x8_splat(0), light_green = light_red, light_blue = light_red;
+  v128_t total_red = light_red, total_green = light_red, total_blue = light_red;
+
+  _split.bits = 0;
+
+  for(int y = 0; y < 8; ++y)
+  {
+    const v128_t light = wasm_i16x8_gt(luma[y], mean);
+
+    _split.bits |= (uint64_t)wasm_i16x8_bitmask(light) << (y * 8);
+
+    light_red = wasm_i16x8_add(light_red, wasm_v128_and(red[y], light));
+    light_green = wasm_i16x8_add(light_green, wasm_v128_and(green[y], light));
+    light_blue = wasm_i16x8_add(light_blue, wasm_v128_and(blue[y], light));
+    total_red = wasm_i16x8_add(total_red, red[y]);
+    total_green = wasm_i16x8_add(total_green, green[y]);
+    total_blue = wasm_i16x8_add(total_blue, blue[y]);
+  }
+
+  _split.light[0] = sumLanes(light_red);
+  _split.light[1] = sumLanes(light_green);
+  _split.light[2] = sumLanes(light_blue);
+  _split.total[0] = sumLanes(total_red);
+  _split.total[1] = sumLanes(total_green);
+  _split.total[2] = sumLanes(total_blue);
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  __m128i red[8], green[8], blue[8], luma[8];
+  __m128i luma_sum = zero;
+
+  for(int y = 0; y < 8; ++y)
+  {
+    red[y] = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(_red + y * _pitch)), zero);
+    green[y] = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(_green + y * _pitch)), zero);
+    blue[y] = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(_blue + y * _pitch)), zero);
+
+    luma[y] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(red[y], _mm_set1_epi16(luma_red)),
+        _mm_mullo_epi16(green[y], _mm_set1_epi16(luma_green))),
+        _mm_mullo_epi16(blue[y], _mm_set1_epi16(luma_blue))), 8);
+
+    luma_sum = _mm_add_epi16(luma_sum, luma[y]);
+  }
+
+  const __m128i mean = _mm_set1_epi16(sumLanes(luma_sum) / 64);
+
+  __m128i light_red = zero, light_green = zero, light_blue = zero;
+  __m128i total_red = zero, total_green = zero, total_blue = zero;
+
+  _split.bits = 0;
+
+  for(int y = 0; y < 8; ++y)
+  {
+    const __m128i light = _mm_cmpgt_epi16(luma[y], mean);
+
+    _split.bits |= (uint64_t)(_mm_movemask_epi8(_mm_packs_epi16(light, zero)) & 0xFF) << (y * 8);
+
+    light_red = _mm_add_epi16(light_red, _mm_and_si128(red[y], light));
+    light_green = _mm_add_epi16(light_green, _mm_and_si128(green[y], light));
+    light_blue = _mm_add_epi16(light_blue, _mm_and_si128(blue[y], light));
+    total_red = _mm_add_epi16(total_red, red[y]);
+    total_green = _mm_add_epi16(total_green, green[y]);
+    total_blue = _mm_add_epi16(total_blue, blue[y]);
+  }
+
+  _split.light[0] = sumLanes(light_red);
+  _split.light[1] = sumLanes(light_green);
+  _split.light[2] = sumLanes(light_blue);
+  _split.total[0] = sumLanes(total_red);
+  _split.total[1] = sumLanes(total_green);
+  _split.total[2] = sumLanes(total_blue);
+#else
+  int luma[64];
+  int luma_sum = 0;
+
+  for(int y = 0; y < 8; ++y)
+  {
+    for(int x = 0; x < 8; ++x)
+    {
+      const int i = y * _pitch + x;
+      luma[y * 8 + x] = (_red[i] * luma_red + _green[i] * luma_green + _blue[i] * luma_blue) >> 8;
+      luma_sum += luma[y * 8 + x];
+    }
+  }
+
+  const int mean = luma_sum / 64;
+
+  _split.bits = 0;
+
+  for(int c = 0; c < 3; ++c) { _split.light[c] = _split.total[c] = 0; }
+
+  for(int y = 0; y < 8; ++y)
+  {
+    for(int x = 0; x < 8; ++x)
+    {
+      const int i = y * _pitch + x;
+      const int rgb[3] = { _red[i], _green[i], _blue[i] };
+      const bool light = luma[y * 8 + x] > mean;
+
+      if(light) { _split.bits |= (uint64_t)1 << (y * 8 + x); }
+
+      for(int c = 0; c < 3; ++c)
+      {
+        if(light) { _split.light[c] += rgb[c]; }
+        _split.total[c] += rgb[c];
+      }
+    }
+  }
+#endif
+}
+
+// --------------------------------
+
+// Returns the glyph closest to _bits or to its inverse
+
+static int matchGlyph(const CharArt& _art, uint64_t _bits, bool& _inverted)
+{
+  int best = 0;
+  int best_distance = 65;
+
+  _inverted = false;
+
+  for(int glyph = 0; glyph < 256; ++glyph)
+  {
+    const int distance = __builtin_popcountll(_art.glyphs[glyph] ^ _bits);
+
+    if(distance < best_distance)
+    {
+      best = glyph;
+      best_distance = distance;
+      _inverted = false;
+    }
+
+    if(64 - distance < best_distance)
+    {
+      best = glyph;
+      best_distance = 64 - distance;
+      _inverted = true;
+    }
+
+    if(!best_distance) { break; }
+  }
+
+  return best;
+}
+
+// --------------------------------
+
+static void convertBlock(const CharArt& _art, const BlockSplit& _split, uint8_t& _cell, uint8_t& _attribute)
+{
+  const int light_count = __builtin_popcountll(_split.bits);
+  const int dark_count = 64 - light_count;
+
+  int light[3], dark[3];
+
+  for(int c = 0; c < 3; ++c)
+  {
+    const int dark_sum = _split.total[c] - _split.light[c];
+
+    light[c] = light_count ? _split.light[c] / light_count : dark_sum / dark_count;
+    dark[c] = dark_count ? dark_sum / dark_count : light[c];
+  }
+
+  const int foreground = _art.nearest[nearestIndex(light[0], light[1], light[2])];
+  const int background = _art.nearest[nearestIndex(dark[0], dark[1], dark[2])];
+
+  if(foreground == background)
+  {
+    _cell = _art.blank_glyph;
+    _attribute = (background << 4) | background;
+    return;
+  }
+
+  bool inverted;
+  _cell = matchGlyph(_art, _split.bits, inverted);
+  _attribute = inverted ? (foreground << 4) | background : (background << 4) | foreground;
+}
+
+// --------------------------------
+
+// Each row of blocks is copied into red, green and blue planes first, so a
+// block row of a plane is one 8 byte load
+
+static void convertRows(const CharArt* _art, const CharArtImage* _image, uint8_t* _cells, uint8_t* _attributes, int _pitch, int _first_row, int _end_row)
+{
+  const int columns = _image->width / char_art_block;
+  const int width = columns * char_art_block;
+
+  std::vector<uint8_t> planes(3 * char_art_block * width);
+
+  uint8_t* red = planes.data();
+  uint8_t* green = red + char_art_block * width;
+  uint8_t* blue = green + char_art_block * width;
+
+  for(int row = _first_row; row < _end_row; ++row)
+  {
+    for(int y = 0; y < char_art_block; ++y)
+    {
+      const uint8_t* pixel = _image->pixels + (row * char_art_block + y) * _image->pitch;
+
+      for(int x = 0; x < width; ++x, pixel += 3)
+      {
+        red[y * width + x] = pixel[0];
+        green[y * width + x] = pixel[1];
+        blue[y * width + x] = pixel[2];
+      }
+    }
+
+    for(int column = 0; column < columns; ++column)
+    {
+      const int x = column * char_art_block;
+
+      BlockSplit split;
+      splitBlock(red + x, green + x, blue + x, width, split);
+      convertBlock(*_art, split, _cells[row * _pitch + column], _attributes[row * _pitch + column]);
+    }
+  }
+}
+
+// --------------------------------
+
+void convertCharArt(const CharArt& _art, const CharArtImage& _image, uint8_t* _cells, uint8_t* _attributes, int _pitch, int _threads)
+{
+  const int rows = _image.height / char_art_block;
+  const int threads = std::max(1, std::min(_threads, rows));
+
+  if(threads == 1)
+  {
+    convertRows(&_art, &_image, _cells, _attributes, _pitch, 0, rows);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+
+  for(int i = 1; i < threads; ++i)
+  {
+    workers.emplace_back(convertRows, &_art, &_image, _cells, _attributes, _pitch, rows * i / threads, rows * (i + 1) / threads);
+  }
+
+  convertRows(&_art, &_image, _cells, _attributes, _pitch, 0, rows / threads);
+
+  for(std::thread& worker : workers) { worker.join(); }
+}
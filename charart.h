@@ -0,0 +1,47 @@
+#ifndef _charart_h_
+#define _charart_h_
+
+#include <cstdint>
+
+// --------------------------------
+// Character art
+//
+// Converts RGB images into a character map and colour RAM for a font and a
+// 16 colour palette. Each 8x8 block is split around its mean luma, the mean
+// colours of the light and dark pixels become the nearest palette colours,
+// and the glyph differing from the split in the fewest pixels (XOR and
+// popcount against all 256 glyphs) is chosen. An inverted glyph match swaps
+// the colours.
+//
+// Luma and the colour sums use SSE2 or WebAssembly SIMD, 8 pixels at a time.
+// Blocks on the right and bottom edges that are not whole are left out.
+
+const int char_art_block = 8;
+
+// 24 bit RGB
+
+struct CharArtImage
+{
+  const uint8_t* pixels;
+  int            width;
+  int            height;
+  int            pitch;          // Bytes
+};
+
+struct CharArt
+{
+  uint64_t glyphs[256];         // Row 0 in the low byte, bit 0 leftmost
+  int      blank_glyph;         // With the fewest pixels set
+  uint8_t  palette[16 * 3];
+  uint8_t  nearest[32768];      // 5:5:5 RGB to palette colour
+};
+
+void setCharArtFont(CharArt& _art, const uint8_t* _font_ram);
+void setCharArtPalette(CharArt& _art, const uint8_t* _palette);
+
+// Writes image width / 8 by image height / 8 cells and attributes, _pitch
+// cells apart. Rows of blocks are shared between _threads threads.
+
+void convertCharArt(const CharArt& _art, const CharArtImage& _image, uint8_t* _cells, uint8_t* _attributes, int _pitch, int _threads = 1);
+
+#endif
@@ -0,0 +1,148 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "charart.h"
+
+// --------------------------------
+// Character art conversion speed.
+//
+// Converts a sequence of 320x240 frames, a moving colour gradient with a
+// bouncing disc, the way a video clip would be converted, and reports 8x8
+// blocks per second and frames per second on one thread and on all of them.
+//
+// The font is a 2x4 mosaic: bit n of the glyph number fills the nth 4x2
+// pixel cell, so every block has a close match.
+//
+// g++ -O2 -std=c++11 charart.cpp charartbench.cpp -o charartbench -lpthread
+
+// --------------------------------
+
+const int frame_width = 320;
+const int frame_height = 240;
+const int frame_count = 60;
+
+const uint8_t palette[16 * 3] =
+{
+    0,   0,   0,  255, 255, 255,  136,  57,  50,  103, 182, 189,
+  139,  63, 150,   85, 160,  73,   71,  59, 171,  191, 206, 114,
+  139,  84,  41,   87,  66,   0,  184, 105,  98,   80,  80,  80,
+  120, 120, 120,  148, 224, 137,  135, 122, 222,  159, 159, 159,
+};
+
+// --------------------------------
+
+void makeMosaicFont(uint8_t* _font_ram)
+{
+  for(int glyph = 0; glyph < 256; ++glyph)
+  {
+    for(int row = 0; row < 8; ++row)
+    {
+      const int left = (glyph >> ((row / 2) * 2)) & 1;
+      const int right = (glyph >> ((row / 2) * 2 + 1)) & 1;
+
+      _font_ram[glyph * 8 + row] = (left ? 0x0F : 0) | (right ? 0xF0 : 0);
+    }
+  }
+}
+
+// --------------------------------
+
+void makeFrame(uint8_t* _pixels, int _frame)
+{
+  const float t = _frame / (float)frame_count;
+  const float disc_x = frame_width * (0.5f + 0.35f * std::sin(t * 6.2832f));
+  const float disc_y = frame_height * (0.5f + 0.35f * std::cos(t * 6.2832f * 2.0f));
+
+  for(int y = 0; y < frame_height; ++y)
+  {
+    for(int x = 0; x < frame_width; ++x)
+    {
+      uint8_t* pixel = _pixels + (y * frame_width + x) * 3;
+
+      const float dx = x - disc_x;
+      const float dy = y - disc_y;
+
+      if(dx * dx + dy * dy < 40.0f * 40.0f)
+      {
+        pixel[0] = 240;
+        pixel[1] = 220;
+        pixel[2] = 90;
+        continue;
+      }
+
+      pixel[0] = (x * 255 / frame_width + _frame * 4) & 0xFF;
+      pixel[1] = y * 255 / frame_height;
+      pixel[2] = ((x ^ y) & 16) ? 160 : 60;
+    }
+  }
+}
+
+// --------------------------------
+
+double run(const CharArt& _art, const std::vector<uint8_t>& _frames, uint8_t* _cells, uint8_t* _attributes, int _threads, int _repeats)
+{
+  const auto start = std::chrono::steady_clock::now();
+
+  for(int repeat = 0; repeat < _repeats; ++repeat)
+  {
+    for(int frame = 0; frame < frame_count; ++frame)
+    {
+      const CharArtImage image = { _frames.data() + frame * frame_width * frame_height * 3, frame_width, frame_height, frame_width * 3 };
+      convertCharArt(_art, image, _cells, _attributes, frame_width / char_art_block, _threads);
+    }
+  }
+
+  const auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double>(end - start).count();
+}
+
+// --------------------------------
+
+int main(int argc, char** argv)
+{
+  static CharArt art;
+  uint8_t font_ram[256 * 8];
+
+  makeMosaicFont(font_ram);
+  setCharArtFont(art, font_ram);
+  setCharArtPalette(art, palette);
+
+  std::vector<uint8_t> frames(frame_count * frame_width * frame_height * 3);
+
+  for(int frame = 0; frame < frame_count; ++frame) { makeFrame(frames.data() + frame * frame_width * frame_height * 3, frame); }
+
+  const int columns = frame_width / char_art_block;
+  const int rows = frame_height / char_art_block;
+  const int repeats = 20;
+
+  std::vector<uint8_t> cells(columns * rows);
+  std::vector<uint8_t> attributes(columns * rows);
+
+#if defined(__wasm_simd128__)
+  printf("WebAssembly SIMD\n");
+#elif defined(__SSE2__)
+  printf("SSE2\n");
+#else
+  printf("Scalar\n");
+#endif
+
+  const int thread_counts[] = { 1, (int)std::max(1u, std::thread::hardware_concurrency()) };
+
+  for(int threads : thread_counts)
+  {
+    const double seconds = run(art, frames, cells.data(), attributes.data(), threads, repeats);
+    const double converted = frame_count * repeats;
+
+    printf("%d thread%s: %.0f blocks/s, %.0f frames/s of %dx%d\n", threads, threads > 1 ? "s" : "",
+        converted * columns * rows / seconds, converted / seconds, frame_width, frame_height);
+  }
+
+  return 0;
+}
+
+// --------------------------------
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cstring>
+
+#include "collision.h"
+
+// --------------------------------
+
+static uint64_t glyphWord(const uint8_t* _font_ram, int _glyph)
+{
+  uint64_t word;
+  memcpy(&word, _font_ram + _glyph * 8, 8);
+
+  return word;
+}
+
+// --------------------------------
+
+// Moves the pixels of an 8x8 word by _dx columns and _dy rows, dropping the
+// ones that leave it. Columns move within each byte, rows by whole bytes.
+
+static uint64_t shiftGlyph(uint64_t _glyph, int _dx, int _dy)
+{
+  if(_dx <= -8 || _dx >= 8 || _dy <= -8 || _dy >= 8) { return 0; }
+
+  const uint64_t bytes = 0x0101010101010101ULL;
+
+  if(_dx > 0) { _glyph = (_glyph << _dx) & (bytes * ((0xFF << _dx) & 0xFF)); }
+  else if(_dx < 0) { _glyph = (_glyph >> -_dx) & (bytes * (0xFF >> -_dx)); }
+
+  if(_dy > 0) { _glyph <<= _dy * 8; }
+  else if(_dy < 0) { _glyph >>= -_dy * 8; }
+
+  return _glyph;
+}
+
+// --------------------------------
+
+// The pixels of a sprite at _x, _y that are on the screen
+
+static uint64_t screenMask(int _x, int _y, int _width, int _height)
+{
+  const uint64_t all = ~0ULL;
+
+  uint64_t mask = all;
+
+  if(_x < 0) { mask &= shiftGlyph(all, -_x, 0); }
+  if(_x + 8 > _width) { mask &= shiftGlyph(all, _width - _x - 8, 0); }
+  if(_y < 0) { mask &= shiftGlyph(all, 0, -_y); }
+  if(_y + 8 > _height) { mask &= shiftGlyph(all, 0, _height - _y - 8); }
+
+  return mask;
+}
+
+// --------------------------------
+
+// The glyph pixels of the up to 2x2 scrolled map cells under a sprite at
+// screen position _x, _y, lined up with the sprite
+
+static uint64_t backgroundUnder(const CollisionScene& _scene, int _x, int _y)
+{
+  const int map_width = _scene.columns * 8;
+  const int map_height = _scene.rows * 8;
+
+  const int map_x = ((_x + _scene.scroll_x) % map_width + map_width) % map_width;
+  const int map_y = ((_y + _scene.scroll_y) % map_height + map_height) % map_height;
+
+  const int offset_x = map_x & 7;
+  const int offset_y = map_y & 7;
+
+  uint64_t background = 0;
+
+  for(int j = 0; j < 2; ++j)
+  {
+    for(int i = 0; i < 2; ++i)
+    {
+      if((i && !offset_x) || (j && !offset_y)) { continue; }
+
+      const int cell = ((map_y / 8 + j) % _scene.rows) * _scene.columns + (map_x / 8 + i) % _scene.columns;
+
+      if(cell >= _scene.map_size) { continue; }
+
+      background |= shiftGlyph(glyphWord(_scene.font_ram, _scene.map[cell]), i * 8 - offset_x, j * 8 - offset_y);
+    }
+  }
+
+  return background;
+}
+
+// --------------------------------
+
+// Calls _visit(cell) for the screen cells a sprite with pixels on the
+// screen covers
+
+template <typename Visit>
+static void visitCells(const CollisionSprite& _sprite, int _columns, int _rows, Visit _visit)
+{
+  const int first_x = std::max(0, (_sprite.x + 8) / 8 - 1);
+  const int first_y = std::max(0, (_sprite.y + 8) / 8 - 1);
+  const int last_x = std::min(_columns - 1, (_sprite.x + 7) / 8);
+  const int last_y = std::min(_rows - 1, (_sprite.y + 7) / 8);
+
+  for(int y = first_y; y <= last_y; ++y)
+  {
+    for(int x = first_x; x <= last_x; ++x) { _visit(y * _columns + x); }
+  }
+}
+
+// --------------------------------
+
+void detectCollisions(Collisions& _collisions, const CollisionScene& _scene)
+{
+  _collisions.sprites = 0;
+  _collisions.background = 0;
+  _collisions.pairs.clear();
+
+  if(_scene.columns <= 0 || _scene.rows <= 0) { return; }
+
+  const int width = _scene.columns * 8;
+  const int height = _scene.rows * 8;
+  const int count = std::min(_scene.sprite_count, collision_max_sprites);
+
+  _collisions.grid.resize(_scene.columns * _scene.rows);
+
+  uint32_t* grid = _collisions.grid.data();
+
+  uint64_t masks[collision_max_sprites];          // Sprite pixels on the screen
+  uint32_t candidates[collision_max_sprites];     // Lower sprites sharing a cell
+
+  for(int i = 0; i < count; ++i)
+  {
+    const CollisionSprite& sprite = _scene.sprites[i];
+
+    masks[i] = sprite.visible ? glyphWord(_scene.font_ram, sprite.glyph) & screenMask(sprite.x, sprite.y, width, height) : 0;
+    candidates[i] = 0;
+
+    if(!masks[i]) { continue; }
+
+    if(masks[i] & backgroundUnder(_scene, sprite.x, sprite.y)) { _collisions.background |= 1U << i; }
+
+    visitCells(sprite, _scene.columns, _scene.rows, [&](int _cell)
+    {
+      candidates[i] |= grid[_cell];
+      grid[_cell] |= 1U << i;
+    });
+  }
+
+  for(int i = 0; i < count; ++i)
+  {
+    if(!masks[i]) { continue; }
+
+    const CollisionSprite& sprite = _scene.sprites[i];
+
+    visitCells(sprite, _scene.columns, _scene.rows, [&](int _cell) { grid[_cell] = 0; });
+
+    for(uint32_t others = candidates[i]; others; others &= others - 1)
+    {
+      const int j = __builtin_ctz(others);
+      const CollisionSprite& other = _scene.sprites[j];
+
+      if(!(masks[i] & shiftGlyph(masks[j], other.x - sprite.x, other.y - sprite.y))) { continue; }
+
+      _collisions.sprites |= (1U << i) | (1U << j);
+      _collisions.pairs.push_back(j);
+      _collisions.pairs.push_back(i);
+    }
+  }
+}
+
+// --------------------------------
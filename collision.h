@@ -0,0 +1,53 @@
+#ifndef _collision_h_
+#define _collision_h_
+
+#include <cstdint>
+#include <vector>
+
+// --------------------------------
+// Sprite collisions
+//
+// Finds the sprites whose set pixels overlap a set pixel of another sprite,
+// or of the glyph in a map cell under them, on the screen. Sprites and
+// glyphs are 8x8, so a glyph is one 64-bit word (row 0 in the low byte, bit
+// 0 leftmost, as in font RAM) and a whole sprite is tested with one AND of
+// shifted words instead of row by row.
+//
+// Sprites are first sorted into a grid of 8x8 screen cells, and only
+// sprites sharing a cell are compared.
+
+const int collision_max_sprites = 32;
+
+struct CollisionSprite
+{
+  int     x;                // Screen pixels
+  int     y;
+  uint8_t glyph;
+  bool    visible;
+};
+
+struct CollisionScene
+{
+  const CollisionSprite* sprites;
+  int                    sprite_count;
+  const uint8_t*         map;            // 8-bit cells, row major
+  int                    map_size;       // Bytes, cells past it are blank
+  int                    columns;        // Map and screen size in cells
+  int                    rows;
+  const uint8_t*         font_ram;
+  int                    scroll_x;       // Map pixels, the map wraps
+  int                    scroll_y;
+};
+
+struct Collisions
+{
+  uint32_t             sprites;          // Bit n: sprite n touches another sprite
+  uint32_t             background;       // Bit n: sprite n touches the map
+  std::vector<uint8_t> pairs;            // Sprite numbers of each touching pair, lower first
+
+  std::vector<uint32_t> grid;            // Sprites by screen cell, empty between calls
+};
+
+void detectCollisions(Collisions& _collisions, const CollisionScene& _scene);
+
+#endif
@@ -0,0 +1,576 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "arena.h"
+#include "console.h"
+#include "font.h"
+#include "opengl.h"
+#include "shaders.h"
+#include "trace.h"
+
+// --------------------------------
+
+const int console_layer_cells = console_columns * console_rows;
+
+const uint16_t console_flag_open = 0x01;
+
+// Instance attributes, read by console_vs
+
+struct ConsoleInstance
+{
+  int16_t  x;
+  int16_t  y;
+  int16_t  columns;
+  int16_t  rows;
+  uint16_t layer;
+  uint16_t font;
+  uint16_t palette;
+  uint16_t flags;
+};
+
+static_assert(sizeof(ConsoleInstance) == 16, "Console instance layout");
+
+struct ConsoleBatch
+{
+  GLuint program;
+  GLuint vao;
+  GLuint instance_vbo;
+  GLuint font_texture;
+  GLuint map_texture;
+  GLuint attribute_texture;
+
+  GLenum font_texture_unit;
+  GLenum map_texture_unit;
+  GLenum attribute_texture_unit;
+  GLint  screen_size_location;
+  GLint  palettes_location;
+
+  ConsoleInstance instances[console_max];
+  int             instance_count;     // Last open console + 1
+
+  // Shadows of the array textures, one console_columns x console_rows layer
+  // per console and the font RAM of each font layer. The textures can be
+  // evicted and made again from them.
+
+  uint8_t map[console_max * console_layer_cells];
+  uint8_t attributes[console_max * console_layer_cells];
+  uint8_t fonts[console_fonts * font_ram_size];
+  uint8_t palettes[console_palettes * 16 * 3];
+
+  // Bounding box of the edits since the last upload
+
+  int  first_dirty_layer;
+  int  last_dirty_layer;
+  int  first_dirty_row;
+  int  last_dirty_row;
+
+  bool instances_dirty;
+  bool palettes_dirty;
+  bool palettes_changed;              // For the display palette, cleared by consolePalettesChanged()
+
+  // The program, textures and buffers are made when the first console opens
+
+  bool indexed;
+  bool created;
+  bool failed;
+
+  ConsoleStats stats;
+};
+
+ConsoleBatch console_batch;
+
+// --------------------------------
+
+static void clearDirtyBox()
+{
+  console_batch.first_dirty_layer = console_max;
+  console_batch.last_dirty_layer = -1;
+  console_batch.first_dirty_row = console_rows;
+  console_batch.last_dirty_row = -1;
+}
+
+// --------------------------------
+
+static void markDirty(int _console, int _first_row, int _last_row)
+{
+  ConsoleBatch& batch = console_batch;
+
+  batch.first_dirty_layer = std::min(batch.first_dirty_layer, _console);
+  batch.last_dirty_layer = std::max(batch.last_dirty_layer, _console);
+  batch.first_dirty_row = std::min(batch.first_dirty_row, _first_row);
+  batch.last_dirty_row = std::max(batch.last_dirty_row, _last_row);
+}
+
+// --------------------------------
+
+static bool isOpen(int _console)
+{
+  return _console >= 0 && _console < console_max && (console_batch.instances[_console].flags & console_flag_open);
+}
+
+// --------------------------------
+
+static bool buildConsoleProgram()
+{
+  ConsoleBatch& batch = console_batch;
+
+  char defines[128];
+  int length = snprintf(defines, sizeof(defines), "#define PALETTE_ENTRIES %d\n", console_palettes * 16);
+
+  if(batch.indexed) { snprintf(defines + length, sizeof(defines) - length, "#define INDEXED\n#define FIRST_INDEX %dU\n", console_first_index); }
+
+  batch.program = getProgramVariant(console_vs, console_fs, defines);
+
+  if(!batch.program) { return false; }
+
+  useProgram(batch.program);
+
+  setUniform1i(glGetUniformLocation(batch.program, "font_sampler"), batch.font_texture_unit);
+  setUniform1i(glGetUniformLocation(batch.program, "map_sampler"), batch.map_texture_unit);
+  setUniform1i(glGetUniformLocation(batch.program, "attribute_sampler"), batch.attribute_texture_unit);
+
+  batch.screen_size_location = glGetUniformLocation(batch.program, "screen_size");
+  batch.palettes_location = glGetUniformLocation(batch.program, "palettes");
+  batch.palettes_dirty = true;
+
+  return true;
+}
+
+// --------------------------------
+
+bool setConsoleIndexed(bool _indexed)
+{
+  console_batch.indexed = _indexed;
+
+  return !console_batch.created || buildConsoleProgram();
+}
+
+// --------------------------------
+
+static bool texturesResident()
+{
+  return console_batch.font_texture && console_batch.map_texture && console_batch.attribute_texture;
+}
+
+// --------------------------------
+
+static void consoleTextureEvicted(GLuint _texture_id)
+{
+  ConsoleBatch& batch = console_batch;
+
+  if(batch.font_texture == _texture_id) { batch.font_texture = 0; }
+  if(batch.map_texture == _texture_id) { batch.map_texture = 0; }
+  if(batch.attribute_texture == _texture_id) { batch.attribute_texture = 0; }
+}
+
+// --------------------------------
+
+// Makes the array textures that are missing from the shadows: all of them
+// at first, later the ones evicted while no console was shown
+
+static bool createConsoleTextures()
+{
+  ConsoleBatch& batch = console_batch;
+
+  if(!batch.font_texture)
+  {
+    const int atlas_bytes = fontAtlasWidth(default_text_mode) * fontAtlasHeight(default_text_mode);
+    unsigned char* font_layers = (unsigned char*)malloc(atlas_bytes * console_fonts);
+
+    for(int i = 0; i < console_fonts; ++i) { expandFont(default_text_mode, batch.fonts + i * font_ram_size, font_layers + i * atlas_bytes); }
+
+    batch.font_texture = createTextureArray(batch.font_texture_unit, fontAtlasWidth(default_text_mode), fontAtlasHeight(default_text_mode), console_fonts,
+        font_layers, GL_R8, GL_RED, GL_UNSIGNED_BYTE, GL_NEAREST, "console fonts");
+
+    free(font_layers);
+
+    if(!batch.font_texture) { return false; }
+    setTextureEvictable(batch.font_texture, consoleTextureEvicted);
+  }
+
+  if(!batch.map_texture)
+  {
+    batch.map_texture = createTextureArray(batch.map_texture_unit, console_columns, console_rows, console_max, batch.map, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, GL_NEAREST, "console maps");
+
+    if(!batch.map_texture) { return false; }
+    setTextureEvictable(batch.map_texture, consoleTextureEvicted);
+  }
+
+  if(!batch.attribute_texture)
+  {
+    batch.attribute_texture = createTextureArray(batch.attribute_texture_unit, console_columns, console_rows, console_max, batch.attributes, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, GL_NEAREST, "console attributes");
+
+    if(!batch.attribute_texture) { return false; }
+    setTextureEvictable(batch.attribute_texture, consoleTextureEvicted);
+  }
+
+  return true;
+}
+
+// --------------------------------
+
+// The GL objects are made from the shadows as they are, so edits made before
+// need no upload of their own
+
+static bool createConsoleObjects()
+{
+  TRACE_SCOPE("createConsoleObjects");
+
+  ConsoleBatch& batch = console_batch;
+
+  if(batch.created) { return true; }
+  if(batch.failed) { return false; }
+
+  // Cleared once everything is made, so a failure is not retried every frame
+
+  batch.failed = true;
+
+  if(!buildConsoleProgram()) { return false; }
+  if(!createConsoleTextures()) { return false; }
+
+  // The instance table is the vertex data, the quad corners come from gl_VertexID
+
+  batch.vao = createVertexArray("console instances");
+  batch.instance_vbo = createBuffer(GL_ARRAY_BUFFER, sizeof(batch.instances), batch.instances, GL_DYNAMIC_DRAW, "console instances");
+
+  glEnableVertexAttribArray(0);
+  glVertexAttribIPointer(0, 4, GL_SHORT, sizeof(ConsoleInstance), 0);
+  glVertexAttribDivisor(0, 1);
+
+  glEnableVertexAttribArray(1);
+  glVertexAttribIPointer(1, 4, GL_UNSIGNED_SHORT, sizeof(ConsoleInstance), (const void*)(4 * sizeof(int16_t)));
+  glVertexAttribDivisor(1, 1);
+
+  clearDirtyBox();
+  batch.instances_dirty = false;
+  batch.created = true;
+  batch.failed = false;
+
+  return true;
+}
+
+// --------------------------------
+
+bool initConsoles(GLenum _font_texture_unit, GLenum _map_texture_unit, GLenum _attribute_texture_unit)
+{
+  ConsoleBatch& batch = console_batch;
+
+  batch.font_texture_unit = _font_texture_unit;
+  batch.map_texture_unit = _map_texture_unit;
+  batch.attribute_texture_unit = _attribute_texture_unit;
+
+  memset(batch.palettes, 0, sizeof(batch.palettes));
+  memset(batch.map, 0, sizeof(batch.map));
+  memset(batch.attributes, 0, sizeof(batch.attributes));
+  memset(batch.instances, 0, sizeof(batch.instances));
+
+  // Every font layer starts as the built-in font
+
+  for(int i = 0; i < console_fonts; ++i) { copyBuiltinFont(batch.fonts + i * font_ram_size); }
+
+  batch.font_texture = 0;
+  batch.map_texture = 0;
+  batch.attribute_texture = 0;
+  batch.instance_count = 0;
+
+  clearDirtyBox();
+  batch.instances_dirty = false;
+  batch.palettes_changed = false;
+  batch.indexed = false;
+  batch.created = false;
+  batch.failed = false;
+
+  batch.stats.open = 0;
+  batch.stats.uploaded_layers = 0;
+  batch.stats.uncovered = 0;
+
+  return true;
+}
+
+// --------------------------------
+
+void destroyConsoles()
+{
+  ConsoleBatch& batch = console_batch;
+
+  if(!batch.created) { return; }
+
+  deleteBuffer(batch.instance_vbo);
+  deleteVertexArray(batch.vao);
+  deleteTexture(batch.font_texture);
+  deleteTexture(batch.map_texture);
+  deleteTexture(batch.attribute_texture);
+}
+
+// --------------------------------
+
+int openConsole(int _x, int _y, int _columns, int _rows)
+{
+  ConsoleBatch& batch = console_batch;
+
+  if(_columns < 1 || _columns > console_columns || _rows < 1 || _rows > console_rows) { return -1; }
+
+  for(int i = 0; i < console_max; ++i)
+  {
+    ConsoleInstance& instance = batch.instances[i];
+
+    if(instance.flags & console_flag_open) { continue; }
+
+    instance.x = _x;
+    instance.y = _y;
+    instance.columns = _columns;
+    instance.rows = _rows;
+    instance.layer = i;
+    instance.font = 0;
+    instance.palette = 0;
+    instance.flags = console_flag_open;
+
+    batch.instance_count = std::max(batch.instance_count, i + 1);
+    batch.instances_dirty = true;
+    ++batch.stats.open;
+
+    clearConsole(i, 0x01);
+
+    return i;
+  }
+
+  return -1;
+}
+
+// --------------------------------
+
+void closeConsole(int _console)
+{
+  ConsoleBatch& batch = console_batch;
+
+  if(!isOpen(_console)) { return; }
+
+  batch.instances[_console].flags = 0;
+
+  while(batch.instance_count > 0 && !(batch.instances[batch.instance_count - 1].flags & console_flag_open)) { --batch.instance_count; }
+
+  batch.instances_dirty = true;
+  --batch.stats.open;
+  ++batch.stats.uncovered;
+}
+
+// --------------------------------
+
+void moveConsole(int _console, int _x, int _y)
+{
+  if(!isOpen(_console)) { return; }
+
+  ConsoleInstance& instance = console_batch.instances[_console];
+
+  instance.x = _x;
+  instance.y = _y;
+
+  console_batch.instances_dirty = true;
+  ++console_batch.stats.uncovered;
+}
+
+// --------------------------------
+
+void setConsoleStyle(int _console, int _font, int _palette)
+{
+  if(!isOpen(_console) || _font < 0 || _font >= console_fonts || _palette < 0 || _palette >= console_palettes) { return; }
+
+  ConsoleInstance& instance = console_batch.instances[_console];
+
+  instance.font = _font;
+  instance.palette = _palette;
+
+  console_batch.instances_dirty = true;
+}
+
+// --------------------------------
+
+void setConsoleFont(int _font, const uint8_t* _font_ram)
+{
+  if(_font < 0 || _font >= console_fonts) { return; }
+
+  memcpy(console_batch.fonts + _font * font_ram_size, _font_ram, font_ram_size);
+
+  // An evicted font texture is made again from the shadow
+
+  if(!createConsoleObjects() || !console_batch.font_texture) { return; }
+
+  const int atlas_bytes = fontAtlasWidth(default_text_mode) * fontAtlasHeight(default_text_mode);
+  unsigned char* font_image = expandFont(default_text_mode, _font_ram, arenaArray<unsigned char>(frame_arena, atlas_bytes));
+
+  selectTexture(console_batch.font_texture_unit, console_batch.font_texture, GL_TEXTURE_2D_ARRAY);
+  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, _font, fontAtlasWidth(default_text_mode), fontAtlasHeight(default_text_mode), 1,
+      GL_RED, GL_UNSIGNED_BYTE, font_image);
+}
+
+// --------------------------------
+
+void setConsolePalette(int _palette, const uint8_t* _rgb)
+{
+  if(_palette < 0 || _palette >= console_palettes) { return; }
+
+  memcpy(console_batch.palettes + _palette * 16 * 3, _rgb, 16 * 3);
+
+  console_batch.palettes_dirty = true;
+  console_batch.palettes_changed = true;
+}
+
+// --------------------------------
+
+void copyConsolePalettes(uint8_t* _rgb)
+{
+  memcpy(_rgb, console_batch.palettes, sizeof(console_batch.palettes));
+}
+
+// --------------------------------
+
+bool consolePalettesChanged()
+{
+  const bool changed = console_batch.palettes_changed;
+  console_batch.palettes_changed = false;
+
+  return changed;
+}
+
+// --------------------------------
+
+void clearConsole(int _console, uint8_t _attribute)
+{
+  if(!isOpen(_console)) { return; }
+
+  const ConsoleInstance& instance = console_batch.instances[_console];
+  const int offset = _console * console_layer_cells;
+
+  for(int row = 0; row < instance.rows; ++row)
+  {
+    memset(console_batch.map + offset + row * console_columns, ' ', instance.columns);
+    memset(console_batch.attributes + offset + row * console_columns, _attribute, instance.columns);
+  }
+
+  markDirty(_console, 0, instance.rows - 1);
+}
+
+// --------------------------------
+
+void printConsole(int _console, int _x, int _y, const char* _text, uint8_t _attribute)
+{
+  if(!isOpen(_console)) { return; }
+
+  const ConsoleInstance& instance = console_batch.instances[_console];
+
+  if(_x < 0 || _y < 0 || _x >= instance.columns || _y >= instance.rows) { return; }
+
+  const int offset = _console * console_layer_cells + _y * console_columns;
+  const int first_x = _x;
+
+  for(; *_text && _x < instance.columns; ++_x, ++_text)
+  {
+    console_batch.map[offset + _x] = *_text & 0x7F;
+    console_batch.attributes[offset + _x] = _attribute;
+  }
+
+  if(_x > first_x) { markDirty(_console, _y, _y); }
+}
+
+// --------------------------------
+
+// The edits of all consoles go up as one box of rows x layers per texture.
+// GL_UNPACK_IMAGE_HEIGHT keeps the layer stride of the shadows when only
+// some rows are uploaded.
+
+void uploadConsoles()
+{
+  TRACE_SCOPE("uploadConsoles");
+
+  ConsoleBatch& batch = console_batch;
+
+  batch.stats.uploaded_layers = 0;
+
+  if(!batch.created && (!batch.instance_count || !createConsoleObjects())) { return; }
+
+  // Touched first, so making the evicted ones again or anything else made
+  // later in the frame does not evict them before they are drawn
+
+  if(batch.instance_count)
+  {
+    touchTexture(batch.font_texture);
+    touchTexture(batch.map_texture);
+    touchTexture(batch.attribute_texture);
+  }
+
+  // Evicted textures are made again once there is a console to draw. Edits
+  // meanwhile wait in the dirty box, as they would for one texture alone.
+
+  if(!texturesResident() && batch.instance_count && !createConsoleTextures()) { return; }
+
+  if(texturesResident() && batch.first_dirty_layer <= batch.last_dirty_layer)
+  {
+    const int layers = batch.last_dirty_layer - batch.first_dirty_layer + 1;
+    const int rows = batch.last_dirty_row - batch.first_dirty_row + 1;
+    const int offset = batch.first_dirty_layer * console_layer_cells + batch.first_dirty_row * console_columns;
+
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, console_rows);
+
+    selectTexture(batch.map_texture_unit, batch.map_texture, GL_TEXTURE_2D_ARRAY);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, batch.first_dirty_row, batch.first_dirty_layer, console_columns, rows, layers,
+        GL_RED_INTEGER, GL_UNSIGNED_BYTE, batch.map + offset);
+
+    selectTexture(batch.attribute_texture_unit, batch.attribute_texture, GL_TEXTURE_2D_ARRAY);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, batch.first_dirty_row, batch.first_dirty_layer, console_columns, rows, layers,
+        GL_RED_INTEGER, GL_UNSIGNED_BYTE, batch.attributes + offset);
+
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+
+    batch.stats.uploaded_layers = layers;
+
+    clearDirtyBox();
+  }
+
+  if(batch.instances_dirty)
+  {
+    bindBuffer(GL_ARRAY_BUFFER, batch.instance_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, batch.instance_count * sizeof(ConsoleInstance), batch.instances);
+
+    batch.instances_dirty = false;
+  }
+
+  if(batch.palettes_dirty)
+  {
+    GLfloat palettes[console_palettes * 16 * 3];
+
+    for(int i = 0; i < console_palettes * 16 * 3; ++i) { palettes[i] = batch.palettes[i] / 255.0f; }
+
+    useProgram(batch.program);
+    setUniform3fv(batch.palettes_location, console_palettes * 16, palettes);
+
+    batch.palettes_dirty = false;
+  }
+}
+
+// --------------------------------
+
+void renderConsoles(int _width, int _height)
+{
+  ConsoleBatch& batch = console_batch;
+
+  if(!batch.instance_count || !batch.created || !texturesResident()) { return; }
+
+  useProgram(batch.program);
+  setUniform2f(batch.screen_size_location, _width, _height);
+
+  bindVertexArray(batch.vao);
+  bindTexture(batch.font_texture_unit, batch.font_texture, GL_TEXTURE_2D_ARRAY);
+  bindTexture(batch.map_texture_unit, batch.map_texture, GL_TEXTURE_2D_ARRAY);
+  bindTexture(batch.attribute_texture_unit, batch.attribute_texture, GL_TEXTURE_2D_ARRAY);
+
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch.instance_count);
+}
+
+// --------------------------------
+
+ConsoleStats consoleStats()
+{
+  return console_batch.stats;
+}
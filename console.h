@@ -0,0 +1,73 @@
+#ifndef _console_h_
+#define _console_h_
+
+#include <cstdint>
+#include <GLES3/gl3.h>
+
+// --------------------------------
+// Console batch
+//
+// Many small independent text consoles drawn with one instanced draw call.
+// Console n owns layer n of the map and attribute array textures and places
+// it anywhere on the display, with a font (a layer of the font array
+// texture) and a palette of its own. Edits from every console are uploaded
+// with one glTexSubImage3D per texture, so the CPU cost of a frame does not
+// grow with the number of consoles.
+//
+// Consoles use 8x8 cells, attributes as in the VPU: foreground palette index
+// in the low nibble, background in the high nibble.
+//
+// The program and the GL objects are made when the first console opens, so
+// a session without consoles never builds them.
+
+const int console_max = 64;
+const int console_columns = 64;        // Largest console, in cells
+const int console_rows = 32;
+const int console_fonts = 4;
+const int console_palettes = 8;
+
+// In an indexed display the console palettes are display palette entries
+// console_first_index onwards, palette after palette
+
+const int console_first_index = 16;
+
+struct ConsoleStats
+{
+  unsigned int open;
+  unsigned int uploaded_layers;        // In the last uploadConsoles()
+  unsigned int uncovered;              // Closes and moves, which leave what was drawn under a console showing
+};
+
+bool initConsoles(GLenum _font_texture_unit, GLenum _map_texture_unit, GLenum _attribute_texture_unit);
+void destroyConsoles();
+
+// Switches between writing colours and writing display palette indices
+
+bool setConsoleIndexed(bool _indexed);
+
+// Returns the console number, or -1 when all are in use or the size is out
+// of range. New consoles use font 0 and palette 0 and are cleared.
+
+int openConsole(int _x, int _y, int _columns, int _rows);
+void closeConsole(int _console);
+void moveConsole(int _console, int _x, int _y);
+void setConsoleStyle(int _console, int _font, int _palette);
+
+// Every font starts as the built-in font and every palette as black
+
+void setConsoleFont(int _font, const uint8_t* _font_ram);
+void setConsolePalette(int _palette, const uint8_t* _rgb);      // 16 RGB entries
+void copyConsolePalettes(uint8_t* _rgb);                        // All of them, console_palettes * 16 RGB entries
+bool consolePalettesChanged();                                  // Since the last call
+
+void clearConsole(int _console, uint8_t _attribute);
+void printConsole(int _console, int _x, int _y, const char* _text, uint8_t _attribute);   // ASCII, clipped to the row
+
+// Draws every open console into the bound framebuffer, in console order
+
+void uploadConsoles();
+void renderConsoles(int _width, int _height);
+
+ConsoleStats consoleStats();
+
+#endif
@@ -0,0 +1,546 @@
+#include <cstring>
+
+#include "cpu.h"
+
+// --------------------------------
+
+static uint8_t unmapped_read_page[256];
+static uint8_t unmapped_write_page[256];
+
+// --------------------------------
+
+void initCPU(CPU& _cpu)
+{
+  memset(unmapped_read_page, 0xFF, sizeof(unmapped_read_page));
+
+  memset(&_cpu, 0, sizeof(CPU));
+
+  unmapCPUMemory(_cpu, 0, 256);
+
+  _cpu.s = 0xFD;
+  _cpu.p = cpu_flag_u | cpu_flag_i;
+}
+
+// --------------------------------
+
+void resetCPU(CPU& _cpu)
+{
+  _cpu.a = 0;
+  _cpu.x = 0;
+  _cpu.y = 0;
+  _cpu.s = 0xFD;
+  _cpu.p = cpu_flag_u | cpu_flag_i;
+
+  _cpu.waiting = false;
+  _cpu.nmi = false;
+  _cpu.irq = false;
+
+  _cpu.pc = readCPUMemory(_cpu, 0xFFFC) | (readCPUMemory(_cpu, 0xFFFD) << 8);
+  _cpu.cycles += 7;
+}
+
+// --------------------------------
+
+void mapCPUMemory(CPU& _cpu, int _first_page, int _page_count, uint8_t* _memory, bool _writable)
+{
+  for(int i = 0; i < _page_count && _first_page + i < 256; ++i)
+  {
+    _cpu.read_pages[_first_page + i] = _memory + i * 256;
+    _cpu.write_pages[_first_page + i] = _writable ? _memory + i * 256 : unmapped_write_page;
+  }
+}
+
+// --------------------------------
+
+void unmapCPUMemory(CPU& _cpu, int _first_page, int _page_count)
+{
+  for(int i = 0; i < _page_count && _first_page + i < 256; ++i)
+  {
+    _cpu.read_pages[_first_page + i] = unmapped_read_page;
+    _cpu.write_pages[_first_page + i] = unmapped_write_page;
+  }
+}
+
+// --------------------------------
+
+uint8_t readCPUMemory(const CPU& _cpu, uint16_t _address)
+{
+  return _cpu.read_pages[_address >> 8][_address & 0xFF];
+}
+
+// --------------------------------
+
+void writeCPUMemory(CPU& _cpu, uint16_t _address, uint8_t _value)
+{
+  _cpu.write_pages[_address >> 8][_address & 0xFF] = _value;
+  _cpu.written_pages[_address >> 8] = 1;
+}
+
+// --------------------------------
+
+void triggerNMI(CPU& _cpu)
+{
+  _cpu.nmi = true;
+}
+
+// --------------------------------
+
+void setIRQ(CPU& _cpu, bool _active)
+{
+  _cpu.irq = _active;
+}
+
+// --------------------------------
+
+static void interrupt(CPU& _cpu, uint16_t _vector)
+{
+  writeCPUMemory(_cpu, 0x100 | _cpu.s--, _cpu.pc >> 8);
+  writeCPUMemory(_cpu, 0x100 | _cpu.s--, _cpu.pc & 0xFF);
+  writeCPUMemory(_cpu, 0x100 | _cpu.s--, (_cpu.p & ~cpu_flag_b) | cpu_flag_u);
+
+  _cpu.p |= cpu_flag_i;
+  _cpu.pc = readCPUMemory(_cpu, _vector) | (readCPUMemory(_cpu, _vector + 1) << 8);
+  _cpu.waiting = false;
+}
+
+// --------------------------------
+
+// With GCC and Clang each handler jumps straight to the next one through a
+// table of label addresses (threaded dispatch), which avoids the shared
+// bounds-checked jump of a switch and gives the branch predictor one
+// indirect jump per handler. Other compilers get the equivalent switch.
+
+#if defined(__GNUC__)
+#define CPU_THREADED_DISPATCH 1
+#endif
+
+#define READ(address)         read_pages[(uint16_t)(address) >> 8][(uint8_t)(address)]
+#define READ16(address)       (READ(address) | (READ((uint16_t)((address) + 1)) << 8))
+#define WRITE(address, value) do { const uint16_t w = (address); write_pages[w >> 8][w & 0xFF] = (value); written_pages[w >> 8] = 1; } while(0)
+
+#define PUSH(value)           do { write_pages[1][s--] = (value); written_pages[1] = 1; } while(0)
+#define PULL()                read_pages[1][++s]
+
+#define SET_NZ(value)         n = z = (value)
+
+#define AM_IMM    ea = pc++;
+#define AM_ZP     ea = READ(pc); ++pc;
+#define AM_ZPX    ea = (uint8_t)(READ(pc) + x); ++pc;
+#define AM_ZPY    ea = (uint8_t)(READ(pc) + y); ++pc;
+#define AM_ABS    ea = READ16(pc); pc += 2;
+#define AM_ABX    base = READ16(pc); pc += 2; ea = base + x; if((base ^ ea) & 0xFF00) { --budget; }
+#define AM_ABY    base = READ16(pc); pc += 2; ea = base + y; if((base ^ ea) & 0xFF00) { --budget; }
+#define AM_ABX_W  ea = READ16(pc) + x; pc += 2;
+#define AM_ABY_W  ea = READ16(pc) + y; pc += 2;
+#define AM_INX    zp = READ(pc) + x; ++pc; ea = READ(zp) | (READ((uint8_t)(zp + 1)) << 8);
+#define AM_INY    zp = READ(pc); ++pc; base = READ(zp) | (READ((uint8_t)(zp + 1)) << 8); ea = base + y; if((base ^ ea) & 0xFF00) { --budget; }
+#define AM_INY_W  zp = READ(pc); ++pc; ea = (READ(zp) | (READ((uint8_t)(zp + 1)) << 8)) + y;
+
+#define BRANCH(condition) \
+  if(condition) \
+  { \
+    const uint16_t target = pc + 1 + (int8_t)READ(pc); \
+    budget -= (((pc + 1) ^ target) & 0xFF00) ? 2 : 1; \
+    pc = target; \
+  } \
+  else \
+  { \
+    ++pc; \
+  }
+
+#if CPU_THREADED_DISPATCH
+#define CASE(opcode)      op_##opcode:
+#define CASE_ILLEGAL      op_illegal:
+#define NEXT(cycles)      budget -= (cycles); if(budget <= 0) { goto done; } opcode = READ(pc); ++pc; goto *dispatch_table[opcode]
+#else
+#define CASE(opcode)      case 0x##opcode:
+#define CASE_ILLEGAL      default:
+#define NEXT(cycles)      budget -= (cycles); continue
+#endif
+
+// --------------------------------
+
+int runCPU(CPU& _cpu, int _cycles)
+{
+  if(_cpu.nmi)
+  {
+    _cpu.nmi = false;
+    interrupt(_cpu, 0xFFFA);
+    _cpu.cycles += 7;
+  }
+  else if(_cpu.irq && !(_cpu.p & cpu_flag_i))
+  {
+    interrupt(_cpu, 0xFFFE);
+    _cpu.cycles += 7;
+  }
+  else if(_cpu.waiting)
+  {
+    return 0;
+  }
+
+  // Registers live in locals so the compiler can keep them in host registers.
+  // N and Z are kept as the value they were derived from.
+
+  uint8_t* const* read_pages = _cpu.read_pages;
+  uint8_t* const* write_pages = _cpu.write_pages;
+  uint8_t* written_pages = _cpu.written_pages;
+
+  uint16_t pc = _cpu.pc;
+  uint8_t  a = _cpu.a;
+  uint8_t  x = _cpu.x;
+  uint8_t  y = _cpu.y;
+  uint8_t  s = _cpu.s;
+
+  uint8_t  n = _cpu.p & cpu_flag_n;
+  uint8_t  z = !(_cpu.p & cpu_flag_z);
+  uint8_t  c = (_cpu.p & cpu_flag_c) != 0;
+  uint8_t  v = (_cpu.p & cpu_flag_v) != 0;
+  uint8_t  d = (_cpu.p & cpu_flag_d) != 0;
+  uint8_t  i = (_cpu.p & cpu_flag_i) != 0;
+
+  int      budget = _cycles;
+  uint8_t  opcode;
+  uint16_t ea;
+  uint16_t base;
+  uint8_t  zp;
+
+  auto packFlags = [&]() -> uint8_t
+  {
+    return (n & 0x80) | (v << 6) | cpu_flag_u | (d << 3) | (i << 2) | ((z == 0) << 1) | c;
+  };
+
+  auto unpackFlags = [&](uint8_t _p)
+  {
+    n = _p & cpu_flag_n;
+    z = !(_p & cpu_flag_z);
+    c = (_p & cpu_flag_c) != 0;
+    v = (_p & cpu_flag_v) != 0;
+    d = (_p & cpu_flag_d) != 0;
+    i = (_p & cpu_flag_i) != 0;
+  };
+
+  auto adc = [&](uint8_t _m)
+  {
+    const unsigned int sum = a + _m + c;
+
+    if(d)
+    {
+      unsigned int lo = (a & 0x0F) + (_m & 0x0F) + c;
+      unsigned int hi = (a & 0xF0) + (_m & 0xF0);
+
+      if(lo > 0x09) { lo += 0x06; }
+      if(lo > 0x0F) { hi += 0x10; }
+
+      v = (~(a ^ _m) & (a ^ hi) & 0x80) != 0;
+
+      if(hi > 0x90) { hi += 0x60; }
+
+      c = hi > 0xFF;
+      z = (uint8_t)sum;
+      a = (hi & 0xF0) | (lo & 0x0F);
+      n = a;
+    }
+    else
+    {
+      v = (~(a ^ _m) & (a ^ sum) & 0x80) != 0;
+      c = sum > 0xFF;
+      a = sum;
+      SET_NZ(a);
+    }
+  };
+
+  auto sbc = [&](uint8_t _m)
+  {
+    const unsigned int difference = a - _m - (1 - c);
+
+    v = ((a ^ _m) & (a ^ difference) & 0x80) != 0;
+
+    if(d)
+    {
+      int lo = (a & 0x0F) - (_m & 0x0F) - (1 - c);
+      int hi = (a & 0xF0) - (_m & 0xF0);
+
+      if(lo < 0) { lo -= 0x06; hi -= 0x10; }
+      if(hi < 0) { hi -= 0x60; }
+
+      c = difference < 0x100;
+      a = (hi & 0xF0) | (lo & 0x0F);
+      SET_NZ((uint8_t)difference);
+    }
+    else
+    {
+      c = difference < 0x100;
+      a = difference;
+      SET_NZ(a);
+    }
+  };
+
+  auto compare = [&](uint8_t _r, uint8_t _m)
+  {
+    c = _r >= _m;
+    SET_NZ((uint8_t)(_r - _m));
+  };
+
+  auto inc = [&](uint8_t _m) -> uint8_t { ++_m; SET_NZ(_m); return _m; };
+  auto dec = [&](uint8_t _m) -> uint8_t { --_m; SET_NZ(_m); return _m; };
+  auto asl = [&](uint8_t _m) -> uint8_t { c = _m >> 7; _m <<= 1; SET_NZ(_m); return _m; };
+  auto lsr = [&](uint8_t _m) -> uint8_t { c = _m & 1; _m >>= 1; SET_NZ(_m); return _m; };
+  auto rol = [&](uint8_t _m) -> uint8_t { const uint8_t r = (_m << 1) | c; c = _m >> 7; SET_NZ(r); return r; };
+  auto ror = [&](uint8_t _m) -> uint8_t { const uint8_t r = (_m >> 1) | (c << 7); c = _m & 1; SET_NZ(r); return r; };
+
+#if CPU_THREADED_DISPATCH
+  static const void* const dispatch_table[256] =
+  {
+    &&op_00, &&op_01, &&op_illegal, &&op_illegal, &&op_illegal, &&op_05, &&op_06, &&op_illegal, &&op_08, &&op_09, &&op_0A, &&op_illegal, &&op_illegal, &&op_0D, &&op_0E, &&op_illegal,
+    &&op_10, &&op_11, &&op_illegal, &&op_illegal, &&op_illegal, &&op_15, &&op_16, &&op_illegal, &&op_18, &&op_19, &&op_illegal, &&op_illegal, &&op_illegal, &&op_1D, &&op_1E, &&op_illegal,
+    &&op_20, &&op_21, &&op_illegal, &&op_illegal, &&op_24, &&op_25, &&op_26, &&op_illegal, &&op_28, &&op_29, &&op_2A, &&op_illegal, &&op_2C, &&op_2D, &&op_2E, &&op_illegal,
+    &&op_30, &&op_31, &&op_illegal, &&op_illegal, &&op_illegal, &&op_35, &&op_36, &&op_illegal, &&op_38, &&op_39, &&op_illegal, &&op_illegal, &&op_illegal, &&op_3D, &&op_3E, &&op_illegal,
+    &&op_40, &&op_41, &&op_illegal, &&op_illegal, &&op_illegal, &&op_45, &&op_46, &&op_illegal, &&op_48, &&op_49, &&op_4A, &&op_illegal, &&op_4C, &&op_4D, &&op_4E, &&op_illegal,
+    &&op_50, &&op_51, &&op_illegal, &&op_illegal, &&op_illegal, &&op_55, &&op_56, &&op_illegal, &&op_58, &&op_59, &&op_illegal, &&op_illegal, &&op_illegal, &&op_5D, &&op_5E, &&op_illegal,
+    &&op_60, &&op_61, &&op_illegal, &&op_illegal, &&op_illegal, &&op_65, &&op_66, &&op_illegal, &&op_68, &&op_69, &&op_6A, &&op_illegal, &&op_6C, &&op_6D, &&op_6E, &&op_illegal,
+    &&op_70, &&op_71, &&op_illegal, &&op_illegal, &&op_illegal, &&op_75, &&op_76, &&op_illegal, &&op_78, &&op_79, &&op_illegal, &&op_illegal, &&op_illegal, &&op_7D, &&op_7E, &&op_illegal,
+    &&op_illegal, &&op_81, &&op_illegal, &&op_illegal, &&op_84, &&op_85, &&op_86, &&op_illegal, &&op_88, &&op_illegal, &&op_8A, &&op_illegal, &&op_8C, &&op_8D, &&op_8E, &&op_illegal,
+    &&op_90, &&op_91, &&op_illegal, &&op_illegal, &&op_94, &&op_95, &&op_96, &&op_illegal, &&op_98, &&op_99, &&op_9A, &&op_illegal, &&op_illegal, &&op_9D, &&op_illegal, &&op_illegal,
+    &&op_A0, &&op_A1, &&op_A2, &&op_illegal, &&op_A4, &&op_A5, &&op_A6, &&op_illegal, &&op_A8, &&op_A9, &&op_AA, &&op_illegal, &&op_AC, &&op_AD, &&op_AE, &&op_illegal,
+    &&op_B0, &&op_B1, &&op_illegal, &&op_illegal, &&op_B4, &&op_B5, &&op_B6, &&op_illegal, &&op_B8, &&op_B9, &&op_BA, &&op_illegal, &&op_BC, &&op_BD, &&op_BE, &&op_illegal,
+    &&op_C0, &&op_C1, &&op_illegal, &&op_illegal, &&op_C4, &&op_C5, &&op_C6, &&op_illegal, &&op_C8, &&op_C9, &&op_CA, &&op_CB, &&op_CC, &&op_CD, &&op_CE, &&op_illegal,
+    &&op_D0, &&op_D1, &&op_illegal, &&op_illegal, &&op_illegal, &&op_D5, &&op_D6, &&op_illegal, &&op_D8, &&op_D9, &&op_illegal, &&op_illegal, &&op_illegal, &&op_DD, &&op_DE, &&op_illegal,
+    &&op_E0, &&op_E1, &&op_illegal, &&op_illegal, &&op_E4, &&op_E5, &&op_E6, &&op_illegal, &&op_E8, &&op_E9, &&op_EA, &&op_illegal, &&op_EC, &&op_ED, &&op_EE, &&op_illegal,
+    &&op_F0, &&op_F1, &&op_illegal, &&op_illegal, &&op_illegal, &&op_F5, &&op_F6, &&op_illegal, &&op_F8, &&op_F9, &&op_illegal, &&op_illegal, &&op_illegal, &&op_FD, &&op_FE, &&op_illegal
+  };
+
+  if(budget <= 0) { goto done; }
+
+  opcode = READ(pc);
+  ++pc;
+  goto *dispatch_table[opcode];
+#else
+  while(budget > 0)
+  {
+    opcode = READ(pc);
+    ++pc;
+
+    switch(opcode)
+#endif
+    {
+      // Loads and stores
+
+      CASE(A9) AM_IMM   a = READ(ea); SET_NZ(a); NEXT(2);
+      CASE(A5) AM_ZP    a = READ(ea); SET_NZ(a); NEXT(3);
+      CASE(B5) AM_ZPX   a = READ(ea); SET_NZ(a); NEXT(4);
+      CASE(AD) AM_ABS   a = READ(ea); SET_NZ(a); NEXT(4);
+      CASE(BD) AM_ABX   a = READ(ea); SET_NZ(a); NEXT(4);
+      CASE(B9) AM_ABY   a = READ(ea); SET_NZ(a); NEXT(4);
+      CASE(A1) AM_INX   a = READ(ea); SET_NZ(a); NEXT(6);
+      CASE(B1) AM_INY   a = READ(ea); SET_NZ(a); NEXT(5);
+
+      CASE(A2) AM_IMM   x = READ(ea); SET_NZ(x); NEXT(2);
+      CASE(A6) AM_ZP    x = READ(ea); SET_NZ(x); NEXT(3);
+      CASE(B6) AM_ZPY   x = READ(ea); SET_NZ(x); NEXT(4);
+      CASE(AE) AM_ABS   x = READ(ea); SET_NZ(x); NEXT(4);
+      CASE(BE) AM_ABY   x = READ(ea); SET_NZ(x); NEXT(4);
+
+      CASE(A0) AM_IMM   y = READ(ea); SET_NZ(y); NEXT(2);
+      CASE(A4) AM_ZP    y = READ(ea); SET_NZ(y); NEXT(3);
+      CASE(B4) AM_ZPX   y = READ(ea); SET_NZ(y); NEXT(4);
+      CASE(AC) AM_ABS   y = READ(ea); SET_NZ(y); NEXT(4);
+      CASE(BC) AM_ABX   y = READ(ea); SET_NZ(y); NEXT(4);
+
+      CASE(85) AM_ZP    WRITE(ea, a); NEXT(3);
+      CASE(95) AM_ZPX   WRITE(ea, a); NEXT(4);
+      CASE(8D) AM_ABS   WRITE(ea, a); NEXT(4);
+      CASE(9D) AM_ABX_W WRITE(ea, a); NEXT(5);
+      CASE(99) AM_ABY_W WRITE(ea, a); NEXT(5);
+      CASE(81) AM_INX   WRITE(ea, a); NEXT(6);
+      CASE(91) AM_INY_W WRITE(ea, a); NEXT(6);
+
+      CASE(86) AM_ZP    WRITE(ea, x); NEXT(3);
+      CASE(96) AM_ZPY   WRITE(ea, x); NEXT(4);
+      CASE(8E) AM_ABS   WRITE(ea, x); NEXT(4);
+
+      CASE(84) AM_ZP    WRITE(ea, y); NEXT(3);
+      CASE(94) AM_ZPX   WRITE(ea, y); NEXT(4);
+      CASE(8C) AM_ABS   WRITE(ea, y); NEXT(4);
+
+      // Register transfers
+
+      CASE(AA) x = a; SET_NZ(x); NEXT(2);
+      CASE(A8) y = a; SET_NZ(y); NEXT(2);
+      CASE(8A) a = x; SET_NZ(a); NEXT(2);
+      CASE(98) a = y; SET_NZ(a); NEXT(2);
+      CASE(BA) x = s; SET_NZ(x); NEXT(2);
+      CASE(9A) s = x; NEXT(2);
+
+      // Stack
+
+      CASE(48) PUSH(a); NEXT(3);
+      CASE(08) PUSH(packFlags() | cpu_flag_b); NEXT(3);
+      CASE(68) a = PULL(); SET_NZ(a); NEXT(4);
+      CASE(28) unpackFlags(PULL()); NEXT(4);
+
+      // Logic and arithmetic
+
+      CASE(09) AM_IMM   a |= READ(ea); SET_NZ(a); NEXT(2);
+      CASE(05) AM_ZP    a |= READ(ea); SET_NZ(a); NEXT(3);
+      CASE(15) AM_ZPX   a |= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(0D) AM_ABS   a |= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(1D) AM_ABX   a |= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(19) AM_ABY   a |= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(01) AM_INX   a |= READ(ea); SET_NZ(a); NEXT(6);
+      CASE(11) AM_INY   a |= READ(ea); SET_NZ(a); NEXT(5);
+
+      CASE(29) AM_IMM   a &= READ(ea); SET_NZ(a); NEXT(2);
+      CASE(25) AM_ZP    a &= READ(ea); SET_NZ(a); NEXT(3);
+      CASE(35) AM_ZPX   a &= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(2D) AM_ABS   a &= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(3D) AM_ABX   a &= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(39) AM_ABY   a &= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(21) AM_INX   a &= READ(ea); SET_NZ(a); NEXT(6);
+      CASE(31) AM_INY   a &= READ(ea); SET_NZ(a); NEXT(5);
+
+      CASE(49) AM_IMM   a ^= READ(ea); SET_NZ(a); NEXT(2);
+      CASE(45) AM_ZP    a ^= READ(ea); SET_NZ(a); NEXT(3);
+      CASE(55) AM_ZPX   a ^= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(4D) AM_ABS   a ^= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(5D) AM_ABX   a ^= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(59) AM_ABY   a ^= READ(ea); SET_NZ(a); NEXT(4);
+      CASE(41) AM_INX   a ^= READ(ea); SET_NZ(a); NEXT(6);
+      CASE(51) AM_INY   a ^= READ(ea); SET_NZ(a); NEXT(5);
+
+      CASE(69) AM_IMM   adc(READ(ea)); NEXT(2);
+      CASE(65) AM_ZP    adc(READ(ea)); NEXT(3);
+      CASE(75) AM_ZPX   adc(READ(ea)); NEXT(4);
+      CASE(6D) AM_ABS   adc(READ(ea)); NEXT(4);
+      CASE(7D) AM_ABX   adc(READ(ea)); NEXT(4);
+      CASE(79) AM_ABY   adc(READ(ea)); NEXT(4);
+      CASE(61) AM_INX   adc(READ(ea)); NEXT(6);
+      CASE(71) AM_INY   adc(READ(ea)); NEXT(5);
+
+      CASE(E9) AM_IMM   sbc(READ(ea)); NEXT(2);
+      CASE(E5) AM_ZP    sbc(READ(ea)); NEXT(3);
+      CASE(F5) AM_ZPX   sbc(READ(ea)); NEXT(4);
+      CASE(ED) AM_ABS   sbc(READ(ea)); NEXT(4);
+      CASE(FD) AM_ABX   sbc(READ(ea)); NEXT(4);
+      CASE(F9) AM_ABY   sbc(READ(ea)); NEXT(4);
+      CASE(E1) AM_INX   sbc(READ(ea)); NEXT(6);
+      CASE(F1) AM_INY   sbc(READ(ea)); NEXT(5);
+
+      CASE(C9) AM_IMM   compare(a, READ(ea)); NEXT(2);
+      CASE(C5) AM_ZP    compare(a, READ(ea)); NEXT(3);
+      CASE(D5) AM_ZPX   compare(a, READ(ea)); NEXT(4);
+      CASE(CD) AM_ABS   compare(a, READ(ea)); NEXT(4);
+      CASE(DD) AM_ABX   compare(a, READ(ea)); NEXT(4);
+      CASE(D9) AM_ABY   compare(a, READ(ea)); NEXT(4);
+      CASE(C1) AM_INX   compare(a, READ(ea)); NEXT(6);
+      CASE(D1) AM_INY   compare(a, READ(ea)); NEXT(5);
+
+      CASE(E0) AM_IMM   compare(x, READ(ea)); NEXT(2);
+      CASE(E4) AM_ZP    compare(x, READ(ea)); NEXT(3);
+      CASE(EC) AM_ABS   compare(x, READ(ea)); NEXT(4);
+
+      CASE(C0) AM_IMM   compare(y, READ(ea)); NEXT(2);
+      CASE(C4) AM_ZP    compare(y, READ(ea)); NEXT(3);
+      CASE(CC) AM_ABS   compare(y, READ(ea)); NEXT(4);
+
+      CASE(24) AM_ZP    { const uint8_t m = READ(ea); z = a & m; n = m; v = (m >> 6) & 1; } NEXT(3);
+      CASE(2C) AM_ABS   { const uint8_t m = READ(ea); z = a & m; n = m; v = (m >> 6) & 1; } NEXT(4);
+
+      // Increments and decrements
+
+      CASE(E6) AM_ZP    WRITE(ea, inc(READ(ea))); NEXT(5);
+      CASE(F6) AM_ZPX   WRITE(ea, inc(READ(ea))); NEXT(6);
+      CASE(EE) AM_ABS   WRITE(ea, inc(READ(ea))); NEXT(6);
+      CASE(FE) AM_ABX_W WRITE(ea, inc(READ(ea))); NEXT(7);
+
+      CASE(C6) AM_ZP    WRITE(ea, dec(READ(ea))); NEXT(5);
+      CASE(D6) AM_ZPX   WRITE(ea, dec(READ(ea))); NEXT(6);
+      CASE(CE) AM_ABS   WRITE(ea, dec(READ(ea))); NEXT(6);
+      CASE(DE) AM_ABX_W WRITE(ea, dec(READ(ea))); NEXT(7);
+
+      CASE(E8) ++x; SET_NZ(x); NEXT(2);
+      CASE(C8) ++y; SET_NZ(y); NEXT(2);
+      CASE(CA) --x; SET_NZ(x); NEXT(2);
+      CASE(88) --y; SET_NZ(y); NEXT(2);
+
+      // Shifts and rotates
+
+      CASE(0A) a = asl(a); NEXT(2);
+      CASE(06) AM_ZP    WRITE(ea, asl(READ(ea))); NEXT(5);
+      CASE(16) AM_ZPX   WRITE(ea, asl(READ(ea))); NEXT(6);
+      CASE(0E) AM_ABS   WRITE(ea, asl(READ(ea))); NEXT(6);
+      CASE(1E) AM_ABX_W WRITE(ea, asl(READ(ea))); NEXT(7);
+
+      CASE(4A) a = lsr(a); NEXT(2);
+      CASE(46) AM_ZP    WRITE(ea, lsr(READ(ea))); NEXT(5);
+      CASE(56) AM_ZPX   WRITE(ea, lsr(READ(ea))); NEXT(6);
+      CASE(4E) AM_ABS   WRITE(ea, lsr(READ(ea))); NEXT(6);
+      CASE(5E) AM_ABX_W WRITE(ea, lsr(READ(ea))); NEXT(7);
+
+      CASE(2A) a = rol(a); NEXT(2);
+      CASE(26) AM_ZP    WRITE(ea, rol(READ(ea))); NEXT(5);
+      CASE(36) AM_ZPX   WRITE(ea, rol(READ(ea))); NEXT(6);
+      CASE(2E) AM_ABS   WRITE(ea, rol(READ(ea))); NEXT(6);
+      CASE(3E) AM_ABX_W WRITE(ea, rol(READ(ea))); NEXT(7);
+
+      CASE(6A) a = ror(a); NEXT(2);
+      CASE(66) AM_ZP    WRITE(ea, ror(READ(ea))); NEXT(5);
+      CASE(76) AM_ZPX   WRITE(ea, ror(READ(ea))); NEXT(6);
+      CASE(6E) AM_ABS   WRITE(ea, ror(READ(ea))); NEXT(6);
+      CASE(7E) AM_ABX_W WRITE(ea, ror(READ(ea))); NEXT(7);
+
+      // Jumps and branches
+
+      CASE(4C) pc = READ16(pc); NEXT(3);
+      CASE(6C) base = READ16(pc); pc = READ(base) | (READ((base & 0xFF00) | (uint8_t)(base + 1)) << 8); NEXT(5);
+
+      CASE(20) ea = READ16(pc); ++pc; PUSH(pc >> 8); PUSH(pc & 0xFF); pc = ea; NEXT(6);
+      CASE(60) pc = PULL(); pc |= PULL() << 8; ++pc; NEXT(6);
+
+      CASE(00) ++pc; PUSH(pc >> 8); PUSH(pc & 0xFF); PUSH(packFlags() | cpu_flag_b); i = 1; pc = READ16(0xFFFE); NEXT(7);
+      CASE(40) unpackFlags(PULL()); pc = PULL(); pc |= PULL() << 8; NEXT(6);
+
+      CASE(10) BRANCH(!(n & 0x80)); NEXT(2);
+      CASE(30) BRANCH(n & 0x80);    NEXT(2);
+      CASE(50) BRANCH(!v);          NEXT(2);
+      CASE(70) BRANCH(v);           NEXT(2);
+      CASE(90) BRANCH(!c);          NEXT(2);
+      CASE(B0) BRANCH(c);           NEXT(2);
+      CASE(D0) BRANCH(z != 0);      NEXT(2);
+      CASE(F0) BRANCH(z == 0);      NEXT(2);
+
+      // Flags
+
+      CASE(18) c = 0; NEXT(2);
+      CASE(38) c = 1; NEXT(2);
+      CASE(58) i = 0; NEXT(2);
+      CASE(78) i = 1; NEXT(2);
+      CASE(B8) v = 0; NEXT(2);
+      CASE(D8) d = 0; NEXT(2);
+      CASE(F8) d = 1; NEXT(2);
+
+      CASE(EA) NEXT(2);
+
+      // 65C02 WAI: idle until the next interrupt
+
+      CASE(CB) _cpu.waiting = true; budget -= 3; goto done;
+
+      CASE_ILLEGAL NEXT(2);
+    }
+#if !CPU_THREADED_DISPATCH
+  }
+#endif
+
+done:
+  _cpu.pc = pc;
+  _cpu.a = a;
+  _cpu.x = x;
+  _cpu.y = y;
+  _cpu.s = s;
+  _cpu.p = packFlags();
+
+  _cpu.cycles += _cycles - budget;
+
+  return _cycles - budget;
+}
+
+// --------------------------------
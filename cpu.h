@@ -0,0 +1,66 @@
+#ifndef _cpu_h_
+#define _cpu_h_
+
+#include <cstdint>
+
+// --------------------------------
+// 6502 CPU core
+//
+// All documented NMOS 6502 instructions plus the 65C02 WAI instruction, which
+// idles the CPU until the next interrupt. Undocumented opcodes execute as
+// 1 byte, 2 cycle NOPs.
+//
+// Memory is mapped in 256 byte pages straight onto host buffers. Unmapped
+// pages read as 0xFF and ignore writes. Every write marks its page in
+// written_pages so the host can pick up changes to mapped buffers.
+//
+// Interrupts are sampled when runCPU() starts, so the host raises them
+// between time slices (e.g. NMI at the start of each frame).
+
+struct CPU
+{
+  uint16_t pc;
+  uint8_t  a;
+  uint8_t  x;
+  uint8_t  y;
+  uint8_t  s;
+  uint8_t  p;
+
+  bool     waiting;
+  bool     nmi;
+  bool     irq;
+
+  uint64_t cycles;
+
+  uint8_t* read_pages[256];
+  uint8_t* write_pages[256];
+  uint8_t  written_pages[256];
+};
+
+const uint8_t cpu_flag_c = 0x01;
+const uint8_t cpu_flag_z = 0x02;
+const uint8_t cpu_flag_i = 0x04;
+const uint8_t cpu_flag_d = 0x08;
+const uint8_t cpu_flag_b = 0x10;
+const uint8_t cpu_flag_u = 0x20;
+const uint8_t cpu_flag_v = 0x40;
+const uint8_t cpu_flag_n = 0x80;
+
+void initCPU(CPU& _cpu);
+void resetCPU(CPU& _cpu);
+
+void mapCPUMemory(CPU& _cpu, int _first_page, int _page_count, uint8_t* _memory, bool _writable);
+void unmapCPUMemory(CPU& _cpu, int _first_page, int _page_count);
+
+uint8_t readCPUMemory(const CPU& _cpu, uint16_t _address);
+void writeCPUMemory(CPU& _cpu, uint16_t _address, uint8_t _value);
+
+void triggerNMI(CPU& _cpu);
+void setIRQ(CPU& _cpu, bool _active);
+
+// Runs until at least _cycles cycles have elapsed or the CPU waits for an
+// interrupt, and returns the number of cycles executed
+
+int runCPU(CPU& _cpu, int _cycles);
+
+#endif
@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "cpu.h"
+
+// --------------------------------
+// Emulated CPU speed on the host.
+//
+// Runs a mix of loads, stores, indexed and indirect addressing, arithmetic,
+// branches and subroutine calls in frame-sized time slices, the way the
+// machine runs guest code, and reports emulated MHz.
+//
+// g++ -O2 -std=c++11 cpu.cpp cpubench.cpp -o cpubench
+
+// --------------------------------
+
+uint8_t memory[65536];
+
+// Clears a 4 KB screen buffer at $C000, then sums it with (zp),Y and calls a
+// subroutine that does BCD arithmetic, forever
+
+const uint8_t program[] =
+{
+  0xA9, 0x00, 0x85, 0x10, 0xA9, 0xC0, 0x85, 0x11,   // $0400  LDA #$00; STA $10; LDA #$C0; STA $11
+  0xA2, 0x10, 0xA0, 0x00, 0x98,                     // $0408  LDX #$10; LDY #$00; TYA
+  0x91, 0x10, 0xC8, 0xD0, 0xFA,                     // $040D  STA ($10),Y; INY; BNE $040C
+  0xE6, 0x11, 0xCA, 0xD0, 0xF5,                     // $0412  INC $11; DEX; BNE $040C
+  0xA9, 0xC0, 0x85, 0x11, 0xA2, 0x10, 0x18,         // $0417  LDA #$C0; STA $11; LDX #$10; CLC
+  0xB1, 0x10, 0x65, 0x12, 0x85, 0x12, 0xC8,         // $041E  LDA ($10),Y; ADC $12; STA $12; INY
+  0xD0, 0xF7, 0xE6, 0x11, 0xCA, 0xD0, 0xF2,         // $0425  BNE $041E; INC $11; DEX; BNE $041E
+  0x20, 0x36, 0x04, 0x4C, 0x00, 0x04,               // $042C  JSR $0436; JMP $0400
+  0x00, 0x00, 0x00, 0x00,                           // $0432
+  0xF8, 0x18, 0xA5, 0x13, 0x69, 0x01, 0x85, 0x13,   // $0436  SED; CLC; LDA $13; ADC #$01; STA $13
+  0xD8, 0x60,                                       // $043E  CLD; RTS
+};
+
+// --------------------------------
+
+int main(int argc, char** argv)
+{
+  CPU cpu;
+
+  initCPU(cpu);
+  mapCPUMemory(cpu, 0, 256, memory, true);
+
+  memcpy(memory + 0x0400, program, sizeof(program));
+  memory[0xFFFC] = 0x00;
+  memory[0xFFFD] = 0x04;
+
+  resetCPU(cpu);
+
+  const int frame_cycles = 1000000 / 60;
+  const int frames = 60 * 200;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  uint64_t cycles = 0;
+
+  for(int frame = 0; frame < frames; ++frame)
+  {
+    cycles += runCPU(cpu, frame_cycles);
+  }
+
+  const auto end = std::chrono::steady_clock::now();
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  const double mhz = cycles / seconds / 1000000.0;
+
+  printf("%llu cycles in %.3f s\n", (unsigned long long)cycles, seconds);
+  printf("Emulated speed: %.1f MHz\n", mhz);
+  printf("Cycles per 60 Hz frame: %.0f\n", mhz * 1000000.0 / 60.0);
+
+  return 0;
+}
+
+// --------------------------------
@@ -1,19 +1,30 @@
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
 #include "font.h"
 #include "opengl.h"
 
 // --------------------------------
 
-const unsigned int font_bitmap[]=
+const unsigned int font_bitmap[builtin_glyph_count * 2]=
 {
   0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
   0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
   0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
   0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-  0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-  0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-  0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
-  0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+  0xFF000000, 0x000000FF, 0x18181818, 0x18181818, 0xF8000000, 0x181818F8, 0x1F000000, 0x1818181F,   // Box drawing
+  0xF8181818, 0x000000F8, 0x1F181818, 0x0000001F, 0xF8181818, 0x181818F8, 0x1F181818, 0x1818181F,
+  0xFF000000, 0x181818FF, 0xFF181818, 0x000000FF, 0xFF181818, 0x181818FF, 0xAA55AA55, 0xAA55AA55,
+  0xFFFFFFFF, 0xFFFFFFFF, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
 
   0x00000000, 0x00000000, 0x18181818, 0x00180018, 0x00363636, 0x00000000, 0x367F3636, 0x0036367F,   //  !"#
   0x3C067C18, 0x00183E60, 0x1B356600, 0x0033566C, 0x1C36361C, 0x00DC66B6, 0x000C1818, 0x00000000,   // $%&'
@@ -45,51 +56,209 @@ const unsigned int font_bitmap[]=
 
 // --------------------------------
 
-GLuint loadFont(GLenum _texture_unit)
+// The font_bitmap words are little endian, so their bytes are already the
+// glyph rows in font RAM order
+
+void copyBuiltinFont(unsigned char* _font_ram)
 {
-  unsigned char font_image[128 * 128] {};
-  const unsigned int* font_bitmap_ptr = font_bitmap;
+  memset(_font_ram, 0, font_ram_size);
+  memcpy(_font_ram, font_bitmap, sizeof(font_bitmap));
+}
+
+// --------------------------------
+
+const unsigned char* builtinGlyph(int _glyph)
+{
+  return (const unsigned char*)font_bitmap + _glyph * 8;
+}
 
-  for(uint32_t tile_counter = 0; tile_counter < 16 * 8; ++tile_counter)
+// --------------------------------
+
+// Each row byte is copied to all 8 bytes of a word and masked with bit n in
+// byte n, so a byte is non-zero exactly where its pixel is set
+
+const uint64_t glyph_row_spread = 0x0101010101010101ULL;
+const uint64_t glyph_row_bits   = 0x8040201008040201ULL;
+
+void expandGlyph(const unsigned char* _rows, unsigned char* _pixels)
+{
+#if defined(__wasm_simd128__)
+  const v128_t bits = wasm_i64x2_splat(glyph_row_bits);
+
+  for(int row = 0; row < 8; row += 2)
   {
-    const uint32_t tile_x = tile_counter & 0xF;
-    const uint32_t tile_y = tile_counter >> 4;
+    const v128_t spread = wasm_i64x2_make(_rows[row] * glyph_row_spread, _rows[row + 1] * glyph_row_spread);
+    wasm_v128_store(_pixels + row * 8, wasm_i8x16_eq(wasm_v128_and(spread, bits), bits));
+  }
+#elif defined(__SSE2__)
+  const __m128i bits = _mm_set1_epi64x(glyph_row_bits);
+
+  for(int row = 0; row < 8; row += 2)
+  {
+    const __m128i spread = _mm_set_epi64x(_rows[row + 1] * glyph_row_spread, _rows[row] * glyph_row_spread);
+    _mm_storeu_si128((__m128i*)(_pixels + row * 8), _mm_cmpeq_epi8(_mm_and_si128(spread, bits), bits));
+  }
+#else
+  for(int row = 0; row < 8; ++row)
+  {
+    for(int px = 0; px < 8; ++px) { _pixels[row * 8 + px] = (_rows[row] & (1U << px)) ? 0xFF : 0x00; }
+  }
+#endif
+}
+
+// --------------------------------
+
+// Glyphs are 8x8. Other cell sizes get them centred in the cell, cropped
+// symmetrically when the cell is narrower or shorter than 8 pixels.
+
+void drawGlyph(const unsigned char* _rows, unsigned char* _image, int _pitch, int _glyph_width, int _glyph_height)
+{
+  const int offset_x = (_glyph_width - 8) / 2;
+  const int offset_y = (_glyph_height - 8) / 2;
+
+  unsigned char pixels[64];
+  expandGlyph(_rows, pixels);
 
-    unsigned int font_bits = *font_bitmap_ptr++;
+  // Columns of the cell the glyph covers
 
-    for(uint32_t i = 0; i < 32; ++i)
+  const int first_x = offset_x > 0 ? offset_x : 0;
+  const int end_x = offset_x + 8 < _glyph_width ? offset_x + 8 : _glyph_width;
+
+  for(int py = 0; py < _glyph_height; ++py)
+  {
+    const int sy = py - offset_y;
+    unsigned char* row = _image + _pitch * py;
+
+    if(sy < 0 || sy >= 8)
     {
-      const uint32_t px = i & 0x7;
-      const uint32_t py = i >> 3;
-
-      if(font_bits & (1 << i))
-      {
-        font_image[128 * (tile_y * 8 + py) + (tile_x * 8 + px)] = 0xFF;
-      }
-      else
-      {
-        font_image[128 * (tile_y * 8 + py) + (tile_x * 8 + px)] = 0x00;
-      }
+      memset(row, 0, _glyph_width);
+      continue;
     }
 
-    font_bits = *font_bitmap_ptr++;
+    memset(row, 0, first_x);
+    memcpy(row + first_x, pixels + sy * 8 + first_x - offset_x, end_x - first_x);
+    memset(row + end_x, 0, _glyph_width - end_x);
+  }
+}
+
+// --------------------------------
+
+unsigned char* expandFont(const TextMode& _mode, const unsigned char* _font_ram, unsigned char* _image)
+{
+  const int atlas_width = fontAtlasWidth(_mode);
+  const int atlas_height = fontAtlasHeight(_mode);
+  const int glyph_count = font_ram_size / 8;
+
+  unsigned char* font_image = _image ? (unsigned char*)memset(_image, 0, atlas_width * atlas_height) : (unsigned char*)calloc(atlas_width * atlas_height, 1);
+
+  for(int glyph = 0; glyph < glyph_count && glyph < _mode.atlas_columns * _mode.atlas_rows; ++glyph)
+  {
+    const int tile_x = (glyph % _mode.atlas_columns) * _mode.glyph_width;
+    const int tile_y = (glyph / _mode.atlas_columns) * _mode.glyph_height;
+
+    drawGlyph(_font_ram + glyph * 8, font_image + atlas_width * tile_y + tile_x, atlas_width, _mode.glyph_width, _mode.glyph_height);
+  }
+
+  return font_image;
+}
+
+// --------------------------------
 
-    for(uint32_t i = 0; i < 32; ++i)
+GLuint loadFont(GLenum _texture_unit, const TextMode& _mode, const unsigned char* _font_ram)
+{
+  unsigned char* font_image = expandFont(_mode, _font_ram);
+
+  GLuint texture_id = createTexture(_texture_unit, fontAtlasWidth(_mode), fontAtlasHeight(_mode), font_image, GL_R8, GL_RED, GL_UNSIGNED_BYTE, GL_NEAREST, "font");
+
+  free(font_image);
+
+  return texture_id;
+}
+
+// --------------------------------
+
+void updateFont(GLenum _texture_unit, GLuint _texture_id, const TextMode& _mode, const unsigned char* _font_ram)
+{
+  unsigned char* font_image = expandFont(_mode, _font_ram, arenaArray<unsigned char>(frame_arena, fontAtlasWidth(_mode) * fontAtlasHeight(_mode)));
+
+  selectTexture(_texture_unit, _texture_id);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, fontAtlasWidth(_mode), fontAtlasHeight(_mode), GL_RED, GL_UNSIGNED_BYTE, font_image);
+}
+
+// --------------------------------
+
+int writeGlyphs(unsigned char* _font_ram, int _first_glyph, int _count, const unsigned char* _glyphs, uint64_t* _changed)
+{
+  int changed = 0;
+
+  for(int i = 0; i < _count; ++i)
+  {
+    const int glyph = _first_glyph + i;
+
+    if(!memcmp(_font_ram + glyph * 8, _glyphs + i * 8, 8)) { continue; }
+
+    memcpy(_font_ram + glyph * 8, _glyphs + i * 8, 8);
+    _changed[glyph >> 6] |= 1ULL << (glyph & 63);
+    ++changed;
+  }
+
+  return changed;
+}
+
+// --------------------------------
+
+// Adjacent changed glyphs in an atlas row go up as one strip
+
+int updateFontGlyphs(GLenum _texture_unit, GLuint _texture_id, const TextMode& _mode, const unsigned char* _font_ram, const uint64_t* _glyphs)
+{
+  const int glyph_count = std::min(font_ram_size / 8, _mode.atlas_columns * _mode.atlas_rows);
+
+  int changed = 0;
+
+  for(int glyph = 0; glyph < glyph_count; ++glyph)
+  {
+    if(glyphChanged(_glyphs, glyph)) { ++changed; }
+  }
+
+  if(!changed) { return 0; }
+
+  if(changed > glyph_count / 2)
+  {
+    updateFont(_texture_unit, _texture_id, _mode, _font_ram);
+    return changed;
+  }
+
+  unsigned char* strip = arenaArray<unsigned char>(frame_arena, fontAtlasWidth(_mode) * _mode.glyph_height);
+
+  selectTexture(_texture_unit, _texture_id);
+
+  for(int glyph = 0; glyph < glyph_count; ++glyph)
+  {
+    if(!_glyphs[glyph >> 6])
+    {
+      glyph |= 63;
+      continue;
+    }
+
+    if(!glyphChanged(_glyphs, glyph)) { continue; }
+
+    const int column = glyph % _mode.atlas_columns;
+
+    int end = glyph + 1;
+    while(end < glyph_count && end % _mode.atlas_columns && glyphChanged(_glyphs, end)) { ++end; }
+
+    const int width = (end - glyph) * _mode.glyph_width;
+
+    for(int i = glyph; i < end; ++i)
     {
-      const uint32_t px = i & 0x7;
-      const uint32_t py = (i >> 3) + 4;
-
-      if(font_bits & (1 << i))
-      {
-        font_image[128 * (tile_y * 8 + py) + (tile_x * 8 + px)] = 0xFF;
-      }
-      else
-      {
-        font_image[128 * (tile_y * 8 + py) + (tile_x * 8 + px)] = 0x00;
-      }
+      drawGlyph(_font_ram + i * 8, strip + (i - glyph) * _mode.glyph_width, width, _mode.glyph_width, _mode.glyph_height);
     }
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, column * _mode.glyph_width, (glyph / _mode.atlas_columns) * _mode.glyph_height, width, _mode.glyph_height,
+        GL_RED, GL_UNSIGNED_BYTE, strip);
+
+    glyph = end - 1;
   }
 
-  return createTexture(_texture_unit, 128, 128, font_image, GL_R8, GL_RED, GL_UNSIGNED_BYTE, GL_NEAREST);
+  return changed;
 }
-
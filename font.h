@@ -1,8 +1,81 @@
 #ifndef _font_h_
 #define _font_h_
 
+#include <cstdint>
+
 #include <GLES3/gl3.h>
 
-GLuint loadFont(GLenum _texture_unit);
+// Glyph cell size in pixels and the layout of glyph tiles in the font atlas.
+// A wide map holds 16-bit glyph cache slots instead of 8-bit glyph indices.
+
+struct TextMode
+{
+  int  glyph_width;
+  int  glyph_height;
+  int  atlas_columns;
+  int  atlas_rows;
+  bool wide_map;
+};
+
+const TextMode default_text_mode = { 8, 8, 16, 16, false };
+
+inline int fontAtlasWidth(const TextMode& _mode) { return _mode.atlas_columns * _mode.glyph_width; }
+inline int fontAtlasHeight(const TextMode& _mode) { return _mode.atlas_rows * _mode.glyph_height; }
+
+// Font RAM holds 256 8x8 glyphs in the packed font_bitmap layout: 8 bytes per
+// glyph, one byte per row, bit 0 is the leftmost pixel
+
+const int builtin_glyph_count = 128;
+
+// Box drawing glyphs of the built-in font, in the control code range
+
+const unsigned char glyph_box_horizontal   = 0x10;
+const unsigned char glyph_box_vertical     = 0x11;
+const unsigned char glyph_box_top_left     = 0x12;
+const unsigned char glyph_box_top_right    = 0x13;
+const unsigned char glyph_box_bottom_left  = 0x14;
+const unsigned char glyph_box_bottom_right = 0x15;
+const unsigned char glyph_box_tee_right    = 0x16;    // ├
+const unsigned char glyph_box_tee_left     = 0x17;    // ┤
+const unsigned char glyph_box_tee_down     = 0x18;    // ┬
+const unsigned char glyph_box_tee_up       = 0x19;    // ┴
+const unsigned char glyph_box_cross        = 0x1A;
+const unsigned char glyph_shade            = 0x1B;
+const unsigned char glyph_block            = 0x1C;
+const int font_ram_size = 256 * 8;
+
+void copyBuiltinFont(unsigned char* _font_ram);
+const unsigned char* builtinGlyph(int _glyph);
+
+// 64 pixels, 0xFF where set, with SSE2 or WebAssembly SIMD
+
+void expandGlyph(const unsigned char* _rows, unsigned char* _pixels);
+void drawGlyph(const unsigned char* _rows, unsigned char* _image, int _pitch, int _glyph_width, int _glyph_height);
+
+// Font RAM drawn into a font atlas image. Without _image a new one is
+// allocated, freed by the caller.
+
+unsigned char* expandFont(const TextMode& _mode, const unsigned char* _font_ram, unsigned char* _image = nullptr);
+
+GLuint loadFont(GLenum _texture_unit, const TextMode& _mode, const unsigned char* _font_ram);
+void updateFont(GLenum _texture_unit, GLuint _texture_id, const TextMode& _mode, const unsigned char* _font_ram);
+
+// Changed glyphs are tracked in a 256 bit mask, bit n of word n / 64 for
+// glyph n
+
+const int glyph_mask_words = font_ram_size / 8 / 64;
+
+inline bool glyphChanged(const uint64_t* _mask, int _glyph) { return (_mask[_glyph >> 6] >> (_glyph & 63)) & 1; }
+
+// Copies _count glyphs into font RAM from _first_glyph on, setting the bits
+// of the ones that differ in _changed. Returns how many differ.
+
+int writeGlyphs(unsigned char* _font_ram, int _first_glyph, int _count, const unsigned char* _glyphs, uint64_t* _changed);
+
+// Draws and uploads only the atlas tiles of the glyphs set in _glyphs, or
+// the whole atlas when more than half changed. Returns the number of glyphs
+// updated.
+
+int updateFontGlyphs(GLenum _texture_unit, GLuint _texture_id, const TextMode& _mode, const unsigned char* _font_ram, const uint64_t* _glyphs);
 
 #endif
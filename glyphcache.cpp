@@ -0,0 +1,680 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "glyphcache.h"
+#include "opengl.h"
+#include "trace.h"
+
+// --------------------------------
+
+// Glyph bitmaps of the loaded BDF/PSF font, one bit per pixel, MSB first,
+// every glyph padded to the font bounding box. bitmap_data points at
+// bitmaps, or straight into a PSF font in a mapped asset bundle.
+
+struct GlyphFont
+{
+  int width;
+  int height;
+  int row_bytes;
+
+  std::vector<uint8_t> bitmaps;
+  const uint8_t*       bitmap_data;
+  std::unordered_map<uint32_t, uint32_t> glyphs;    // Code point -> offset into bitmaps
+};
+
+GlyphFont glyph_font;
+
+// --------------------------------
+
+const uint16_t no_slot = 0xFFFF;
+const uint16_t first_dynamic_slot = builtin_glyph_count;
+const uint16_t replacement_slot = '?';
+
+struct GlyphSlot
+{
+  uint32_t codepoint;
+  uint16_t references;
+  uint16_t lru_prev;
+  uint16_t lru_next;
+};
+
+struct GlyphCache
+{
+  TextMode mode;
+  GLenum   texture_unit;
+  GLuint   texture;
+  int      atlas_width;
+  int      atlas_height;
+  int      slot_count;
+  int      next_free_slot;
+
+  uint16_t lru_head;    // Least recently released
+  uint16_t lru_tail;
+
+  std::vector<uint8_t>   atlas;
+  std::vector<GlyphSlot> slots;
+  std::vector<uint16_t>  pending_uploads;
+
+  std::unordered_map<uint32_t, uint16_t> resident;    // Code point -> slot
+
+  GlyphCacheStats stats;
+};
+
+GlyphCache glyph_cache;
+
+// --------------------------------
+
+static bool readFile(const char* _filename, std::vector<uint8_t>& _data)
+{
+  FILE* file = fopen(_filename, "rb");
+  if(!file) { return false; }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  _data.resize(size + 1);
+  bool ok = size > 0 && fread(_data.data(), 1, size, file) == (size_t)size;
+  _data[size] = 0;
+
+  fclose(file);
+
+  return ok;
+}
+
+// --------------------------------
+
+static uint8_t* addFontGlyph(uint32_t _codepoint)
+{
+  auto it = glyph_font.glyphs.find(_codepoint);
+  if(it != glyph_font.glyphs.end()) { return &glyph_font.bitmaps[it->second]; }
+
+  const uint32_t offset = glyph_font.bitmaps.size();
+
+  glyph_font.bitmaps.resize(offset + glyph_font.row_bytes * glyph_font.height, 0);
+  glyph_font.glyphs[_codepoint] = offset;
+
+  return &glyph_font.bitmaps[offset];
+}
+
+// --------------------------------
+
+static bool parseBDF(char* _text)
+{
+  int font_width = 0, font_height = 0, font_x = 0, font_y = 0;
+  int bbx_width = 0, bbx_height = 0, bbx_x = 0, bbx_y = 0;
+  long encoding = -1;
+  uint8_t* glyph = nullptr;
+  int row = -1;
+
+  for(char* line = strtok(_text, "\r\n"); line; line = strtok(nullptr, "\r\n"))
+  {
+    if(row >= 0)
+    {
+      if(strncmp(line, "ENDCHAR", 7) == 0) { row = -1; continue; }
+
+      const int y = (font_height + font_y) - (bbx_height + bbx_y) + row++;
+      if(!glyph || y < 0 || y >= font_height) { continue; }
+
+      const int bits = (int)strspn(line, "0123456789abcdefABCDEF") * 4;
+      if(bits == 0 || bits > 64) { continue; }
+
+      const unsigned long long row_bits = strtoull(line, nullptr, 16);
+
+      for(int px = 0; px < bbx_width && px < bits; ++px)
+      {
+        const int x = bbx_x - font_x + px;
+        if(x < 0 || x >= font_width) { continue; }
+
+        if((row_bits >> (bits - 1 - px)) & 1)
+        {
+          glyph[y * glyph_font.row_bytes + (x >> 3)] |= 0x80 >> (x & 7);
+        }
+      }
+    }
+    else if(sscanf(line, "FONTBOUNDINGBOX %d %d %d %d", &font_width, &font_height, &font_x, &font_y) == 4)
+    {
+      glyph_font.width = font_width;
+      glyph_font.height = font_height;
+      glyph_font.row_bytes = (font_width + 7) / 8;
+    }
+    else if(sscanf(line, "ENCODING %ld", &encoding) == 1) {}
+    else if(sscanf(line, "BBX %d %d %d %d", &bbx_width, &bbx_height, &bbx_x, &bbx_y) == 4) {}
+    else if(strncmp(line, "BITMAP", 6) == 0)
+    {
+      if(glyph_font.row_bytes == 0) { return false; }
+
+      glyph = encoding >= 0 ? addFontGlyph((uint32_t)encoding) : nullptr;
+      row = 0;
+    }
+  }
+
+  return !glyph_font.glyphs.empty();
+}
+
+// --------------------------------
+
+static bool parsePSF(const uint8_t* _data, size_t _size, bool _borrow)
+{
+  const uint8_t* data = _data;
+  const size_t size = _size;
+
+  uint32_t glyph_count = 0;
+  uint32_t glyph_bytes = 0;
+  uint32_t header_size = 0;
+  bool     has_table = false;
+  bool     psf1 = false;
+
+  if(size >= 4 && data[0] == 0x36 && data[1] == 0x04)
+  {
+    psf1 = true;
+    glyph_count = (data[2] & 0x01) ? 512 : 256;
+    has_table = (data[2] & 0x06) != 0;
+    glyph_bytes = data[3];
+    header_size = 4;
+
+    glyph_font.width = 8;
+    glyph_font.height = data[3];
+  }
+  else if(size >= 32 && data[0] == 0x72 && data[1] == 0xB5 && data[2] == 0x4A && data[3] == 0x86)
+  {
+    uint32_t header[8];
+    memcpy(header, data, sizeof(header));
+
+    header_size = header[2];
+    has_table = (header[3] & 0x01) != 0;
+    glyph_count = header[4];
+    glyph_bytes = header[5];
+
+    glyph_font.height = header[6];
+    glyph_font.width = header[7];
+  }
+  else
+  {
+    return false;
+  }
+
+  glyph_font.row_bytes = (glyph_font.width + 7) / 8;
+
+  if(glyph_bytes != (uint32_t)(glyph_font.row_bytes * glyph_font.height)) { return false; }
+  if(header_size + glyph_count * glyph_bytes > size) { return false; }
+
+  if(_borrow)
+  {
+    glyph_font.bitmap_data = data + header_size;
+  }
+  else
+  {
+    glyph_font.bitmaps.assign(data + header_size, data + header_size + glyph_count * glyph_bytes);
+    glyph_font.bitmap_data = glyph_font.bitmaps.data();
+  }
+
+  if(!has_table)
+  {
+    for(uint32_t i = 0; i < glyph_count; ++i) { glyph_font.glyphs[i] = i * glyph_bytes; }
+    return true;
+  }
+
+  // Unicode table: per glyph a list of code points, then sequences we skip,
+  // terminated by 0xFFFF (PSF1, UCS-2) or 0xFF (PSF2, UTF-8)
+
+  const uint8_t* table = data + header_size + glyph_count * glyph_bytes;
+  const uint8_t* end = data + size;
+
+  for(uint32_t i = 0; i < glyph_count && table < end; ++i)
+  {
+    bool sequence = false;
+
+    if(psf1)
+    {
+      for(; table + 1 < end; table += 2)
+      {
+        const uint16_t value = table[0] | (table[1] << 8);
+
+        if(value == 0xFFFF) { table += 2; break; }
+        if(value == 0xFFFE) { sequence = true; }
+        if(!sequence) { glyph_font.glyphs.emplace(value, i * glyph_bytes); }
+      }
+    }
+    else
+    {
+      while(table < end)
+      {
+        if(*table == 0xFF) { ++table; break; }
+        if(*table == 0xFE) { sequence = true; ++table; continue; }
+
+        const char* text = (const char*)table;
+        const uint32_t codepoint = decodeUTF8(text);
+        table = (const uint8_t*)text;
+
+        if(!sequence) { glyph_font.glyphs.emplace(codepoint, i * glyph_bytes); }
+      }
+    }
+  }
+
+  return true;
+}
+
+// --------------------------------
+
+bool loadGlyphFont(const char* _filename)
+{
+  std::vector<uint8_t> data;
+
+  if(!readFile(_filename, data))
+  {
+    printf("Failed to load glyph font %s\n", _filename);
+    return false;
+  }
+
+  glyph_font = GlyphFont();
+
+  bool ok = parsePSF(data.data(), data.size() - 1, false) || parseBDF((char*)data.data());
+
+  if(ok && !glyph_font.bitmap_data) { glyph_font.bitmap_data = glyph_font.bitmaps.data(); }
+
+  if(!ok)
+  {
+    printf("Unrecognised glyph font %s\n", _filename);
+    glyph_font = GlyphFont();
+    return false;
+  }
+
+  printf("Glyph font %s: %d x %d, %d glyphs\n", _filename, glyph_font.width, glyph_font.height, (int)glyph_font.glyphs.size());
+
+  return true;
+}
+
+// --------------------------------
+
+// The bitmaps are used in place, so _data must stay valid while the font is
+// loaded
+
+bool loadGlyphFontMemory(const uint8_t* _data, size_t _size)
+{
+  glyph_font = GlyphFont();
+
+  if(!parsePSF(_data, _size, true))
+  {
+    printf("Unrecognised glyph font\n");
+    glyph_font = GlyphFont();
+    return false;
+  }
+
+  printf("Glyph font: %d x %d, %d glyphs\n", glyph_font.width, glyph_font.height, (int)glyph_font.glyphs.size());
+
+  return true;
+}
+
+// --------------------------------
+
+static void appendUTF8(std::vector<uint8_t>& _data, uint32_t _codepoint)
+{
+  if(_codepoint < 0x80)
+  {
+    _data.push_back(_codepoint);
+  }
+  else if(_codepoint < 0x800)
+  {
+    _data.push_back(0xC0 | (_codepoint >> 6));
+    _data.push_back(0x80 | (_codepoint & 0x3F));
+  }
+  else if(_codepoint < 0x10000)
+  {
+    _data.push_back(0xE0 | (_codepoint >> 12));
+    _data.push_back(0x80 | ((_codepoint >> 6) & 0x3F));
+    _data.push_back(0x80 | (_codepoint & 0x3F));
+  }
+  else
+  {
+    _data.push_back(0xF0 | (_codepoint >> 18));
+    _data.push_back(0x80 | ((_codepoint >> 12) & 0x3F));
+    _data.push_back(0x80 | ((_codepoint >> 6) & 0x3F));
+    _data.push_back(0x80 | (_codepoint & 0x3F));
+  }
+}
+
+// --------------------------------
+
+// Writes the loaded font as PSF2 with a Unicode table, glyphs in code point
+// order
+
+bool exportGlyphFontPSF(std::vector<uint8_t>& _data)
+{
+  if(glyph_font.glyphs.empty()) { return false; }
+
+  // Glyphs shared by several code points are written once
+
+  std::vector<std::pair<uint32_t, uint32_t>> codepoints(glyph_font.glyphs.begin(), glyph_font.glyphs.end());
+  std::sort(codepoints.begin(), codepoints.end());
+
+  std::vector<uint32_t> offsets;
+  std::unordered_map<uint32_t, std::vector<uint32_t>> glyph_codepoints;    // Offset -> code points
+
+  for(const auto& codepoint : codepoints)
+  {
+    std::vector<uint32_t>& list = glyph_codepoints[codepoint.second];
+    if(list.empty()) { offsets.push_back(codepoint.second); }
+    list.push_back(codepoint.first);
+  }
+
+  const uint32_t glyph_bytes = glyph_font.row_bytes * glyph_font.height;
+  const uint32_t header[8] = { 0x864AB572, 0, 32, 0x01, (uint32_t)offsets.size(), glyph_bytes, (uint32_t)glyph_font.height, (uint32_t)glyph_font.width };
+
+  _data.assign((const uint8_t*)header, (const uint8_t*)header + sizeof(header));
+
+  for(uint32_t offset : offsets)
+  {
+    _data.insert(_data.end(), glyph_font.bitmap_data + offset, glyph_font.bitmap_data + offset + glyph_bytes);
+  }
+
+  for(uint32_t offset : offsets)
+  {
+    for(uint32_t codepoint : glyph_codepoints[offset]) { appendUTF8(_data, codepoint); }
+    _data.push_back(0xFF);
+  }
+
+  return true;
+}
+
+// --------------------------------
+
+// Font glyphs are centred in the cell and cropped like the built-in glyphs.
+// Code points the font does not have are drawn as an outlined box.
+
+static void rasteriseGlyph(uint16_t _slot, uint32_t _codepoint)
+{
+  const TextMode& mode = glyph_cache.mode;
+  const int pitch = glyph_cache.atlas_width;
+
+  uint8_t* tile = &glyph_cache.atlas[pitch * (_slot / mode.atlas_columns) * mode.glyph_height + (_slot % mode.atlas_columns) * mode.glyph_width];
+
+  for(int py = 0; py < mode.glyph_height; ++py) { memset(tile + pitch * py, 0, mode.glyph_width); }
+
+  auto it = glyph_font.glyphs.find(_codepoint);
+
+  if(it != glyph_font.glyphs.end())
+  {
+    const uint8_t* bitmap = glyph_font.bitmap_data + it->second;
+    const int offset_x = (mode.glyph_width - glyph_font.width) / 2;
+    const int offset_y = (mode.glyph_height - glyph_font.height) / 2;
+
+    for(int py = 0; py < mode.glyph_height; ++py)
+    {
+      const int sy = py - offset_y;
+      if(sy < 0 || sy >= glyph_font.height) { continue; }
+
+      for(int px = 0; px < mode.glyph_width; ++px)
+      {
+        const int sx = px - offset_x;
+        if(sx < 0 || sx >= glyph_font.width) { continue; }
+
+        if(bitmap[sy * glyph_font.row_bytes + (sx >> 3)] & (0x80 >> (sx & 7)))
+        {
+          tile[pitch * py + px] = 0xFF;
+        }
+      }
+    }
+  }
+  else if(_codepoint < builtin_glyph_count)
+  {
+    drawGlyph(builtinGlyph(_codepoint), tile, pitch, mode.glyph_width, mode.glyph_height);
+  }
+  else
+  {
+    for(int py = 1; py < mode.glyph_height - 1; ++py)
+    {
+      for(int px = 1; px < mode.glyph_width - 1; ++px)
+      {
+        const bool edge = py == 1 || py == mode.glyph_height - 2 || px == 1 || px == mode.glyph_width - 2;
+        if(edge) { tile[pitch * py + px] = 0xFF; }
+      }
+    }
+  }
+
+  glyph_cache.pending_uploads.push_back(_slot);
+}
+
+// --------------------------------
+
+static void lruRemove(uint16_t _slot)
+{
+  GlyphSlot& slot = glyph_cache.slots[_slot];
+
+  if(slot.lru_prev != no_slot) { glyph_cache.slots[slot.lru_prev].lru_next = slot.lru_next; }
+  else { glyph_cache.lru_head = slot.lru_next; }
+
+  if(slot.lru_next != no_slot) { glyph_cache.slots[slot.lru_next].lru_prev = slot.lru_prev; }
+  else { glyph_cache.lru_tail = slot.lru_prev; }
+
+  slot.lru_prev = slot.lru_next = no_slot;
+}
+
+// --------------------------------
+
+static void lruPushBack(uint16_t _slot)
+{
+  GlyphSlot& slot = glyph_cache.slots[_slot];
+
+  slot.lru_prev = glyph_cache.lru_tail;
+  slot.lru_next = no_slot;
+
+  if(glyph_cache.lru_tail != no_slot) { glyph_cache.slots[glyph_cache.lru_tail].lru_next = _slot; }
+  else { glyph_cache.lru_head = _slot; }
+
+  glyph_cache.lru_tail = _slot;
+}
+
+// --------------------------------
+
+GLuint initGlyphCache(GLenum _texture_unit, const TextMode& _mode)
+{
+  destroyGlyphCache();
+
+  GlyphCache& cache = glyph_cache;
+
+  cache.mode = _mode;
+  cache.texture_unit = _texture_unit;
+  cache.atlas_width = fontAtlasWidth(_mode);
+  cache.atlas_height = fontAtlasHeight(_mode);
+  cache.slot_count = std::min(_mode.atlas_columns * _mode.atlas_rows, (int)no_slot);
+  cache.next_free_slot = first_dynamic_slot;
+  cache.lru_head = cache.lru_tail = no_slot;
+
+  if(cache.slot_count <= first_dynamic_slot)
+  {
+    printf("Glyph cache atlas too small\n");
+    return 0;
+  }
+
+  cache.atlas.assign(cache.atlas_width * cache.atlas_height, 0);
+  cache.slots.assign(cache.slot_count, GlyphSlot { 0, 0, no_slot, no_slot });
+
+  for(uint16_t slot = 0; slot < first_dynamic_slot; ++slot)
+  {
+    cache.slots[slot].codepoint = slot;
+    rasteriseGlyph(slot, slot);
+  }
+
+  cache.pending_uploads.clear();
+
+  cache.texture = createTexture(_texture_unit, cache.atlas_width, cache.atlas_height, cache.atlas.data(), GL_R8, GL_RED, GL_UNSIGNED_BYTE, GL_NEAREST, "glyph cache");
+
+  return cache.texture;
+}
+
+// --------------------------------
+
+// The atlas texture itself belongs to the caller
+
+void destroyGlyphCache()
+{
+  GlyphCache& cache = glyph_cache;
+
+  cache.texture = 0;
+  cache.atlas.clear();
+  cache.slots.clear();
+  cache.pending_uploads.clear();
+  cache.resident.clear();
+  cache.stats = GlyphCacheStats {};
+}
+
+// --------------------------------
+
+uint16_t acquireGlyph(uint32_t _codepoint)
+{
+  GlyphCache& cache = glyph_cache;
+
+  if(_codepoint < first_dynamic_slot) { return _codepoint; }
+
+  auto it = cache.resident.find(_codepoint);
+
+  if(it != cache.resident.end())
+  {
+    GlyphSlot& slot = cache.slots[it->second];
+
+    if(slot.references++ == 0) { lruRemove(it->second); }
+
+    return it->second;
+  }
+
+  ++cache.stats.misses;
+
+  uint16_t slot_index;
+
+  if(cache.next_free_slot < cache.slot_count)
+  {
+    slot_index = cache.next_free_slot++;
+  }
+  else if(cache.lru_head != no_slot)
+  {
+    slot_index = cache.lru_head;
+    lruRemove(slot_index);
+    cache.resident.erase(cache.slots[slot_index].codepoint);
+    ++cache.stats.evictions;
+  }
+  else
+  {
+    // Every slot is on screen
+    return replacement_slot;
+  }
+
+  GlyphSlot& slot = cache.slots[slot_index];
+  slot.codepoint = _codepoint;
+  slot.references = 1;
+
+  cache.resident[_codepoint] = slot_index;
+
+  rasteriseGlyph(slot_index, _codepoint);
+
+  return slot_index;
+}
+
+// --------------------------------
+
+void releaseGlyph(uint16_t _slot)
+{
+  GlyphCache& cache = glyph_cache;
+
+  if(_slot < first_dynamic_slot || _slot >= cache.slots.size()) { return; }
+
+  GlyphSlot& slot = cache.slots[_slot];
+
+  if(slot.references == 0) { return; }
+
+  if(--slot.references == 0) { lruPushBack(_slot); }
+}
+
+// --------------------------------
+
+// New glyphs are uploaded once per frame, one glTexSubImage2D per atlas row
+// spanning the changed tiles of that row
+
+void flushGlyphUploads()
+{
+  GlyphCache& cache = glyph_cache;
+
+  if(cache.pending_uploads.empty() || !cache.texture) { return; }
+
+  TRACE_SCOPE("flushGlyphUploads");
+
+  std::vector<uint16_t>& pending = cache.pending_uploads;
+  std::sort(pending.begin(), pending.end());
+
+  const int columns = cache.mode.atlas_columns;
+  const int glyph_width = cache.mode.glyph_width;
+  const int glyph_height = cache.mode.glyph_height;
+
+  selectTexture(cache.texture_unit, cache.texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, cache.atlas_width);
+
+  for(size_t i = 0; i < pending.size();)
+  {
+    const int row = pending[i] / columns;
+    const int first_column = pending[i] % columns;
+    int last_column = first_column;
+
+    while(i < pending.size() && pending[i] / columns == row)
+    {
+      last_column = pending[i] % columns;
+      ++i;
+    }
+
+    const int x = first_column * glyph_width;
+    const int y = row * glyph_height;
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, (last_column - first_column + 1) * glyph_width, glyph_height,
+        GL_RED, GL_UNSIGNED_BYTE, &cache.atlas[cache.atlas_width * y + x]);
+
+    ++cache.stats.uploads;
+  }
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+  pending.clear();
+}
+
+// --------------------------------
+
+GlyphCacheStats glyphCacheStats()
+{
+  GlyphCacheStats stats = glyph_cache.stats;
+  stats.resident = first_dynamic_slot + glyph_cache.resident.size();
+  return stats;
+}
+
+// --------------------------------
+
+uint32_t decodeUTF8(const char*& _text)
+{
+  const uint8_t* p = (const uint8_t*)_text;
+  uint32_t codepoint = 0xFFFD;
+  int length = 1;
+
+  if(p[0] < 0x80)                { codepoint = p[0]; }
+  else if((p[0] & 0xE0) == 0xC0) { codepoint = p[0] & 0x1F; length = 2; }
+  else if((p[0] & 0xF0) == 0xE0) { codepoint = p[0] & 0x0F; length = 3; }
+  else if((p[0] & 0xF8) == 0xF0) { codepoint = p[0] & 0x07; length = 4; }
+  else                           { ++_text; return 0xFFFD; }
+
+  for(int i = 1; i < length; ++i)
+  {
+    if((p[i] & 0xC0) != 0x80)
+    {
+      _text += i;
+      return 0xFFFD;
+    }
+
+    codepoint = (codepoint << 6) | (p[i] & 0x3F);
+  }
+
+  _text += length;
+
+  return codepoint;
+}
+
+// --------------------------------
@@ -0,0 +1,43 @@
+#ifndef _glyphcache_h_
+#define _glyphcache_h_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <GLES3/gl3.h>
+
+#include "font.h"
+
+// --------------------------------
+// Unicode glyph cache
+//
+// Code points are rasterised on demand into free slots of the font atlas and
+// the 16-bit map stores slot numbers. Slots 0-127 always hold the built-in
+// ASCII glyphs, so ASCII text has the same value in 8 and 16-bit maps.
+// Slots no longer referenced by the map are evicted least recently used first.
+
+struct GlyphCacheStats
+{
+  unsigned int resident;
+  unsigned int evictions;
+  unsigned int misses;
+  unsigned int uploads;
+};
+
+bool loadGlyphFont(const char* _filename);
+bool loadGlyphFontMemory(const uint8_t* _data, size_t _size);    // PSF, used in place
+bool exportGlyphFontPSF(std::vector<uint8_t>& _data);
+
+GLuint initGlyphCache(GLenum _texture_unit, const TextMode& _mode);
+void destroyGlyphCache();
+
+uint16_t acquireGlyph(uint32_t _codepoint);
+void releaseGlyph(uint16_t _slot);
+
+void flushGlyphUploads();
+
+GlyphCacheStats glyphCacheStats();
+
+uint32_t decodeUTF8(const char*& _text);
+
+#endif
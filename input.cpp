@@ -0,0 +1,168 @@
+#include <cstring>
+#include <algorithm>
+
+#include "input.h"
+#include "ringbuffer.h"
+
+// --------------------------------
+
+enum InputEventType
+{
+  input_key_down,
+  input_key_up,
+  input_character,
+};
+
+struct InputEvent
+{
+  uint32_t timestamp;     // SDL ticks, milliseconds
+  uint8_t  type;
+  uint8_t  value;         // Scancode or character
+};
+
+const int latency_window = 256;
+
+struct Input
+{
+  RingBuffer<InputEvent, 256> events;
+
+  // Simulation thread
+
+  uint8_t  keys[32];
+
+  // Render thread, the last latency_window latencies in milliseconds
+
+  float    latencies[latency_window];
+  unsigned int latency_count;
+};
+
+Input input;
+
+// --------------------------------
+
+void initInput()
+{
+  initRingBuffer(input.events);
+
+  memset(input.keys, 0, sizeof(input.keys));
+  input.latency_count = 0;
+}
+
+// --------------------------------
+
+bool queueInput(const SDL_Event& _event)
+{
+  InputEvent event;
+  event.timestamp = _event.common.timestamp;
+
+  switch(_event.type)
+  {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+      if(_event.key.repeat || _event.key.keysym.scancode > 255) { return false; }
+      event.type = _event.type == SDL_KEYDOWN ? input_key_down : input_key_up;
+      event.value = _event.key.keysym.scancode;
+      break;
+
+    case SDL_TEXTINPUT:
+      // Only ASCII reaches the machine
+      if(_event.text.text[0] & 0x80) { return false; }
+      event.type = input_character;
+      event.value = _event.text.text[0];
+      break;
+
+    default:
+      return false;
+  }
+
+  // A full queue means the simulation has stalled, the event is dropped
+
+  pushRingBuffer(input.events, event);
+
+  return true;
+}
+
+// --------------------------------
+
+static bool keyDown(int _scancode) { return input.keys[_scancode >> 3] & (1 << (_scancode & 7)); }
+
+// --------------------------------
+
+int latchInput(uint8_t* _input_page, uint32_t* _timestamps, int _max_timestamps)
+{
+  int timestamp_count = 0;
+  int text_count = 0;
+  InputEvent event;
+
+  while(popRingBuffer(input.events, event))
+  {
+    uint8_t character = 0;
+
+    switch(event.type)
+    {
+      case input_key_down:
+        input.keys[event.value >> 3] |= 1 << (event.value & 7);
+        if(event.value == SDL_SCANCODE_RETURN) { character = 13; }
+        if(event.value == SDL_SCANCODE_BACKSPACE) { character = 8; }
+        break;
+
+      case input_key_up:
+        input.keys[event.value >> 3] &= ~(1 << (event.value & 7));
+        break;
+
+      case input_character:
+        character = event.value;
+        break;
+    }
+
+    if(character && text_count < input_text_size) { _input_page[input_text + text_count++] = character; }
+
+    if(timestamp_count < _max_timestamps) { _timestamps[timestamp_count++] = event.timestamp; }
+  }
+
+  uint8_t joystick = 0;
+
+  if(keyDown(SDL_SCANCODE_UP))     { joystick |= input_joystick_up; }
+  if(keyDown(SDL_SCANCODE_DOWN))   { joystick |= input_joystick_down; }
+  if(keyDown(SDL_SCANCODE_LEFT))   { joystick |= input_joystick_left; }
+  if(keyDown(SDL_SCANCODE_RIGHT))  { joystick |= input_joystick_right; }
+  if(keyDown(SDL_SCANCODE_SPACE) || keyDown(SDL_SCANCODE_LCTRL)) { joystick |= input_joystick_fire; }
+  if(keyDown(SDL_SCANCODE_LALT))   { joystick |= input_joystick_fire_2; }
+
+  _input_page[input_joystick] = joystick;
+  _input_page[input_text_count] = text_count;
+  memcpy(_input_page + input_keys, input.keys, sizeof(input.keys));
+
+  return timestamp_count;
+}
+
+// --------------------------------
+
+void recordInputLatency(const uint32_t* _timestamps, int _count, uint32_t _present_time)
+{
+  for(int i = 0; i < _count; ++i)
+  {
+    input.latencies[input.latency_count++ % latency_window] = (float)(_present_time - _timestamps[i]);
+  }
+}
+
+// --------------------------------
+
+InputLatency inputLatency()
+{
+  InputLatency latency = { 0, 0.0f, 0.0f, 0.0f };
+
+  const int count = std::min(input.latency_count, (unsigned int)latency_window);
+  if(!count) { return latency; }
+
+  float sorted[latency_window];
+  memcpy(sorted, input.latencies, count * sizeof(float));
+  std::sort(sorted, sorted + count);
+
+  latency.samples = input.latency_count;
+  latency.p50 = sorted[count * 50 / 100];
+  latency.p95 = sorted[count * 95 / 100];
+  latency.p99 = sorted[count * 99 / 100];
+
+  return latency;
+}
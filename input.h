@@ -0,0 +1,65 @@
+#ifndef _input_h_
+#define _input_h_
+
+#include <cstdint>
+
+#include <SDL.h>
+
+// --------------------------------
+// Input pipeline
+//
+// The render thread timestamps key and text events and queues them for the
+// simulation thread, which latches everything queued so far into the input
+// page at the start of each machine frame. The timestamps travel with the
+// machine frame back to the render thread, which records how long each event
+// took to reach a swapped frame.
+//
+// Input page, rewritten at the start of every frame
+//
+// $00      Joystick: bit 0 up, 1 down, 2 left, 3 right, 4 fire (space or
+//          left ctrl), 5 fire 2 (left alt)
+// $01      Number of characters typed since the last frame
+// $02-$11  Characters typed since the last frame, ASCII, with return as 13
+//          and backspace as 8
+// $20-$3F  Key state by SDL scancode, bit n & 7 of byte n >> 3
+
+const int input_joystick   = 0x00;
+const int input_text_count = 0x01;
+const int input_text       = 0x02;
+const int input_text_size  = 16;
+const int input_keys       = 0x20;
+
+const uint8_t input_joystick_up     = 0x01;
+const uint8_t input_joystick_down   = 0x02;
+const uint8_t input_joystick_left   = 0x04;
+const uint8_t input_joystick_right  = 0x08;
+const uint8_t input_joystick_fire   = 0x10;
+const uint8_t input_joystick_fire_2 = 0x20;
+
+const int input_latch_timestamps = 16;
+
+struct InputLatency
+{
+  unsigned int samples;
+  float        p50;
+  float        p95;
+  float        p99;
+};
+
+void initInput();
+
+// Render thread. Returns false when the event is not machine input.
+
+bool queueInput(const SDL_Event& _event);
+
+// Simulation thread. Fills the input page and returns the number of
+// timestamps stored in _timestamps.
+
+int latchInput(uint8_t* _input_page, uint32_t* _timestamps, int _max_timestamps);
+
+// Render thread, after a frame built from latched input is swapped
+
+void recordInputLatency(const uint32_t* _timestamps, int _count, uint32_t _present_time);
+InputLatency inputLatency();
+
+#endif
@@ -1,8 +1,15 @@
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <SDL_image.h>
 
 #include "opengl.h"
+#include "trace.h"
 
 // --------------------------------
 
@@ -14,11 +21,27 @@ void glCheckError()
 
 // --------------------------------
 
-GLuint loadShader(GLenum _type, const char* _source)
+// _defines are inserted after the #version line of _source
+
+GLuint loadShader(GLenum _type, const char* _source, const char* _defines = nullptr)
 {
   GLuint shader_id = glCreateShader(_type);
 
-  glShaderSource(shader_id, 1, &_source, nullptr);
+  const char* body = strchr(_source, '\n');
+
+  if(_defines && body)
+  {
+    ++body;
+
+    const char* sources[3] = { _source, _defines, body };
+    const GLint lengths[3] = { (GLint)(body - _source), -1, -1 };
+
+    glShaderSource(shader_id, 3, sources, lengths);
+  }
+  else
+  {
+    glShaderSource(shader_id, 1, &_source, nullptr);
+  }
 
   glCompileShader(shader_id);
 
@@ -59,12 +82,14 @@ GLuint loadShader(GLenum _type, const char* _source)
 
 // --------------------------------
 
-GLuint createProgram(const char* _vertex_shader_source, const char* _fragment_shader_source)
+GLuint createProgram(const char* _vertex_shader_source, const char* _fragment_shader_source, const char* _defines)
 {
-  GLuint vertex_shader_id = loadShader(GL_VERTEX_SHADER, _vertex_shader_source);
+  TRACE_SCOPE("createProgram");
+
+  GLuint vertex_shader_id = loadShader(GL_VERTEX_SHADER, _vertex_shader_source, _defines);
   if(!vertex_shader_id) { return 0; }
 
-  GLuint fragment_shader_id = loadShader(GL_FRAGMENT_SHADER, _fragment_shader_source);
+  GLuint fragment_shader_id = loadShader(GL_FRAGMENT_SHADER, _fragment_shader_source, _defines);
   if(!fragment_shader_id) { return 0; }
 
   GLuint program_id = glCreateProgram();
@@ -74,6 +99,11 @@ GLuint createProgram(const char* _vertex_shader_source, const char* _fragment_sh
 
   glLinkProgram(program_id);
 
+  // The program keeps the compiled code, the shader objects are no longer needed
+
+  glDeleteShader(vertex_shader_id);
+  glDeleteShader(fragment_shader_id);
+
   int ok;
   glGetProgramiv(program_id, GL_LINK_STATUS, &ok);
 
@@ -99,6 +129,160 @@ GLuint createProgram(const char* _vertex_shader_source, const char* _fragment_sh
 
 // --------------------------------
 
+struct ProgramVariant
+{
+  const char* vertex_shader_source;
+  const char* fragment_shader_source;
+  std::string defines;
+  GLuint      program;
+};
+
+std::vector<ProgramVariant> program_variants;
+
+// --------------------------------
+
+GLuint getProgramVariant(const char* _vertex_shader_source, const char* _fragment_shader_source, const char* _defines)
+{
+  for(const ProgramVariant& variant : program_variants)
+  {
+    if(variant.vertex_shader_source == _vertex_shader_source
+        && variant.fragment_shader_source == _fragment_shader_source
+        && variant.defines == _defines)
+    {
+      return variant.program;
+    }
+  }
+
+  GLuint program_id = createProgram(_vertex_shader_source, _fragment_shader_source, _defines);
+  if(!program_id) { return 0; }
+
+  ProgramVariant variant;
+  variant.vertex_shader_source = _vertex_shader_source;
+  variant.fragment_shader_source = _fragment_shader_source;
+  variant.defines = _defines;
+  variant.program = program_id;
+
+  program_variants.push_back(variant);
+
+  return program_id;
+}
+
+// --------------------------------
+
+void destroyProgramVariants()
+{
+  for(const ProgramVariant& variant : program_variants) { deleteProgram(variant.program); }
+
+  program_variants.clear();
+}
+
+// --------------------------------
+
+struct GPUResource
+{
+  GPUResourceKind kind;
+  std::string     owner;
+  size_t          bytes;
+  unsigned int    last_used;      // Frame, kept for evictable textures
+  TextureEvicted  evicted;        // nullptr when it cannot be made again
+};
+
+struct GPUMemory
+{
+  std::unordered_map<uint64_t, GPUResource> resources;   // By kind and GL name
+
+  size_t       bytes[gpu_resource_kinds];
+  int          count[gpu_resource_kinds];
+  size_t       total;
+  size_t       peak;
+  size_t       budget;
+
+  uint32_t     texture_units;                            // Bit n: unit n in use
+  unsigned int frame;
+  unsigned int evictions;
+  unsigned int over_budget;                              // Times evicting could not get under
+  bool         over;                                     // Until it gets under again
+};
+
+GPUMemory gpu_memory;
+
+static void enforceGPUMemoryBudget();
+
+// --------------------------------
+
+static uint64_t resourceKey(GPUResourceKind _kind, GLuint _name) { return ((uint64_t)_kind << 32) | _name; }
+
+// Bytes per texel. Unsized RGB and RGBA are the ones loadTexture() uses.
+
+static int texelBytes(GLint _internal_format)
+{
+  switch(_internal_format)
+  {
+    case GL_R8: case GL_R8UI:
+      return 1;
+    case GL_RG8: case GL_RG8UI: case GL_R16UI:
+      return 2;
+    case GL_RGB8: case GL_RGB:
+      return 3;
+    case GL_RGBA16UI:
+      return 8;
+    default:
+      return 4;
+  }
+}
+
+// --------------------------------
+
+static void setResourceBytes(GPUResourceKind _kind, GLuint _name, size_t _bytes)
+{
+  auto it = gpu_memory.resources.find(resourceKey(_kind, _name));
+
+  if(it == gpu_memory.resources.end()) { return; }
+
+  gpu_memory.bytes[_kind] += _bytes - it->second.bytes;
+  gpu_memory.total += _bytes - it->second.bytes;
+  gpu_memory.peak = std::max(gpu_memory.peak, gpu_memory.total);
+
+  it->second.bytes = _bytes;
+
+  enforceGPUMemoryBudget();
+}
+
+// --------------------------------
+
+static void trackResource(GPUResourceKind _kind, GLuint _name, const char* _owner, size_t _bytes)
+{
+  if(!_name) { return; }
+
+  GPUResource& resource = gpu_memory.resources[resourceKey(_kind, _name)];
+  resource.kind = _kind;
+  resource.owner = _owner;
+  resource.bytes = 0;
+  resource.last_used = gpu_memory.frame;
+  resource.evicted = nullptr;
+
+  ++gpu_memory.count[_kind];
+
+  setResourceBytes(_kind, _name, _bytes);
+}
+
+// --------------------------------
+
+static void untrackResource(GPUResourceKind _kind, GLuint _name)
+{
+  auto it = gpu_memory.resources.find(resourceKey(_kind, _name));
+
+  if(it == gpu_memory.resources.end()) { return; }
+
+  gpu_memory.bytes[_kind] -= it->second.bytes;
+  gpu_memory.total -= it->second.bytes;
+  --gpu_memory.count[_kind];
+
+  gpu_memory.resources.erase(it);
+}
+
+// --------------------------------
+
 GLuint loadTexture(GLenum _texture_unit, const char* _filename)
 {
   GLuint texture_id = 0;
@@ -140,11 +324,9 @@ GLuint loadTexture(GLenum _texture_unit, const char* _filename)
 
     if(format != -1)
     {
-      glActiveTexture(GL_TEXTURE0 + _texture_unit);
-
       glGenTextures(1, &texture_id);
 
-      glBindTexture(GL_TEXTURE_2D, texture_id);
+      bindTexture(_texture_unit, texture_id);
 
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -153,6 +335,8 @@ GLuint loadTexture(GLenum _texture_unit, const char* _filename)
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
       glTexImage2D(GL_TEXTURE_2D, 0, format, image->w, image->h, 0, format, GL_UNSIGNED_BYTE, image->pixels);
+
+      trackResource(gpu_texture, texture_id, _filename, (size_t)image->w * image->h * texelBytes(format));
     }
 
     SDL_FreeSurface (image);
@@ -163,15 +347,13 @@ GLuint loadTexture(GLenum _texture_unit, const char* _filename)
 
 // --------------------------------
 
-GLuint createTexture(GLenum _texture_unit, int _width, int _height, const unsigned char* _data, GLint _internal_format, GLenum _format, GLenum _type, GLint _filter)
+GLuint createTexture(GLenum _texture_unit, int _width, int _height, const unsigned char* _data, GLint _internal_format, GLenum _format, GLenum _type, GLint _filter, const char* _owner)
 {
-  glActiveTexture(GL_TEXTURE0 + _texture_unit);
-
   GLuint texture_id = 0;
 
   glGenTextures(1, &texture_id);
 
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  bindTexture(_texture_unit, texture_id);
 
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -181,19 +363,600 @@ GLuint createTexture(GLenum _texture_unit, int _width, int _height, const unsign
 
   glTexImage2D(GL_TEXTURE_2D, 0, _internal_format, _width, _height, 0, _format, _type, _data);
 
+  trackResource(gpu_texture, texture_id, _owner, (size_t)_width * _height * texelBytes(_internal_format));
+
   return texture_id;
 }
 
 // --------------------------------
 
-void resizeTexture(GLenum _texture_unit, GLuint _texture_id, int _width, int _height, GLint _internal_format, GLenum _format, GLenum _type)
+GLuint createTextureArray(GLenum _texture_unit, int _width, int _height, int _layers, const unsigned char* _data, GLint _internal_format, GLenum _format, GLenum _type, GLint _filter, const char* _owner)
+{
+  GLuint texture_id = 0;
+
+  glGenTextures(1, &texture_id);
+
+  bindTexture(_texture_unit, texture_id, GL_TEXTURE_2D_ARRAY);
+
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, _filter);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, _filter);
+
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, _internal_format, _width, _height, _layers, 0, _format, _type, _data);
+
+  trackResource(gpu_texture, texture_id, _owner, (size_t)_width * _height * _layers * texelBytes(_internal_format));
+
+  return texture_id;
+}
+
+// --------------------------------
+
+void resizeTexture(GLenum _texture_unit, GLuint _texture_id, int _width, int _height, GLint _internal_format, GLenum _format, GLenum _type, const void* _data)
+{
+  selectTexture(_texture_unit, _texture_id);
+
+  glTexImage2D(GL_TEXTURE_2D, 0, _internal_format, _width, _height, 0, _format, _type, _data);
+
+  setResourceBytes(gpu_texture, _texture_id, (size_t)_width * _height * texelBytes(_internal_format));
+}
+
+// --------------------------------
+
+GLuint createBuffer(GLenum _target, GLsizeiptr _size, const void* _data, GLenum _usage, const char* _owner)
+{
+  GLuint buffer = 0;
+
+  glGenBuffers(1, &buffer);
+  trackResource(gpu_buffer, buffer, _owner, 0);
+
+  bufferData(_target, buffer, _size, _data, _usage);
+
+  return buffer;
+}
+
+// --------------------------------
+
+void bufferData(GLenum _target, GLuint _buffer, GLsizeiptr _size, const void* _data, GLenum _usage)
+{
+  bindBuffer(_target, _buffer);
+  glBufferData(_target, _size, _data, _usage);
+
+  setResourceBytes(gpu_buffer, _buffer, _size);
+}
+
+// --------------------------------
+
+GLuint createVertexArray(const char* _owner)
+{
+  GLuint vao = 0;
+
+  glGenVertexArrays(1, &vao);
+  trackResource(gpu_vertex_array, vao, _owner, 0);
+
+  bindVertexArray(vao);
+
+  return vao;
+}
+
+// --------------------------------
+
+GLuint createFramebuffer(const char* _owner)
+{
+  GLuint fbo = 0;
+
+  glGenFramebuffers(1, &fbo);
+  trackResource(gpu_framebuffer, fbo, _owner, 0);
+
+  bindFramebuffer(fbo);
+
+  return fbo;
+}
+
+// --------------------------------
+
+
+const int max_texture_units = 32;
+
+struct UniformValue
+{
+  GLfloat v[4];
+};
+
+struct GLState
+{
+  GLuint program;
+  GLuint vao;
+  GLuint array_buffer;
+  GLuint fbo;
+  GLenum active_texture_unit;
+  GLuint textures[max_texture_units];
+
+  int    viewport[4];
+  float  clear_color[4];
+
+  std::unordered_map<uint64_t, UniformValue> uniforms;
+  std::unordered_map<uint64_t, std::vector<GLfloat>> uniform_arrays;
+
+  GLCallCounters frame;
+};
+
+GLState gl_state;
+
+// --------------------------------
+
+static inline bool skipCall(bool _redundant)
+{
+  if(_redundant)
+  {
+    ++gl_state.frame.skipped;
+    return true;
+  }
+
+  ++gl_state.frame.issued;
+  return false;
+}
+
+// --------------------------------
+
+static uint64_t uniformKey(GLint _location) { return ((uint64_t)gl_state.program << 32) | (uint32_t)_location; }
+
+static bool skipUniform(GLint _location, const UniformValue& _value)
+{
+  if(_location < 0) { return true; }
+
+  const uint64_t key = uniformKey(_location);
+
+  auto it = gl_state.uniforms.find(key);
+
+  if(it != gl_state.uniforms.end() && memcmp(&it->second, &_value, sizeof(UniformValue)) == 0)
+  {
+    return skipCall(true);
+  }
+
+  gl_state.uniforms[key] = _value;
+
+  return skipCall(false);
+}
+
+// --------------------------------
+
+// Arrays are compared whole, a change to any element uploads them all
+
+static bool skipUniformArray(GLint _location, const GLfloat* _values, int _count)
+{
+  if(_location < 0) { return true; }
+
+  std::vector<GLfloat>& cached = gl_state.uniform_arrays[uniformKey(_location)];
+
+  if(cached.size() == (size_t)_count && memcmp(cached.data(), _values, _count * sizeof(GLfloat)) == 0)
+  {
+    return skipCall(true);
+  }
+
+  cached.assign(_values, _values + _count);
+
+  return skipCall(false);
+}
+
+// --------------------------------
+
+void resetGLState()
+{
+  // Values that no real call can match, so the first call of each kind is always issued
+
+  gl_state.program = ~0U;
+  gl_state.vao = ~0U;
+  gl_state.array_buffer = ~0U;
+  gl_state.fbo = ~0U;
+  gl_state.active_texture_unit = ~0U;
+
+  for(int i = 0; i < max_texture_units; ++i) { gl_state.textures[i] = ~0U; }
+
+  gl_state.viewport[0] = gl_state.viewport[1] = gl_state.viewport[2] = gl_state.viewport[3] = -1;
+  gl_state.clear_color[0] = gl_state.clear_color[1] = gl_state.clear_color[2] = gl_state.clear_color[3] = -1.0f;
+
+  gl_state.uniforms.clear();
+  gl_state.uniform_arrays.clear();
+
+  gl_state.frame.issued = 0;
+  gl_state.frame.skipped = 0;
+}
+
+// --------------------------------
+
+GLCallCounters endGLFrame()
+{
+  GLCallCounters counters = gl_state.frame;
+
+  gl_state.frame.issued = 0;
+  gl_state.frame.skipped = 0;
+
+  enforceGPUMemoryBudget();
+  ++gpu_memory.frame;
+
+  return counters;
+}
+
+// --------------------------------
+
+void useProgram(GLuint _program)
+{
+  if(skipCall(gl_state.program == _program)) { return; }
+
+  gl_state.program = _program;
+  glUseProgram(_program);
+}
+
+// --------------------------------
+
+void bindVertexArray(GLuint _vao)
+{
+  if(skipCall(gl_state.vao == _vao)) { return; }
+
+  gl_state.vao = _vao;
+  glBindVertexArray(_vao);
+}
+
+// --------------------------------
+
+void bindBuffer(GLenum _target, GLuint _buffer)
+{
+  // Only GL_ARRAY_BUFFER is global state, other targets are captured by the VAO
+
+  if(_target == GL_ARRAY_BUFFER)
+  {
+    if(skipCall(gl_state.array_buffer == _buffer)) { return; }
+    gl_state.array_buffer = _buffer;
+  }
+  else
+  {
+    skipCall(false);
+  }
+
+  glBindBuffer(_target, _buffer);
+}
+
+// --------------------------------
+
+void bindFramebuffer(GLuint _fbo)
 {
+  if(skipCall(gl_state.fbo == _fbo)) { return; }
+
+  gl_state.fbo = _fbo;
+  glBindFramebuffer(GL_FRAMEBUFFER, _fbo);
+}
+
+// --------------------------------
+
+static void setActiveTexture(GLenum _texture_unit)
+{
+  if(skipCall(gl_state.active_texture_unit == _texture_unit)) { return; }
+
+  gl_state.active_texture_unit = _texture_unit;
   glActiveTexture(GL_TEXTURE0 + _texture_unit);
+}
+
+// --------------------------------
+
+void bindTexture(GLenum _texture_unit, GLuint _texture_id, GLenum _target)
+{
+  if(_texture_unit >= (GLenum)max_texture_units)
+  {
+    printf("Texture unit %d out of range\n", _texture_unit);
+    return;
+  }
+
+  if(skipCall(gl_state.textures[_texture_unit] == _texture_id)) { return; }
+
+  setActiveTexture(_texture_unit);
+
+  gl_state.textures[_texture_unit] = _texture_id;
+  glBindTexture(_target, _texture_id);
+}
+
+// --------------------------------
+
+void selectTexture(GLenum _texture_unit, GLuint _texture_id, GLenum _target)
+{
+  bindTexture(_texture_unit, _texture_id, _target);
+  setActiveTexture(_texture_unit);
+}
+
+// --------------------------------
+
+void setViewport(int _x, int _y, int _width, int _height)
+{
+  int* v = gl_state.viewport;
+
+  if(skipCall(v[0] == _x && v[1] == _y && v[2] == _width && v[3] == _height)) { return; }
+
+  v[0] = _x; v[1] = _y; v[2] = _width; v[3] = _height;
+  glViewport(_x, _y, _width, _height);
+}
+
+// --------------------------------
+
+void setClearColor(float _r, float _g, float _b, float _a)
+{
+  float* c = gl_state.clear_color;
+
+  if(skipCall(c[0] == _r && c[1] == _g && c[2] == _b && c[3] == _a)) { return; }
+
+  c[0] = _r; c[1] = _g; c[2] = _b; c[3] = _a;
+  glClearColor(_r, _g, _b, _a);
+}
+
+// --------------------------------
+
+void setUniform1i(GLint _location, GLint _value)
+{
+  UniformValue value {};
+  memcpy(&value.v[0], &_value, sizeof(GLint));
+
+  if(skipUniform(_location, value)) { return; }
+
+  glUniform1i(_location, _value);
+}
+
+// --------------------------------
+
+void setUniform1ui(GLint _location, GLuint _value)
+{
+  UniformValue value {};
+  memcpy(&value.v[0], &_value, sizeof(GLuint));
+
+  if(skipUniform(_location, value)) { return; }
+
+  glUniform1ui(_location, _value);
+}
+
+// --------------------------------
+
+void setUniform2i(GLint _location, GLint _x, GLint _y)
+{
+  UniformValue value {};
+  memcpy(&value.v[0], &_x, sizeof(GLint));
+  memcpy(&value.v[1], &_y, sizeof(GLint));
+
+  if(skipUniform(_location, value)) { return; }
+
+  glUniform2i(_location, _x, _y);
+}
+
+// --------------------------------
+
+void setUniform2f(GLint _location, GLfloat _x, GLfloat _y)
+{
+  UniformValue value {};
+  value.v[0] = _x;
+  value.v[1] = _y;
+
+  if(skipUniform(_location, value)) { return; }
+
+  glUniform2f(_location, _x, _y);
+}
+
+// --------------------------------
+
+void setUniform3fv(GLint _location, GLsizei _count, const GLfloat* _values)
+{
+  if(skipUniformArray(_location, _values, _count * 3)) { return; }
+
+  glUniform3fv(_location, _count, _values);
+}
+
+// --------------------------------
+
+void deleteProgram(GLuint _program)
+{
+  if(gl_state.program == _program) { gl_state.program = ~0U; }
+
+  for(auto it = gl_state.uniforms.begin(); it != gl_state.uniforms.end();)
+  {
+    if((GLuint)(it->first >> 32) == _program) { it = gl_state.uniforms.erase(it); }
+    else { ++it; }
+  }
+
+  for(auto it = gl_state.uniform_arrays.begin(); it != gl_state.uniform_arrays.end();)
+  {
+    if((GLuint)(it->first >> 32) == _program) { it = gl_state.uniform_arrays.erase(it); }
+    else { ++it; }
+  }
+
+  glDeleteProgram(_program);
+}
 
-  glBindTexture(GL_TEXTURE_2D, _texture_id);
+// --------------------------------
+
+void deleteVertexArray(GLuint _vao)
+{
+  if(gl_state.vao == _vao) { gl_state.vao = ~0U; }
+
+  untrackResource(gpu_vertex_array, _vao);
+  glDeleteVertexArrays(1, &_vao);
+}
+
+// --------------------------------
+
+void deleteBuffer(GLuint _buffer)
+{
+  if(gl_state.array_buffer == _buffer) { gl_state.array_buffer = ~0U; }
+
+  untrackResource(gpu_buffer, _buffer);
+  glDeleteBuffers(1, &_buffer);
+}
+
+// --------------------------------
+
+void deleteFramebuffer(GLuint _fbo)
+{
+  if(gl_state.fbo == _fbo) { gl_state.fbo = ~0U; }
+
+  untrackResource(gpu_framebuffer, _fbo);
+  glDeleteFramebuffers(1, &_fbo);
+}
+
+// --------------------------------
+
+void deleteTexture(GLuint _texture_id)
+{
+  for(int i = 0; i < max_texture_units; ++i)
+  {
+    if(gl_state.textures[i] == _texture_id) { gl_state.textures[i] = ~0U; }
+  }
+
+  untrackResource(gpu_texture, _texture_id);
+  glDeleteTextures(1, &_texture_id);
+}
+
+// --------------------------------
+
+GLuint acquireTextureUnit()
+{
+  for(int i = 0; i < max_texture_units; ++i)
+  {
+    if(gpu_memory.texture_units & (1U << i)) { continue; }
+
+    gpu_memory.texture_units |= 1U << i;
+    return i;
+  }
+
+  printf("Out of texture units\n");
+
+  return no_texture_unit;
+}
+
+// --------------------------------
+
+void releaseTextureUnit(GLuint _texture_unit)
+{
+  if(_texture_unit < (GLuint)max_texture_units) { gpu_memory.texture_units &= ~(1U << _texture_unit); }
+}
+
+// --------------------------------
+
+void setTextureEvictable(GLuint _texture_id, TextureEvicted _evicted)
+{
+  auto it = gpu_memory.resources.find(resourceKey(gpu_texture, _texture_id));
+
+  if(it == gpu_memory.resources.end()) { return; }
+
+  it->second.evicted = _evicted;
+  it->second.last_used = gpu_memory.frame;
+}
+
+// --------------------------------
+
+void touchTexture(GLuint _texture_id)
+{
+  auto it = gpu_memory.resources.find(resourceKey(gpu_texture, _texture_id));
 
-  glTexImage2D(GL_TEXTURE_2D, 0, _internal_format, _width, _height, 0, _format, _type, nullptr);
+  if(it != gpu_memory.resources.end()) { it->second.last_used = gpu_memory.frame; }
 }
 
 // --------------------------------
 
+// Runs when a resource grows and at the end of every frame. What eviction
+// cannot free is reported once each time the total goes over the budget.
+
+static void enforceGPUMemoryBudget()
+{
+  if(!gpu_memory.budget) { return; }
+
+  while(gpu_memory.total > gpu_memory.budget)
+  {
+    auto oldest = gpu_memory.resources.end();
+
+    for(auto it = gpu_memory.resources.begin(); it != gpu_memory.resources.end(); ++it)
+    {
+      const GPUResource& resource = it->second;
+
+      if(!resource.evicted || resource.last_used == gpu_memory.frame) { continue; }
+      if(oldest == gpu_memory.resources.end() || resource.last_used < oldest->second.last_used) { oldest = it; }
+    }
+
+    if(oldest == gpu_memory.resources.end()) { break; }
+
+    // The owner is told after the delete, so it only has to forget the name
+
+    const GLuint texture_id = (GLuint)oldest->first;
+    const TextureEvicted evicted = oldest->second.evicted;
+
+    deleteTexture(texture_id);
+    evicted(texture_id);
+
+    ++gpu_memory.evictions;
+  }
+
+  const bool over = gpu_memory.total > gpu_memory.budget;
+  const bool reported = gpu_memory.over;
+
+  gpu_memory.over = over;
+
+  if(!over || reported) { return; }
+
+  ++gpu_memory.over_budget;
+
+  printf("GPU memory over the %u KB budget\n", (unsigned int)(gpu_memory.budget / 1024));
+  printGPUResources();
+}
+
+// --------------------------------
+
+void setGPUMemoryBudget(size_t _bytes)
+{
+  // Enforced when the current frame ends
+
+  gpu_memory.budget = _bytes;
+}
+
+// --------------------------------
+
+GPUMemoryStats gpuMemoryStats()
+{
+  GPUMemoryStats stats;
+
+  for(int i = 0; i < gpu_resource_kinds; ++i)
+  {
+    stats.bytes[i] = gpu_memory.bytes[i];
+    stats.count[i] = gpu_memory.count[i];
+  }
+
+  stats.total = gpu_memory.total;
+  stats.peak = gpu_memory.peak;
+  stats.budget = gpu_memory.budget;
+  stats.texture_units = __builtin_popcount(gpu_memory.texture_units);
+  stats.evictions = gpu_memory.evictions;
+  stats.over_budget = gpu_memory.over_budget;
+
+  return stats;
+}
+
+// --------------------------------
+
+void printGPUResources()
+{
+  std::map<std::string, std::pair<size_t, int>> owners;
+
+  for(const auto& entry : gpu_memory.resources)
+  {
+    std::pair<size_t, int>& owner = owners[entry.second.owner];
+    owner.first += entry.second.bytes;
+    ++owner.second;
+  }
+
+  std::vector<std::pair<size_t, std::string>> sorted;
+  for(const auto& owner : owners) { sorted.push_back(std::make_pair(owner.second.first, owner.first)); }
+  std::sort(sorted.rbegin(), sorted.rend());
+
+  printf("GPU memory %u KB, peak %u KB\n", (unsigned int)(gpu_memory.total / 1024), (unsigned int)(gpu_memory.peak / 1024));
+
+  for(const auto& owner : sorted)
+  {
+    printf("%10u bytes  %3d  %s\n", (unsigned int)owner.first, owners[owner.second].second, owner.second.c_str());
+  }
+}
+
+// --------------------------------
@@ -1,16 +1,120 @@
 #ifndef _opengl_h_
 #define _opengl_h_
 
+#include <cstddef>
+
 #include <GLES3/gl3.h>
 
 void glCheckError();
 
-GLuint createProgram(const char* _vertex_shader_source, const char* _fragment_shader_source);
+GLuint createProgram(const char* _vertex_shader_source, const char* _fragment_shader_source, const char* _defines = nullptr);
+
+// Programs built from the same sources with different #defines, cached so each variant is only compiled once
+
+GLuint getProgramVariant(const char* _vertex_shader_source, const char* _fragment_shader_source, const char* _defines);
+void destroyProgramVariants();
+
+// Objects made here are recorded in the GPU resource registry below, under
+// _owner, until they are deleted with the delete functions of the state cache
 
 GLuint loadTexture(GLenum _texture_unit, const char* _filename);
 
-GLuint createTexture(GLenum _texture_unit, int _width, int _height, const unsigned char* _data, GLint _internal_format = GL_RGBA8, GLenum _format = GL_RGBA, GLenum _type = GL_UNSIGNED_BYTE, GLint _filter = GL_LINEAR);
+GLuint createTexture(GLenum _texture_unit, int _width, int _height, const unsigned char* _data, GLint _internal_format = GL_RGBA8, GLenum _format = GL_RGBA, GLenum _type = GL_UNSIGNED_BYTE, GLint _filter = GL_LINEAR, const char* _owner = "texture");
+
+GLuint createTextureArray(GLenum _texture_unit, int _width, int _height, int _layers, const unsigned char* _data, GLint _internal_format, GLenum _format, GLenum _type, GLint _filter = GL_NEAREST, const char* _owner = "texture array");
+
+void resizeTexture(GLenum _texture_unit, GLuint _texture_id, int _width, int _height, GLint _internal_format = GL_RGBA8, GLenum _format = GL_RGBA, GLenum _type = GL_UNSIGNED_BYTE, const void* _data = nullptr);
+
+GLuint createBuffer(GLenum _target, GLsizeiptr _size, const void* _data, GLenum _usage, const char* _owner);   // Left bound
+void bufferData(GLenum _target, GLuint _buffer, GLsizeiptr _size, const void* _data, GLenum _usage);
+GLuint createVertexArray(const char* _owner);     // Left bound
+GLuint createFramebuffer(const char* _owner);     // Left bound
+
+// --------------------------------
+// GL state cache
+//
+// Every state change goes through these wrappers, which drop calls that
+// would not change the current GL state. WebGL validates each call in
+// JavaScript, so redundant binds are not free.
+
+struct GLCallCounters
+{
+  unsigned int issued;
+  unsigned int skipped;
+};
+
+void resetGLState();
+GLCallCounters endGLFrame();
+
+void useProgram(GLuint _program);
+void bindVertexArray(GLuint _vao);
+void bindBuffer(GLenum _target, GLuint _buffer);
+void bindFramebuffer(GLuint _fbo);
+void bindTexture(GLenum _texture_unit, GLuint _texture_id, GLenum _target = GL_TEXTURE_2D);
+void selectTexture(GLenum _texture_unit, GLuint _texture_id, GLenum _target = GL_TEXTURE_2D);   // Bind and make the unit active for glTex* calls
+void setViewport(int _x, int _y, int _width, int _height);
+void setClearColor(float _r, float _g, float _b, float _a);
+
+void setUniform1i(GLint _location, GLint _value);
+void setUniform1ui(GLint _location, GLuint _value);
+void setUniform2i(GLint _location, GLint _x, GLint _y);
+void setUniform2f(GLint _location, GLfloat _x, GLfloat _y);
+void setUniform3fv(GLint _location, GLsizei _count, const GLfloat* _values);
+
+void deleteProgram(GLuint _program);
+void deleteVertexArray(GLuint _vao);
+void deleteBuffer(GLuint _buffer);
+void deleteFramebuffer(GLuint _fbo);
+void deleteTexture(GLuint _texture_id);
+
+// --------------------------------
+// GPU resources
+//
+// Every live texture, buffer, vertex array and framebuffer with its owner
+// and size as allocated (driver padding and mipmaps are not counted), so the
+// memory a context holds can be measured before it runs out. Texture units
+// are handed out and taken back here too.
+//
+// A texture its owner can make again from memory it keeps is evictable.
+// When the total goes over the budget, evictable textures are deleted least
+// recently used first, never one touched in the current frame, and the
+// owner's function is called with the name so it makes the texture again
+// on its next use. What cannot be evicted is reported with the owners that
+// hold the memory.
+
+enum GPUResourceKind
+{
+  gpu_texture,
+  gpu_buffer,
+  gpu_vertex_array,
+  gpu_framebuffer,
+  gpu_resource_kinds,
+};
+
+struct GPUMemoryStats
+{
+  size_t       bytes[gpu_resource_kinds];
+  int          count[gpu_resource_kinds];
+  size_t       total;
+  size_t       peak;
+  size_t       budget;            // 0 for none
+  int          texture_units;     // In use
+  unsigned int evictions;
+  unsigned int over_budget;       // Times evicting could not get under the budget
+};
+
+typedef void (*TextureEvicted)(GLuint _texture_id);
+
+const GLuint no_texture_unit = ~0U;
+
+GLuint acquireTextureUnit();                      // The lowest free unit, no_texture_unit when all are taken
+void releaseTextureUnit(GLuint _texture_unit);
+
+void setTextureEvictable(GLuint _texture_id, TextureEvicted _evicted);
+void touchTexture(GLuint _texture_id);            // Used in this frame, so not evicted before it ends
 
-void resizeTexture(GLenum _texture_unit, GLuint _texture_id, int _width, int _height, GLint _internal_format = GL_RGBA8, GLenum _format = GL_RGBA, GLenum _type = GL_UNSIGNED_BYTE);
+void setGPUMemoryBudget(size_t _bytes);
+GPUMemoryStats gpuMemoryStats();
+void printGPUResources();                         // Totals by owner, largest first
 
 #endif
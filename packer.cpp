@@ -0,0 +1,358 @@
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <SDL.h>
+#include <SDL_image.h>
+
+#include "bundle.h"
+#include "font.h"
+#include "glyphcache.h"
+
+// --------------------------------
+// Asset bundle packer
+//
+// packer out.bundle name=source ...
+//
+// The entry type follows from the source
+//
+//   builtin      The built-in 8x8 font as font RAM
+//   atlas        The built-in font expanded for the default text mode, as an
+//                R8 texture the VPU uploads without expanding (name it
+//                "font atlas")
+//   *.png        RGBA8 texture
+//   *.bdf *.psf  Glyph font, stored as PSF2
+//   *.pal        Palette, JASC-PAL with 16 colours
+//   *.txt        Map, one row of ASCII cells per line. Optionally a "--" line
+//                and then the attributes, one row per line with two hex
+//                digits per cell
+
+struct PackedEntry
+{
+  BundleEntry          entry;
+  std::vector<uint8_t> data;
+};
+
+// --------------------------------
+
+static bool hasExtension(const std::string& _filename, const char* _extension)
+{
+  const size_t length = strlen(_extension);
+  return _filename.size() > length && strcasecmp(_filename.c_str() + _filename.size() - length, _extension) == 0;
+}
+
+// --------------------------------
+
+static bool packBuiltinFont(PackedEntry& _packed)
+{
+  _packed.entry.type = bundle_font;
+  _packed.data.resize(font_ram_size);
+  copyBuiltinFont(_packed.data.data());
+
+  return true;
+}
+
+// --------------------------------
+
+static bool packFontAtlas(PackedEntry& _packed)
+{
+  uint8_t font_ram[font_ram_size];
+  copyBuiltinFont(font_ram);
+
+  const int width = fontAtlasWidth(default_text_mode);
+  const int height = fontAtlasHeight(default_text_mode);
+
+  _packed.entry.type = bundle_texture;
+  _packed.entry.width = width;
+  _packed.entry.height = height;
+  _packed.entry.format = GL_R8;
+  _packed.data.resize(width * height);
+
+  expandFont(default_text_mode, font_ram, _packed.data.data());
+
+  return true;
+}
+
+// --------------------------------
+
+static bool packTexture(PackedEntry& _packed, const char* _filename)
+{
+  SDL_Surface* image = IMG_Load(_filename);
+
+  if(!image)
+  {
+    printf("Failed to load %s, due to %s\n", _filename, IMG_GetError());
+    return false;
+  }
+
+  // ABGR8888 is R, G, B, A in memory on little endian hosts
+
+  SDL_Surface* rgba = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ABGR8888, 0);
+  SDL_FreeSurface(image);
+
+  if(!rgba || rgba->w > 0xFFFF || rgba->h > 0xFFFF)
+  {
+    printf("Failed to convert %s\n", _filename);
+    SDL_FreeSurface(rgba);
+    return false;
+  }
+
+  _packed.entry.type = bundle_texture;
+  _packed.entry.width = rgba->w;
+  _packed.entry.height = rgba->h;
+  _packed.entry.format = GL_RGBA8;
+
+  const int row_bytes = rgba->w * 4;
+  _packed.data.resize(row_bytes * rgba->h);
+
+  for(int y = 0; y < rgba->h; ++y)
+  {
+    memcpy(&_packed.data[y * row_bytes], (const uint8_t*)rgba->pixels + y * rgba->pitch, row_bytes);
+  }
+
+  SDL_FreeSurface(rgba);
+
+  return true;
+}
+
+// --------------------------------
+
+static bool packGlyphFont(PackedEntry& _packed, const char* _filename)
+{
+  if(!loadGlyphFont(_filename)) { return false; }
+
+  _packed.entry.type = bundle_glyph_font;
+
+  return exportGlyphFontPSF(_packed.data);
+}
+
+// --------------------------------
+
+static bool packPalette(PackedEntry& _packed, const char* _filename)
+{
+  FILE* file = fopen(_filename, "r");
+
+  if(!file)
+  {
+    printf("Failed to load %s\n", _filename);
+    return false;
+  }
+
+  char magic[16];
+  int version = 0, count = 0;
+  bool ok = fscanf(file, "%15s %d %d", magic, &version, &count) == 3 && strcmp(magic, "JASC-PAL") == 0 && count >= 16;
+
+  _packed.entry.type = bundle_palette;
+  _packed.entry.width = 16;
+  _packed.data.resize(16 * 3);
+
+  for(int i = 0; ok && i < 16; ++i)
+  {
+    int r, g, b;
+    ok = fscanf(file, "%d %d %d", &r, &g, &b) == 3;
+
+    _packed.data[i * 3 + 0] = r;
+    _packed.data[i * 3 + 1] = g;
+    _packed.data[i * 3 + 2] = b;
+  }
+
+  fclose(file);
+
+  if(!ok) { printf("%s is not a 16 colour JASC-PAL palette\n", _filename); }
+
+  return ok;
+}
+
+// --------------------------------
+
+static bool packMap(PackedEntry& _packed, const char* _filename)
+{
+  FILE* file = fopen(_filename, "r");
+
+  if(!file)
+  {
+    printf("Failed to load %s\n", _filename);
+    return false;
+  }
+
+  std::vector<std::string> lines;
+  std::vector<std::string> attribute_lines;
+  size_t width = 0;
+  bool attributes = false;
+  char line[1024];
+
+  while(fgets(line, sizeof(line), file))
+  {
+    line[strcspn(line, "\r\n")] = 0;
+
+    if(!attributes && strcmp(line, "--") == 0)
+    {
+      attributes = true;
+      continue;
+    }
+
+    if(attributes)
+    {
+      attribute_lines.push_back(line);
+      continue;
+    }
+
+    lines.push_back(line);
+    width = std::max(width, lines.back().size());
+  }
+
+  fclose(file);
+
+  if(width == 0 || width > 0xFFFF || lines.size() > 0xFFFF)
+  {
+    printf("%s is not a usable map\n", _filename);
+    return false;
+  }
+
+  const size_t cells = width * lines.size();
+
+  _packed.entry.type = bundle_map;
+  _packed.entry.width = width;
+  _packed.entry.height = lines.size();
+  _packed.data.assign(cells, ' ');
+
+  for(size_t y = 0; y < lines.size(); ++y)
+  {
+    for(size_t x = 0; x < lines[y].size(); ++x) { _packed.data[y * width + x] = lines[y][x] & 0x7F; }
+  }
+
+  if(!attributes) { return true; }
+
+  // Every cell needs one, there is no default to fill in with
+
+  if(attribute_lines.size() != lines.size())
+  {
+    printf("%s has %d attribute rows for %d map rows\n", _filename, (int)attribute_lines.size(), (int)lines.size());
+    return false;
+  }
+
+  _packed.entry.format = bundle_map_attributes;
+  _packed.data.resize(cells * 2);
+
+  for(size_t y = 0; y < attribute_lines.size(); ++y)
+  {
+    const std::string& row = attribute_lines[y];
+
+    for(size_t x = 0; x < width; ++x)
+    {
+      unsigned int attribute;
+
+      if(row.size() < x * 2 + 2 || !isxdigit(row[x * 2]) || !isxdigit(row[x * 2 + 1]) || sscanf(row.c_str() + x * 2, "%2x", &attribute) != 1)
+      {
+        printf("%s has no attribute for cell %d,%d\n", _filename, (int)x, (int)y);
+        return false;
+      }
+
+      _packed.data[cells + y * width + x] = attribute;
+    }
+  }
+
+  return true;
+}
+
+// --------------------------------
+
+static bool writeBundle(const char* _filename, std::vector<PackedEntry>& _entries)
+{
+  FILE* file = fopen(_filename, "wb");
+
+  if(!file)
+  {
+    printf("Failed to write %s\n", _filename);
+    return false;
+  }
+
+  BundleHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, bundle_magic, sizeof(bundle_magic));
+  header.version = bundle_version;
+  header.entry_count = _entries.size();
+
+  uint32_t offset = sizeof(BundleHeader) + _entries.size() * sizeof(BundleEntry);
+
+  for(PackedEntry& packed : _entries)
+  {
+    offset = (offset + bundle_alignment - 1) & ~(bundle_alignment - 1);
+
+    packed.entry.offset = offset;
+    packed.entry.size = packed.data.size();
+
+    offset += packed.data.size();
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+
+  for(const PackedEntry& packed : _entries) { fwrite(&packed.entry, sizeof(packed.entry), 1, file); }
+
+  for(const PackedEntry& packed : _entries)
+  {
+    while((uint32_t)ftell(file) < packed.entry.offset) { fputc(0, file); }
+    fwrite(packed.data.data(), 1, packed.data.size(), file);
+  }
+
+  fclose(file);
+
+  printf("Bundle %s: %d entries, %u bytes\n", _filename, (int)_entries.size(), offset);
+
+  return true;
+}
+
+// --------------------------------
+
+int main(int argc, char** argv)
+{
+  if(argc < 3)
+  {
+    printf("Usage: packer out.bundle name=source ...\n");
+    return 1;
+  }
+
+  std::vector<PackedEntry> entries;
+
+  for(int i = 2; i < argc; ++i)
+  {
+    const char* equals = strchr(argv[i], '=');
+
+    if(!equals || equals == argv[i] || equals - argv[i] >= (int)sizeof(BundleEntry::name))
+    {
+      printf("Expected name=source, got %s\n", argv[i]);
+      return 1;
+    }
+
+    PackedEntry packed;
+    memset(&packed.entry, 0, sizeof(packed.entry));
+    memcpy(packed.entry.name, argv[i], equals - argv[i]);
+
+    const std::string source = equals + 1;
+    bool ok;
+
+    if(source == "builtin")                                               { ok = packBuiltinFont(packed); }
+    else if(source == "atlas")                                            { ok = packFontAtlas(packed); }
+    else if(hasExtension(source, ".png"))                                 { ok = packTexture(packed, source.c_str()); }
+    else if(hasExtension(source, ".bdf") || hasExtension(source, ".psf")) { ok = packGlyphFont(packed, source.c_str()); }
+    else if(hasExtension(source, ".pal"))                                 { ok = packPalette(packed, source.c_str()); }
+    else if(hasExtension(source, ".txt"))                                 { ok = packMap(packed, source.c_str()); }
+    else
+    {
+      printf("Unknown source type %s\n", source.c_str());
+      ok = false;
+    }
+
+    if(!ok) { return 1; }
+
+    printf("%-16s %8u bytes  %s\n", packed.entry.name, (unsigned int)packed.data.size(), source.c_str());
+
+    entries.push_back(packed);
+  }
+
+  return writeBundle(argv[1], entries) ? 0 : 1;
+}
@@ -0,0 +1,445 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "recording.h"
+
+// --------------------------------
+
+const int session_header_size = 32;
+const int session_record_size = 8;
+const int session_run_size    = 4;
+const int session_index_size  = 8;
+
+const uint8_t session_keyframe = 0x01;    // Record flag, one run covering the whole window
+
+// Unchanged bytes shorter than a run header are stored rather than starting
+// a new run
+
+const int run_merge_gap = session_run_size;
+
+// --------------------------------
+
+static void put16(std::vector<uint8_t>& _data, uint32_t _value)
+{
+  _data.push_back(_value & 0xFF);
+  _data.push_back((_value >> 8) & 0xFF);
+}
+
+static void put32(std::vector<uint8_t>& _data, uint32_t _value)
+{
+  put16(_data, _value & 0xFFFF);
+  put16(_data, _value >> 16);
+}
+
+static void set32(std::vector<uint8_t>& _data, size_t _offset, uint32_t _value)
+{
+  for(int i = 0; i < 4; ++i) { _data[_offset + i] = (_value >> (i * 8)) & 0xFF; }
+}
+
+static uint32_t get16(const uint8_t* _data) { return _data[0] | (_data[1] << 8); }
+static uint32_t get32(const uint8_t* _data) { return get16(_data) | (get16(_data + 2) << 16); }
+
+// --------------------------------
+
+void startRecording(SessionRecorder& _recorder, int _window_size)
+{
+  _recorder.data.clear();
+  _recorder.index.clear();
+  _recorder.previous.assign(_window_size, 0);
+
+  // Written by stopRecording()
+
+  _recorder.data.resize(session_header_size, 0);
+
+  _recorder.window_size = _window_size;
+  _recorder.first_sequence = 0;
+  _recorder.frames = 0;
+  _recorder.records = 0;
+  _recorder.keyframe_frame = 0;
+  _recorder.active = true;
+}
+
+// --------------------------------
+
+static void writeRecordHeader(SessionRecorder& _recorder, uint32_t _frame, int _runs, uint8_t _flags)
+{
+  put32(_recorder.data, _frame);
+  put16(_recorder.data, _runs);
+  _recorder.data.push_back(_flags);
+  _recorder.data.push_back(0);
+}
+
+// --------------------------------
+
+static void writeKeyframe(SessionRecorder& _recorder, uint32_t _frame, const uint8_t* _window)
+{
+  _recorder.index.push_back(_frame);
+  _recorder.index.push_back(_recorder.data.size());
+
+  writeRecordHeader(_recorder, _frame, 1, session_keyframe);
+  put16(_recorder.data, 0);
+  put16(_recorder.data, _recorder.window_size);
+  _recorder.data.insert(_recorder.data.end(), _window, _window + _recorder.window_size);
+
+  _recorder.keyframe_frame = _frame;
+}
+
+// --------------------------------
+
+// Appends the runs of bytes that differ from the previous window. Equal
+// stretches are skipped 8 bytes at a time. Returns the number of runs.
+
+static int writeRuns(SessionRecorder& _recorder, const uint8_t* _window)
+{
+  const uint8_t* previous = _recorder.previous.data();
+  const int size = _recorder.window_size;
+
+  int runs = 0;
+  int i = 0;
+
+  while(i < size)
+  {
+    uint64_t a, b;
+
+    if(i + 8 <= size)
+    {
+      memcpy(&a, _window + i, 8);
+      memcpy(&b, previous + i, 8);
+      if(a == b) { i += 8; continue; }
+    }
+
+    if(_window[i] == previous[i]) { ++i; continue; }
+
+    // Extend the run until run_merge_gap equal bytes follow it
+
+    int end = i + 1;
+
+    for(int j = end; j < size && j - end < run_merge_gap; ++j)
+    {
+      if(_window[j] != previous[j]) { end = j + 1; }
+    }
+
+    put16(_recorder.data, i);
+    put16(_recorder.data, end - i);
+    _recorder.data.insert(_recorder.data.end(), _window + i, _window + end);
+
+    ++runs;
+    i = end;
+  }
+
+  return runs;
+}
+
+// --------------------------------
+
+void recordFrame(SessionRecorder& _recorder, uint32_t _sequence, const uint8_t* _window)
+{
+  if(!_recorder.active) { return; }
+
+  if(!_recorder.records)
+  {
+    _recorder.first_sequence = _sequence;
+    writeKeyframe(_recorder, 0, _window);
+  }
+  else
+  {
+    const uint32_t frame = _sequence - _recorder.first_sequence;
+    const size_t start = _recorder.data.size();
+
+    writeRecordHeader(_recorder, frame, 0, 0);
+    const int runs = writeRuns(_recorder, _window);
+
+    if(!runs)
+    {
+      _recorder.data.resize(start);
+      _recorder.frames = frame + 1;
+      return;
+    }
+
+    // A keyframe is due, or would be smaller than the runs
+
+    if(frame - _recorder.keyframe_frame >= (uint32_t)session_keyframe_interval || _recorder.data.size() - start > (size_t)_recorder.window_size)
+    {
+      _recorder.data.resize(start);
+      writeKeyframe(_recorder, frame, _window);
+    }
+    else
+    {
+      _recorder.data[start + 4] = runs & 0xFF;
+      _recorder.data[start + 5] = runs >> 8;
+    }
+  }
+
+  memcpy(_recorder.previous.data(), _window, _recorder.window_size);
+
+  _recorder.frames = _sequence - _recorder.first_sequence + 1;
+  ++_recorder.records;
+}
+
+// --------------------------------
+
+void stopRecording(SessionRecorder& _recorder, std::vector<uint8_t>& _data)
+{
+  std::vector<uint8_t>& data = _recorder.data;
+
+  const uint32_t index_offset = data.size();
+
+  for(uint32_t value : _recorder.index) { put32(data, value); }
+
+  memcpy(data.data(), "RREC", 4);
+  data[4] = session_version & 0xFF;
+  data[5] = session_version >> 8;
+  data[6] = session_keyframe_interval & 0xFF;
+  data[7] = session_keyframe_interval >> 8;
+  set32(data, 8, _recorder.window_size);
+  set32(data, 12, _recorder.frames);
+  set32(data, 16, _recorder.records);
+  set32(data, 20, index_offset);
+  set32(data, 24, _recorder.index.size() / 2);
+
+  _data.swap(data);
+
+  data.clear();
+  _recorder.previous.clear();
+  _recorder.index.clear();
+  _recorder.active = false;
+}
+
+// --------------------------------
+
+// Walks every record once so playback can trust the offsets and lengths
+
+static bool checkSession(const SessionPlayer& _player)
+{
+  const uint8_t* data = _player.data.data();
+  const size_t end = _player.index_offset;
+
+  size_t offset = session_header_size;
+  uint32_t records = 0;
+  uint32_t keyframes = 0;
+  uint32_t last_frame = 0;
+
+  while(offset < end)
+  {
+    if(end - offset < (size_t)session_record_size) { return false; }
+
+    const uint32_t frame = get32(data + offset);
+    const int runs = get16(data + offset + 4);
+    const bool keyframe = data[offset + 6] & session_keyframe;
+
+    if(frame >= _player.frame_count || (records && frame <= last_frame) || (!records && (frame || !keyframe))) { return false; }
+
+    if(keyframe)
+    {
+      const uint8_t* entry = data + end + keyframes * session_index_size;
+
+      if(keyframes == _player.keyframe_count || get32(entry) != frame || get32(entry + 4) != offset) { return false; }
+      ++keyframes;
+    }
+
+    offset += session_record_size;
+
+    for(int i = 0; i < runs; ++i)
+    {
+      if(end - offset < (size_t)session_run_size) { return false; }
+
+      const uint32_t start = get16(data + offset);
+      const uint32_t length = get16(data + offset + 2);
+
+      offset += session_run_size;
+
+      if(start + length > (uint32_t)_player.window_size || end - offset < length) { return false; }
+      if(keyframe && (runs != 1 || start || length != (uint32_t)_player.window_size)) { return false; }
+
+      offset += length;
+    }
+
+    last_frame = frame;
+    ++records;
+  }
+
+  return records == _player.record_count && keyframes == _player.keyframe_count;
+}
+
+// --------------------------------
+
+bool openPlayback(SessionPlayer& _player, std::vector<uint8_t>& _data)
+{
+  _player.active = false;
+  _player.data.swap(_data);
+
+  const uint8_t* data = _player.data.data();
+  const size_t size = _player.data.size();
+
+  if(size < (size_t)session_header_size || memcmp(data, "RREC", 4) || get16(data + 4) != (uint32_t)session_version)
+  {
+    printf("Not a session recording\n");
+    return false;
+  }
+
+  _player.window_size = get32(data + 8);
+  _player.frame_count = get32(data + 12);
+  _player.record_count = get32(data + 16);
+  _player.index_offset = get32(data + 20);
+  _player.keyframe_count = get32(data + 24);
+
+  if(!_player.record_count || !_player.window_size || _player.window_size > 0xFFFF
+      || _player.index_offset < (size_t)session_header_size || _player.index_offset > size
+      || (size - _player.index_offset) / session_index_size != _player.keyframe_count
+      || (size - _player.index_offset) % session_index_size
+      || !checkSession(_player))
+  {
+    printf("Session recording is damaged\n");
+    return false;
+  }
+
+  _player.window.assign(_player.window_size, 0);
+  _player.changed_pages.assign((_player.window_size + 255) / 256, 1);
+
+  _player.next = session_header_size;
+  _player.frame = 0;
+  _player.active = true;
+
+  seekPlayback(_player, 0);
+
+  return true;
+}
+
+// --------------------------------
+
+void closePlayback(SessionPlayer& _player)
+{
+  _player.data.clear();
+  _player.window.clear();
+  _player.changed_pages.clear();
+  _player.active = false;
+}
+
+// --------------------------------
+
+// Applies the record at _player.next and moves past it. A keyframe only flags
+// the pages it actually changes.
+
+static void applyRecord(SessionPlayer& _player)
+{
+  const uint8_t* record = _player.data.data() + _player.next;
+  const int runs = get16(record + 4);
+  const bool keyframe = record[6] & session_keyframe;
+
+  const uint8_t* run = record + session_record_size;
+
+  for(int i = 0; i < runs; ++i)
+  {
+    const uint32_t start = get16(run);
+    const uint32_t length = get16(run + 2);
+    const uint8_t* bytes = run + session_run_size;
+
+    if(keyframe)
+    {
+      for(uint32_t page = 0; page < _player.changed_pages.size(); ++page)
+      {
+        const uint32_t first = page * 256;
+        const uint32_t count = std::min<uint32_t>(256, length - first);
+
+        if(memcmp(_player.window.data() + first, bytes + first, count)) { _player.changed_pages[page] = 1; }
+      }
+    }
+    else
+    {
+      for(uint32_t page = start / 256; page <= (start + length - 1) / 256; ++page) { _player.changed_pages[page] = 1; }
+    }
+
+    memcpy(_player.window.data() + start, bytes, length);
+
+    run = bytes + length;
+  }
+
+  _player.next = run - _player.data.data();
+}
+
+// --------------------------------
+
+int seekPlayback(SessionPlayer& _player, uint32_t _frame)
+{
+  if(!_player.active) { return 0; }
+
+  const uint8_t* data = _player.data.data();
+
+  if(_frame >= _player.frame_count) { _frame = _player.frame_count - 1; }
+
+  // The last keyframe at or before _frame, frame 0 always is one
+
+  uint32_t low = 0;
+  uint32_t high = _player.keyframe_count;
+
+  while(high - low > 1)
+  {
+    const uint32_t middle = (low + high) / 2;
+
+    if(get32(data + _player.index_offset + middle * session_index_size) <= _frame) { low = middle; }
+    else { high = middle; }
+  }
+
+  const uint8_t* keyframe = data + _player.index_offset + low * session_index_size;
+
+  if(_frame < _player.frame || get32(keyframe) > _player.frame) { _player.next = get32(keyframe + 4); }
+
+  int applied = 0;
+
+  while(_player.next < _player.index_offset && get32(data + _player.next) <= _frame)
+  {
+    applyRecord(_player);
+    ++applied;
+  }
+
+  _player.frame = _frame;
+
+  return applied;
+}
+
+// --------------------------------
+
+bool loadSession(const char* _filename, std::vector<uint8_t>& _data)
+{
+  FILE* file = fopen(_filename, "rb");
+
+  if(!file)
+  {
+    printf("Failed to load session %s\n", _filename);
+    return false;
+  }
+
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  _data.resize(size > 0 ? size : 0);
+
+  const bool ok = size > 0 && fread(_data.data(), 1, size, file) == (size_t)size;
+
+  fclose(file);
+
+  if(!ok) { printf("Failed to read session %s\n", _filename); }
+
+  return ok;
+}
+
+// --------------------------------
+
+bool writeSession(const char* _filename, const std::vector<uint8_t>& _data)
+{
+  FILE* file = fopen(_filename, "wb");
+
+  if(!file)
+  {
+    printf("Failed to write %s\n", _filename);
+    return false;
+  }
+
+  const bool ok = fwrite(_data.data(), 1, _data.size(), file) == _data.size();
+
+  fclose(file);
+
+  return ok;
+}
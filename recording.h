@@ -0,0 +1,88 @@
+#ifndef _recording_h_
+#define _recording_h_
+
+#include <cstdint>
+#include <vector>
+
+// --------------------------------
+// Session recording
+//
+// A session is the VPU window ($C000-$D9FF) as it was after each recorded
+// machine frame. Every frame that changed anything is stored as runs of
+// changed bytes against the frame before, and every keyframe_interval frames
+// (or when the runs would be larger) the whole window is stored instead.
+// Frames without changes take no space.
+//
+// Layout, little endian:
+//
+//   header    "RREC", version, keyframe interval, window size, frame count,
+//             record count, index offset, keyframe count
+//   records   frame, run count, flags, then per run: offset, length, bytes
+//   index     frame and record offset of every keyframe, for seeking
+//
+// Playback rebuilds the window by applying the records, so a seek costs one
+// keyframe and at most keyframe_interval records, and fast forward costs
+// only the bytes that changed.
+
+const int session_version           = 1;
+const int session_keyframe_interval = 300;   // Frames, 5 seconds at 60 Hz
+
+struct SessionRecorder
+{
+  std::vector<uint8_t>  data;
+  std::vector<uint8_t>  previous;           // Window as of the last recorded frame
+  std::vector<uint32_t> index;              // Frame, offset pairs
+
+  int      window_size;
+  uint32_t first_sequence;
+  uint32_t frames;
+  uint32_t records;
+  uint32_t keyframe_frame;
+  bool     active;
+};
+
+struct SessionPlayer
+{
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> window;              // As of frame
+  std::vector<uint8_t> changed_pages;       // Set by playback, cleared by the caller
+
+  int      window_size;
+  uint32_t frame_count;
+  uint32_t record_count;
+  uint32_t keyframe_count;
+  size_t   index_offset;
+
+  size_t   next;                            // Offset of the next record
+  uint32_t frame;
+  bool     active;
+};
+
+// Windows must be smaller than 64 KB, runs have 16 bit offsets and lengths
+
+void startRecording(SessionRecorder& _recorder, int _window_size);
+
+// Frames are numbered by machine frame sequence, frames that were never
+// recorded in between keep the window of the one before
+
+void recordFrame(SessionRecorder& _recorder, uint32_t _sequence, const uint8_t* _window);
+
+// Finishes the session and moves it into _data
+
+void stopRecording(SessionRecorder& _recorder, std::vector<uint8_t>& _data);
+
+// Takes the data of a session after checking every record, the window shows
+// frame 0
+
+bool openPlayback(SessionPlayer& _player, std::vector<uint8_t>& _data);
+void closePlayback(SessionPlayer& _player);
+
+// Moves the window to a frame, forwards by applying records and backwards
+// from the nearest keyframe. Returns the number of records applied.
+
+int seekPlayback(SessionPlayer& _player, uint32_t _frame);
+
+bool loadSession(const char* _filename, std::vector<uint8_t>& _data);
+bool writeSession(const char* _filename, const std::vector<uint8_t>& _data);
+
+#endif
@@ -1,4 +1,13 @@
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <SDL.h>
 #include <SDL_image.h>
 #include <SDL_opengles2.h>
@@ -8,12 +17,43 @@
 #include <emscripten.h>
 #endif
 
+// RETRO_RENDER_THREAD moves the GL context and the main loop to a pthread
+// that draws to the canvas through an OffscreenCanvas. The browser main thread
+// only forwards SDL events, so page layout and script on it no longer delay
+// frames.
+
+#ifdef RETRO_RENDER_THREAD
+#ifndef __EMSCRIPTEN__
+#error RETRO_RENDER_THREAD needs an Emscripten build
+#endif
+#include <pthread.h>
+#include <emscripten/html5.h>
+#include <emscripten/threading.h>
+#endif
+
+#include "arena.h"
+#include "audio.h"
+#include "bundle.h"
+#include "charart.h"
+#include "collision.h"
+#include "console.h"
+#include "cpu.h"
 #include "font.h"
+#include "glyphcache.h"
+#include "input.h"
 #include "opengl.h"
+#include "recording.h"
+#include "ringbuffer.h"
 #include "shaders.h"
+#include "trace.h"
+#include "triplebuffer.h"
+#include "ui.h"
 
 // --------------------------------
 
+// These touch the DOM, so with RETRO_RENDER_THREAD they must be run on the
+// main thread (emscripten_async_run_in_main_runtime_thread)
+
 EM_JS(void, chooseFile, (), {
     const choose_file_dialog = document.getElementById("choose_file_dialog");
     choose_file_dialog.style.display = "block";
@@ -24,10 +64,38 @@ EM_JS(void, saveFile, (const char* _filename, const char* _data), {
     saveAs(blob, Module.UTF8ToString(_filename));
     });
 
+// The bytes are copied out, the heap may be shared with other threads
+
+EM_JS(void, saveBinaryFile, (const char* _filename, const uint8_t* _data, int _size), {
+    var blob = new Blob([HEAPU8.slice(_data, _data + _size)], { type: "application/octet-stream" });
+    saveAs(blob, Module.UTF8ToString(_filename));
+    });
+
+// --------------------------------
+
+// How the display is placed in the window, F12 cycles through them. Integer
+// scaling needs no filtering, the others antialias the pixel seams.
+
+enum ScalingMode
+{
+  scaling_integer,                  // Largest whole multiple that fits, letterboxed
+  scaling_fit,                      // Largest size with the display aspect, 95% of larger windows
+  scaling_stretch,                  // The whole window
+  scaling_prescale,                 // As fit, from a nearest scale by the whole part of the scale
+  scaling_mode_count,
+};
+
+const char* const scaling_mode_names[scaling_mode_count] = { "integer", "fit", "stretch", "prescale" };
+
 // --------------------------------
 
 bool running = true;
-GLuint next_texture_unit = 0;
+std::atomic<bool> late_input_latch(false);  // Read by the simulation thread
+bool indexed_display = false;
+bool partial_redraw = true;
+int scaling_mode = scaling_integer;
+bool ui_visible = false;            // The UI owns the character map and colour RAM
+GLuint console_texture_units[3];
 
 struct Window
 {
@@ -53,13 +121,100 @@ struct Display
   GLuint vao;
   GLuint vbo;
   GLuint texture;
+  GLuint palette_texture;
 
   GLuint texture_unit;
+  GLuint palette_texture_unit;
   GLint  screen_size_location;
+  GLint  prescale_location;
+
+  int    scaling;                   // Scaling mode in effect, integer falls back to fit in small windows
+  int    prescale;
 };
 
+// With indexed_display the VPU pass renders palette indices to an R8UI
+// display texture, and the upscale pass resolves them through the display
+// palette: the 16 VPU colours, then the console palettes from
+// console_first_index.
+
+const int display_palette_entries = 256;
+
 Display display;
 
+// VPU register file, mapped at $D800
+
+const int vpu_scroll_x = 0x00;    // 16 bit, pixels
+const int vpu_scroll_y = 0x02;    // 16 bit, pixels
+const int vpu_border   = 0x04;    // Palette index
+const int vpu_control  = 0x05;    // Bit 0: NMI at the start of each frame
+const int vpu_frame    = 0x06;    // Read only, frame counter
+const int vpu_columns  = 0x07;    // Read only, map width in cells
+const int vpu_rows     = 0x08;    // Read only, map height in cells
+const int vpu_palette  = 0x10;    // 16 RGB entries
+const int vpu_animations = 0x40;  // Glyph animation table, to $9F
+
+// Sprite collisions of the last machine frame, read only. Bit n of the masks
+// is sprite n, and each pair is two sprite numbers, the lower first.
+
+const int vpu_sprite_collisions     = 0xA0;   // 32 bit mask, sprites touching another sprite
+const int vpu_background_collisions = 0xA4;   // 32 bit mask, sprites touching a set map pixel
+const int vpu_collision_pair_count  = 0xA8;   // Pairs stored, at most max_collision_pairs
+const int vpu_collision_pairs       = 0xB0;   // To $FF
+
+const int max_collision_pairs = 40;
+
+const int vpu_control_frame_nmi = 0x01;
+
+// Sprite table, mapped at $D900. Each entry is 8 bytes: x and y as 16 bit
+// signed display pixels, glyph, colour (palette index), flags and a spare
+// byte. Sprites are drawn over the character map, unscrolled, with the
+// background of the glyph transparent.
+
+const int sprite_count = 32;
+const int sprite_bytes = 8;
+const int sprite_flags = 6;
+
+const int sprite_flag_visible = 0x01;
+
+// Glyph animation table, in the VPU registers from vpu_animations. Each
+// entry is 12 bytes: the animated glyph, a frame count (0 for an unused
+// entry) and up to 5 frames of glyph and duration in machine frames. Map
+// cells holding an animated glyph show the frame for the current machine
+// frame, picked by the text mode shader, so animated tiles need no map
+// writes. The first entry for a glyph wins. Only 8-bit maps animate.
+
+const int animation_count  = 8;
+const int animation_bytes  = 12;
+const int animation_frames = 5;
+
+static_assert(vpu_animations + animation_count * animation_bytes <= vpu_sprite_collisions, "Glyph animation table overlaps the collision registers");
+
+const uint8_t default_attribute = 0x6E;   // Light blue on blue
+
+const uint8_t default_palette[16 * 3] =
+{
+    0,   0,   0,  255, 255, 255,  136,  57,  50,  103, 182, 189,
+  139,  63, 150,   85, 160,  73,   71,  59, 171,  191, 206, 114,
+  139,  84,  41,   87,  66,   0,  184, 105,  98,   80,  80,  80,
+  120, 120, 120,  148, 224, 137,  135, 122, 222,  159, 159, 159,
+};
+
+struct DirtyRows
+{
+  int first;
+  int last;
+};
+
+// Screen cells drawn by the VPU pass, one instance each
+
+struct VPURect
+{
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+};
+
 struct VPU
 {
   GLuint program;
@@ -68,408 +223,3035 @@ struct VPU
   GLuint fbo;
   GLuint font_texture;
   GLuint map_texture;
+  GLuint attribute_texture;
+  GLuint animation_texture;         // 256 x (1 + animation_frames) RG16UI, by glyph
 
   GLuint font_texture_unit;
   GLuint map_texture_unit;
+  GLuint attribute_texture_unit;
+  GLuint animation_texture_unit;
+  GLint  animation_time_location;
   GLint  screen_size_location;
+  GLint  palette_location;
+  GLint  scroll_location;
+  GLint  map_pixels_location;
+  GLint  glyph_size_location;
+
+  GLuint sprite_program;
+  bool   sprite_program_failed;     // Not built again until the defines change
+  GLuint sprite_vao;
+  GLuint sprite_vbo;
+  GLint  sprite_screen_size_location;
+  GLint  sprite_glyph_size_location;
+  GLint  sprite_palette_location;
+
+  TextMode text_mode;
+
+  // CPU side shadows of the VPU memory. Cells hold a glyph index (or glyph
+  // cache slot in a wide map) and an attribute byte with the foreground
+  // palette index in the low nibble and the background in the high nibble.
+
+  uint8_t* map;
+  uint8_t* attributes;
+  uint8_t  font_ram[font_ram_size];
+  uint8_t  registers[256];
+  uint8_t  sprites[sprite_count * sprite_bytes];
+
+  DirtyRows map_dirty;
+  DirtyRows attributes_dirty;
+  uint64_t  font_dirty[glyph_mask_words];
+  bool      registers_dirty;
+  bool      animations_dirty;
+  bool      sprites_dirty;
+  int       visible_sprites;
+
+  // Partial redraw: the display texture keeps the last frame and only the
+  // screen cells showing a changed cell or sprite are shaded again, as
+  // rectangles of cells in one instanced draw. The drawn_ copies hold what
+  // the display texture shows.
+
+  uint8_t*  drawn_map;
+  uint8_t*  drawn_attributes;
+  uint8_t   drawn_sprites[sprite_count * sprite_bytes];
+  DirtyRows redraw_rows;            // Map rows to compare with what was drawn
+  DirtyRows texture_rows;           // Map rows written straight to the map texture, drawn whole
+  bool      redraw_all;
+  uint64_t  redraw_glyphs[glyph_mask_words];   // Redefined since the last frame drawn
+  int       redefined_glyphs;                  // By the last font update
+
+  uint8_t*  damage;                 // Per screen cell, set when it is to be drawn
+  int       damaged_cells;
+  DirtyRows damaged_rows;           // Screen rows
+
+  VPURect*  rects;                  // In the frame arena
+  int       rect_count;
+  int       redrawn_cells;
+
+  // What the drawn frame depends on besides the cells
+
+  int          scroll_x;
+  int          scroll_y;
+  uint8_t      palette[16 * 3];
+  unsigned int glyph_uploads;
+  unsigned int consoles_uncovered;
+
+  uint8_t      animations[animation_count * animation_bytes];   // As in the animation texture
+  uint32_t     animation_time;                                  // Machine frame sequence
+  uint32_t     drawn_animation_time;
 };
 
 VPU vpu;
 
 // --------------------------------
 
-void setWindowSize(int _width, int _height)
+// Fantasy machine memory map
+//
+// $0000-$BFFF  RAM
+// $C000-$C7FF  Character map (8-bit maps only, row major)
+// $C800-$CFFF  Colour RAM (cell attributes)
+// $D000-$D7FF  Font RAM
+// $D800-$D8FF  VPU registers
+// $D900-$D9FF  Sprite table
+// $DA00-$DAFF  Sound chip registers (write only, see audio.h)
+// $DB00-$DBFF  Input page (see input.h)
+// $DC00-$FFFF  RAM
+//
+// The machine runs on its own thread and owns all of this memory. The VPU
+// shadows are updated from snapshots of $C000-$D9FF handed over once per
+// machine frame.
+
+const int machine_map_page       = 0xC0;
+const int machine_attribute_page = 0xC8;
+const int machine_font_page      = 0xD0;
+const int machine_register_page  = 0xD8;
+const int machine_sprite_page    = 0xD9;
+const int machine_sound_page     = 0xDA;
+const int machine_input_page     = 0xDB;
+const int machine_window_pages   = 8;
+const int machine_window_size    = machine_window_pages * 256;
+const int machine_vpu_pages      = machine_sprite_page + 1 - machine_map_page;
+
+const int machine_cycles_per_frame = 1000000 / 60;   // 1 MHz
+
+struct Machine
 {
-  window.width = _width;
-  window.height = _height;
-  window.aspect = (float)_width / (float)_height;
-}
+  CPU     cpu;
+  uint8_t ram[65536];
 
-// --------------------------------
+  bool    running;
+  int     cycles_per_frame;
+  int     frame_cycles;
 
-void setDisplaySize(int _width, int _height)
+  uint8_t sound_registers[256];     // As last sent to the sound chip
+  bool    sound_pending;            // Writes the ring could not take, retried next frame
+
+  uint32_t input_timestamps[input_latch_timestamps];
+  int      input_count;
+
+  Collisions collisions;
+};
+
+Machine machine;
+
+// VPU memory as the render thread sees it after a machine frame, with the
+// pages the CPU wrote during that frame
+
+struct MachineFrame
 {
-  display.width = _width;
-  display.height = _height;
-  display.aspect = (float)_width / (float)_height;
+  uint32_t sequence;
+  int      cycles;
+  bool     running;
+  bool     waiting;
 
-  display.cell_width = _width / 8;
-  display.cell_height = _height / 8;
-}
+  uint32_t input_timestamps[input_latch_timestamps];   // Of the input latched for the frame
+  int      input_count;
 
-// --------------------------------
+  uint8_t  written_pages[machine_vpu_pages];
+  uint8_t  memory[machine_vpu_pages * 256];
+};
 
-bool initWindow(int _width, int _height)
+struct Simulation
 {
-  setWindowSize(_width, _height);
+  std::thread       thread;
+  std::atomic<bool> quit;
 
-  window.sdl_window = SDL_CreateWindow("Retro", 
-      SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-      window.width, window.height, 
-      SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_SHOWN);
+  // Display size in cells for the read only registers, set by the render thread
 
-  if(!window.sdl_window)
-  {
-    printf("Failed to create SDL window\n");
-    return false;
-  }
+  std::atomic<int>  columns;
+  std::atomic<int>  rows;
 
-  window.id = SDL_GetWindowID(window.sdl_window);
+  TripleBuffer<MachineFrame> frames;
+  uint32_t published;               // Simulation thread only
+  uint32_t applied;                 // Render thread only
 
-  return true;
-}
+  // Late input latching: a machine frame that is due waits for the render
+  // thread to poll input and wake it, so the frame runs on that input.
+  // Guarded by latch_mutex.
 
-// --------------------------------
+  std::mutex                            latch_mutex;
+  std::condition_variable               latch_changed;
+  std::chrono::steady_clock::time_point next_frame;
+  bool                                  latch_requested;
+  bool                                  started;
 
-bool initDisplay(int _width, int _height)
-{
-  setDisplaySize(_width, _height);
+  // Machine status as of the last applied frame
 
-  glGenVertexArrays(1, &display.vao);
-  glBindVertexArray(display.vao);
+  int      frame_cycles;
+  bool     running;
+  bool     waiting;
 
-  glGenBuffers(1, &display.vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, display.vbo);
-  glBufferData(GL_ARRAY_BUFFER, 4 * 4 * sizeof(GLfloat), nullptr, GL_STATIC_DRAW);
+  // Input latched for the frame being drawn, to be timed when it is swapped
 
-  display.program = createProgram(pixel_upscale_vs, pixel_upscale_fs);
+  uint32_t input_timestamps[input_latch_timestamps];
+  int      input_count;
+};
 
-  if(!display.program) { return false; }
+Simulation simulation;
 
-  glUseProgram(display.program);
+const char* unicode_font_filename = "fonts/unicode.bdf";
+const char* bundle_filename = "retro.bundle";
 
-  GLint position_location = glGetAttribLocation(display.program, "position");
-  glEnableVertexAttribArray(position_location);
-  glVertexAttribPointer(position_location, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+// Set once the bundle has been loaded (or failed to), read by the render thread
 
-  GLint uv_location = glGetAttribLocation(display.program, "uv");
-  glEnableVertexAttribArray(uv_location);
-  glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (const void*)(2 * sizeof(GLfloat)));
+std::atomic<Bundle*> assets(nullptr);
 
-  display.texture_unit = next_texture_unit++;
+const char* startup_program_filename = nullptr;
+const char* startup_art_filename = nullptr;
+const char* trace_filename = "retro_trace.json";
+const char* session_filename = "retro_session.rrec";
 
-  GLint screen_sampler_location = glGetUniformLocation(display.program, "screen_sampler");
-  glUniform1i(screen_sampler_location, display.texture_unit);
+struct Overlay
+{
+  bool   visible;
+  int    frames_until_refresh;
+  int    rows;
 
-  display.screen_size_location = glGetUniformLocation(display.program, "screen_size");
-  glUniform2f(display.screen_size_location, display.width, display.height);
+  GLCallCounters gl_calls;
+};
 
-  display.texture = createTexture(display.texture_unit, display.width, display.height, nullptr, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, GL_LINEAR);
+Overlay overlay;
 
-  if(!display.texture) { return false; }
+// Heap use of the frame loop. The first frames fill caches and grow
+// buffers, after them every frame should leave the heap alone.
 
-  return true;
-}
+const unsigned int heap_warmup_frames = 120;
 
-// --------------------------------
+struct FrameHeap
+{
+  HeapCounts   last;                // Last frame
+  unsigned int frames;
+  unsigned int allocating_frames;   // After the warm up
+  unsigned int reported;            // Frame of the last report
+};
 
-void showDisplay()
+FrameHeap frame_heap;
+
+// Startup is a list of timed stages. startup() runs only what the first
+// frame needs, the machine, the window and the GL context, and shows a
+// cleared screen. update() runs the rest, as many stages a frame as fit in
+// startup_frame_budget_ms, clearing the screen until they are done. Input
+// waits in the event queue meanwhile.
+
+const double startup_frame_budget_ms = 8.0;
+const int startup_max_stages = 16;
+
+struct StartupStage
 {
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  glViewport(0, 0, window.width, window.height);
-  glClearColor(0.53f, 0.48f, 0.87f, 1.0f);
-  glClear(GL_COLOR_BUFFER_BIT);
-  glUseProgram(display.program);
-  glBindVertexArray(display.vao);
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-}
+  const char* name;
+  double      ms;
+};
 
-// --------------------------------
+struct StartupProfile
+{
+  uint64_t     start;               // traceNow() when main() began
+  uint64_t     stage_start;
+  double       page_ms;             // Page load to main(), on the web
+  double       first_frame_ms;      // 0 until then
+  double       ready_ms;
+
+  StartupStage stages[startup_max_stages];
+  int          stage_count;
+  int          next_deferred;
+  bool         ready;
+};
 
-void destroyDisplay()
+StartupProfile startup_profile;
+
+// A grid of consoles drawn over the display below the overlay rows
+
+const int dashboard_grid = 8;
+const int dashboard_top = 64;       // Pixels
+
+struct Dashboard
 {
-  glDeleteProgram(display.program);
-  glDeleteBuffers(1, &display.vbo);
-  glDeleteVertexArrays(1, &display.vao);
-  glDeleteTextures(1, &display.texture);
-}
+  bool         visible;
+  int          panes[console_max];
+  int          pane_count;
+  unsigned int frame;
+};
 
-// --------------------------------
+Dashboard dashboard;
 
-void updateDisplayVBO()
+// F8 records the machine frames shown, F9 plays the last recording back in
+// place of the machine
+
+const int session_speeds[] = { 1, 16, 256 };
+const int session_seek_frames = 10 * 60;
+
+struct Session
 {
-  GLfloat vertices[16];
+  SessionRecorder      recorder;
+  SessionPlayer        player;
+  std::vector<uint8_t> last;        // Last recording made or loaded
+  int                  speed;       // Index into session_speeds
+  int                  applied;     // Records applied by the last playback step
 
-  const GLfloat display_size = window.width > 320 ? 0.95f : 1.0f;
+  MachineFrame         frame;       // Played back frame, for applyMachineFrame()
+};
 
-  if(window.aspect < display.aspect)     // Portrait Device
-  {
-    vertices[0]  =  display_size;
-    vertices[1]  =  display_size * window.aspect / display.aspect;
-    vertices[2]  =  1.0f;
-    vertices[3]  =  0.0f;
+Session session;
 
-    vertices[4]  = -display_size;
-    vertices[5]  =  display_size * window.aspect / display.aspect;
-    vertices[6]  =  0.0f;
-    vertices[7]  =  0.0f;
+CharArt char_art;
 
-    vertices[8]  =  display_size;
-    vertices[9]  = -display_size * window.aspect / display.aspect;
-    vertices[10] =  1.0f;
-    vertices[11] =  1.0f;
+#ifdef RETRO_RENDER_THREAD
 
-    vertices[12] = -display_size;
-    vertices[13] = -display_size * window.aspect / display.aspect;
-    vertices[14] =  0.0f;
-    vertices[15] =  1.0f;
-  }
-  else                                  // Landscape Device
-  {
-    vertices[0]  =  display_size * display.aspect / window.aspect;
-    vertices[1]  =  display_size;
-    vertices[2]  =  1.0f;
-    vertices[3]  =  0.0f;
+// SDL events polled on the main thread, for the render thread
 
-    vertices[4]  = -display_size * display.aspect / window.aspect;
-    vertices[5]  =  display_size;
-    vertices[6]  =  0.0f;
-    vertices[7]  =  0.0f;
+struct EventQueue
+{
+  RingBuffer<SDL_Event, 256> events;
+  unsigned int dropped;             // Main thread only
+};
 
-    vertices[8]  =  display_size * display.aspect / window.aspect;
-    vertices[9]  = -display_size;
-    vertices[10] =  1.0f;
-    vertices[11] =  1.0f;
+EventQueue event_queue;
 
-    vertices[12] = -display_size * display.aspect / window.aspect;
-    vertices[13] = -display_size;
-    vertices[14] =  0.0f;
-    vertices[15] =  1.0f;
-  }
+#endif
 
-  glBindBuffer(GL_ARRAY_BUFFER, display.vbo);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+// --------------------------------
+
+void setWindowSize(int _width, int _height)
+{
+  window.width = _width;
+  window.height = _height;
+  window.aspect = (float)_width / (float)_height;
 }
 
 // --------------------------------
 
-void resizeWindow(int _width, int _height)
+void setDisplaySize(int _width, int _height)
 {
-  setWindowSize(_width, _height);
+  display.width = _width;
+  display.height = _height;
+  display.aspect = (float)_width / (float)_height;
 
-  updateDisplayVBO();
+  display.cell_width = _width / vpu.text_mode.glyph_width;
+  display.cell_height = _height / vpu.text_mode.glyph_height;
 
-  printf("Window: %4d x %4d\n", window.width, window.height);
+  simulation.columns.store(display.cell_width, std::memory_order_relaxed);
+  simulation.rows.store(display.cell_height, std::memory_order_relaxed);
 }
 
 // --------------------------------
 
-void resizeDisplay(int _width, int _height)
-{
-  setDisplaySize(_width, _height);
-
-  updateDisplayVBO();
+int mapCellBytes() { return vpu.text_mode.wide_map ? 2 : 1; }
+GLint mapInternalFormat() { return vpu.text_mode.wide_map ? GL_R16UI : GL_R8UI; }
+GLenum mapType() { return vpu.text_mode.wide_map ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE; }
 
-  glUseProgram(vpu.program);
-  glUniform2f(vpu.screen_size_location, display.width, display.height);
+// The shadows are at least as large as their machine memory window
 
-  glUseProgram(display.program);
-  glUniform2f(display.screen_size_location, display.width, display.height);
+int mapAllocationBytes() { return std::max(display.cell_width * display.cell_height * mapCellBytes(), machine_window_size); }
+int attributeAllocationBytes() { return std::max(display.cell_width * display.cell_height, machine_window_size); }
 
-  resizeTexture(display.texture_unit, display.texture, display.width, display.height, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE);
-  resizeTexture(vpu.map_texture_unit, vpu.map_texture, display.cell_width, display.cell_height, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE);
+// Screen cells include the partial cells on the right and bottom edges
 
-  printf("Display: %4d x %4d\n", display.width, display.height);
-}
+int screenColumns() { return (display.width + vpu.text_mode.glyph_width - 1) / vpu.text_mode.glyph_width; }
+int screenRows() { return (display.height + vpu.text_mode.glyph_height - 1) / vpu.text_mode.glyph_height; }
 
 // --------------------------------
 
-bool initVPU()
+void markRowsDirty(DirtyRows& _rows, int _first_row, int _last_row)
 {
-  GLfloat vertices[16];
+  _last_row = std::min(_last_row, display.cell_height - 1);
+  if(_first_row > _last_row) { return; }
 
-  vertices[0]  =  1.0f;
-  vertices[1]  =  1.0f;
-  vertices[2]  =  1.0f;
-  vertices[3]  =  1.0f;
+  if(_rows.first > _rows.last)
+  {
+    _rows.first = _first_row;
+    _rows.last = _last_row;
+  }
+  else
+  {
+    _rows.first = std::min(_rows.first, _first_row);
+    _rows.last = std::max(_rows.last, _last_row);
+  }
+}
 
-  vertices[4]  = -1.0f;
-  vertices[5]  =  1.0f;
-  vertices[6]  =  0.0f;
-  vertices[7]  =  1.0f;
+// --------------------------------
 
-  vertices[8]  =  1.0f;
-  vertices[9]  = -1.0f;
-  vertices[10] =  1.0f;
-  vertices[11] =  0.0f;
+void clearDirtyRows(DirtyRows& _rows)
+{
+  _rows.first = 0;
+  _rows.last = -1;
+}
 
-  vertices[12] = -1.0f;
-  vertices[13] = -1.0f;
-  vertices[14] =  0.0f;
-  vertices[15] =  0.0f;
+// --------------------------------
 
-  glGenVertexArrays(1, &vpu.vao);
-  glBindVertexArray(vpu.vao);
+uint8_t* machinePage(int _page) { return machine.ram + _page * 256; }
 
-  glGenBuffers(1, &vpu.vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, vpu.vbo);
-  glBufferData(GL_ARRAY_BUFFER, 4 * 4 * sizeof(GLfloat), vertices, GL_STATIC_DRAW);
+// --------------------------------
 
-  vpu.program = createProgram(text_mode_vs, text_mode_fs);
+void captureMachineFrame(MachineFrame& _frame)
+{
+  _frame.cycles = machine.frame_cycles;
+  _frame.running = machine.running;
+  _frame.waiting = machine.cpu.waiting;
 
-  if(!vpu.program) { return false; }
+  _frame.input_count = machine.input_count;
+  memcpy(_frame.input_timestamps, machine.input_timestamps, machine.input_count * sizeof(uint32_t));
 
-  glUseProgram(vpu.program);
+  memcpy(_frame.written_pages, machine.cpu.written_pages + machine_map_page, sizeof(_frame.written_pages));
+  memcpy(_frame.memory, machinePage(machine_map_page), sizeof(_frame.memory));
+}
 
-  GLint position_location = glGetAttribLocation(vpu.program, "position");
-  glEnableVertexAttribArray(position_location);
-  glVertexAttribPointer(position_location, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+// --------------------------------
 
-  GLint uv_location = glGetAttribLocation(vpu.program, "uv");
-  glEnableVertexAttribArray(uv_location);
-  glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (const void*)(2 * sizeof(GLfloat)));
+// Fills the VPU memory with its power on state and hands the same snapshot
+// to every frame buffer, so the render thread has valid state before the
+// simulation thread starts
 
-  vpu.font_texture_unit = next_texture_unit++;
+void initMachine()
+{
+  initCPU(machine.cpu);
+  mapCPUMemory(machine.cpu, 0, 256, machine.ram, true);
 
-  GLint font_sampler_location = glGetUniformLocation(vpu.program, "font_sampler");
-  glUniform1i(font_sampler_location, vpu.font_texture_unit);
+  machine.running = false;
+  machine.cycles_per_frame = machine_cycles_per_frame;
+  machine.input_count = 0;
+  machine.sound_pending = false;
 
-  vpu.map_texture_unit = next_texture_unit++;
+  initInput();
 
-  GLint map_sampler_location = glGetUniformLocation(vpu.program, "map_sampler");
-  glUniform1i(map_sampler_location, vpu.map_texture_unit);
+  uint8_t* map = machinePage(machine_map_page);
+  for(int i = 0; i < machine_window_size; ++i) { map[i] = rand() & 0xFF; }
 
-  vpu.screen_size_location = glGetUniformLocation(vpu.program, "screen_size");
-  glUniform2f(vpu.screen_size_location, display.width, display.height);
+  memset(machinePage(machine_attribute_page), default_attribute, machine_window_size);
+  copyBuiltinFont(machinePage(machine_font_page));
 
-  vpu.font_texture = loadFont(vpu.font_texture_unit);
-  if(!vpu.font_texture) { return false; }
+  uint8_t* registers = machinePage(machine_register_page);
+  memcpy(registers + vpu_palette, default_palette, sizeof(default_palette));
+  registers[vpu_border] = 14;
 
-  const int cell_count = display.cell_width * display.cell_height;
-  uint8_t* map = (uint8_t*)malloc(cell_count);
-  uint8_t* map_ptr = map;
+  initTripleBuffer(simulation.frames);
 
-  for(int i = cell_count; i--; ++map_ptr)
+  for(int i = 0; i < 3; ++i)
   {
-    *map_ptr = rand() & 0xFF;
+    captureMachineFrame(simulation.frames.buffers[i]);
+    simulation.frames.buffers[i].sequence = 0;
   }
 
-  vpu.map_texture = createTexture(vpu.map_texture_unit, display.cell_width, display.cell_height, map, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, GL_NEAREST);
-  if(!vpu.map_texture) { return false; }
+  simulation.published = 0;
+  simulation.applied = 0;
+}
+
+// --------------------------------
 
-  free(map);
+// Copies the pages of a machine frame into the VPU shadows and marks them
+// dirty. The CPU cannot see a wide map.
 
-  glGenFramebuffers(1, &vpu.fbo);
-  glBindFramebuffer(GL_FRAMEBUFFER, vpu.fbo);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, display.texture, 0);
-  GLenum DrawBuffers[1] = {GL_COLOR_ATTACHMENT0};
-  glDrawBuffers(1, DrawBuffers);
-  if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+void applyMachineFrame(const MachineFrame& _frame, bool _all_pages)
+{
+  auto page = [&](int _page) { return _frame.memory + (_page - machine_map_page) * 256; };
+  auto changed = [&](int _page) { return _all_pages || _frame.written_pages[_page - machine_map_page]; };
+
+  vpu.animation_time = _frame.sequence;
+
+  for(int i = 0; i < machine_window_pages; ++i)
   {
-    printf("Failed to create Framebuffer\n");
-    return false;
-  }
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    const int first_row = i * 256 / display.cell_width;
+    const int last_row = (i * 256 + 255) / display.cell_width;
 
-  return true;
-}
+    if(!vpu.text_mode.wide_map && !ui_visible && changed(machine_map_page + i))
+    {
+      memcpy(vpu.map + i * 256, page(machine_map_page + i), 256);
+      markRowsDirty(vpu.map_dirty, first_row, last_row);
+    }
 
-// --------------------------------
+    if(!ui_visible && changed(machine_attribute_page + i))
+    {
+      memcpy(vpu.attributes + i * 256, page(machine_attribute_page + i), 256);
+      markRowsDirty(vpu.attributes_dirty, first_row, last_row);
+    }
 
-void renderVPU()
-{
-  glActiveTexture(GL_TEXTURE0 + display.texture_unit);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glBindFramebuffer(GL_FRAMEBUFFER, vpu.fbo);
-  glViewport(0, 0, display.width, display.height);
-  glClearColor(0.28f, 0.23f, 0.67f, 1.0f);
-  glClear(GL_COLOR_BUFFER_BIT);
-  glUseProgram(vpu.program);
-  glBindVertexArray(vpu.vao);
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-  glBindTexture(GL_TEXTURE_2D, display.texture);
-}
+    if(changed(machine_font_page + i))
+    {
+      writeGlyphs(vpu.font_ram, i * 32, 32, page(machine_font_page + i), vpu.font_dirty);
+    }
+  }
 
-// --------------------------------
+  if(changed(machine_register_page))
+  {
+    memcpy(vpu.registers, page(machine_register_page), sizeof(vpu.registers));
+    vpu.registers_dirty = true;
+  }
 
-void destroyVPU()
-{
-  glDeleteProgram(vpu.program);
-  glDeleteBuffers(1, &vpu.vbo);
-  glDeleteVertexArrays(1, &vpu.vao);
-  glDeleteTextures(1, &vpu.font_texture);
-  glDeleteTextures(1, &vpu.map_texture);
-  glDeleteFramebuffers(1, &vpu.fbo);
+  if(changed(machine_sprite_page))
+  {
+    memcpy(vpu.sprites, page(machine_sprite_page), sizeof(vpu.sprites));
+    vpu.sprites_dirty = true;
+  }
+
+  simulation.frame_cycles = _frame.cycles;
+  simulation.running = _frame.running;
+  simulation.waiting = _frame.waiting;
 }
 
 // --------------------------------
 
-bool initSDL(void)
+// Loads a program in PRG format (2 byte little endian load address, then the
+// data) through the memory map, so it can also fill the VPU windows, and
+// resets the CPU. Programs that do not set the reset vector start at their
+// load address. Must be called before the simulation thread starts.
+
+bool loadProgram(const char* _filename)
 {
-  if(SDL_Init(SDL_INIT_VIDEO) != 0) {
-    printf("Failed to initialize SDL:  %s\n", SDL_GetError());
+  FILE* file = fopen(_filename, "rb");
+
+  if(!file)
+  {
+    printf("Failed to load program %s\n", _filename);
     return false;
   }
 
-  if(!initWindow(640, 480)) { return false; }
+  uint8_t header[2];
+  if(fread(header, 1, 2, file) != 2)
+  {
+    fclose(file);
+    return false;
+  }
 
-  return true;
-}
+  const int load_address = header[0] | (header[1] << 8);
+  int address = load_address;
+  int c;
 
-// --------------------------------
+  while(address <= 0xFFFF && (c = fgetc(file)) != EOF)
+  {
+    writeCPUMemory(machine.cpu, address++, c);
+  }
 
-bool initOpenGL(void)
-{
-  SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
-  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
-  SDL_GL_SetSwapInterval(1);
-  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+  fclose(file);
 
-  SDL_GLContext context = SDL_GL_CreateContext(window.sdl_window);
+  const bool sets_reset_vector = load_address <= 0xFFFC && address > 0xFFFD;
 
-  if(!context)
+  if(!sets_reset_vector)
   {
-    printf("Failed to create the OpenGL context\n");
-    return false;
+    writeCPUMemory(machine.cpu, 0xFFFC, load_address & 0xFF);
+    writeCPUMemory(machine.cpu, 0xFFFD, load_address >> 8);
   }
 
-  printf("%s\n",glGetString(GL_VERSION));
-  printf("%s\n",glGetString(GL_SHADING_LANGUAGE_VERSION));
+  resetCPU(machine.cpu);
 
-  if(!initDisplay(320, 240)) { return false; }
-  if(!initVPU()) { return false; }
+  machine.running = true;
 
-  resizeWindow(640, 480);
+  printf("Program %s: $%04X-$%04X\n", _filename, load_address, address - 1);
 
   return true;
 }
 
 // --------------------------------
 
-bool startup(void)
+// Sends the sound registers the CPU changed during the frame to the audio
+// callback. Only the value at the end of the frame is sent.
+
+void syncSoundWrites()
 {
-  if(!initSDL()) { return false; }
-  if(!initOpenGL()) { return false; }
+  if(!machine.cpu.written_pages[machine_sound_page] && !machine.sound_pending) { return; }
 
-  // saveFile("game", "The time has come the Walrus said, to talk of many things.");
-  // chooseFile();
+  const uint8_t* registers = machinePage(machine_sound_page);
+  bool sent = true;
 
-  return true;
-}
+  for(int i = 0; i < 256; ++i)
+  {
+    if(registers[i] == machine.sound_registers[i]) { continue; }
 
-// --------------------------------
+    if(queueSoundWrite(i, registers[i])) { machine.sound_registers[i] = registers[i]; }
+    else { sent = false; }
+  }
 
-void render(void)
-{
-  renderVPU();
-  showDisplay();
+  // Writes that did not fit in the ring are retried next frame. The page
+  // flags are cleared when the frame is published, so this has its own.
 
-  SDL_GL_SwapWindow(window.sdl_window);
+  machine.sound_pending = !sent;
 }
 
 // --------------------------------
 
-void update(void)
+// Copies the assets the machine can see into its memory: the font to font
+// RAM, the palette to the palette registers and the "screen" map to the
+// character map and colour RAM. Runs before the simulation thread starts.
+
+void applyBundle(const Bundle& _bundle)
 {
-  SDL_Event event;
+  uint8_t* written = machine.cpu.written_pages;
 
-  while(SDL_PollEvent(&event))
+  const BundleEntry* font = findBundleEntry(_bundle, "font", bundle_font);
+
+  if(font && font->size >= font_ram_size)
   {
-    switch (event.type)
-    {
-      case SDL_QUIT:
-        running = false;
+    memcpy(machinePage(machine_font_page), bundleData(_bundle, *font), font_ram_size);
+    memset(written + machine_font_page, 1, machine_window_pages);
+  }
+
+  const BundleEntry* palette = findBundleEntry(_bundle, "palette", bundle_palette);
+
+  if(palette && palette->size >= sizeof(default_palette))
+  {
+    memcpy(machinePage(machine_register_page) + vpu_palette, bundleData(_bundle, *palette), sizeof(default_palette));
+    written[machine_register_page] = 1;
+  }
+
+  const BundleEntry* map = findBundleEntry(_bundle, "screen", bundle_map);
+
+  if(map && map->size >= (uint32_t)map->width * map->height * ((map->format & bundle_map_attributes) ? 2 : 1))
+  {
+    // Laid out for the current display width, which the window does not know
+
+    const int columns = simulation.columns.load() > 0 ? simulation.columns.load() : map->width;
+    const int width = std::min((int)map->width, columns);
+    const int height = std::min((int)map->height, machine_window_size / columns);
+
+    const uint8_t* cells = bundleData(_bundle, *map);
+    const uint8_t* attributes = cells + map->width * map->height;
+
+    memset(machinePage(machine_map_page), ' ', machine_window_size);
+
+    for(int y = 0; y < height; ++y)
+    {
+      memcpy(machinePage(machine_map_page) + y * columns, cells + y * map->width, width);
+
+      if(map->format & bundle_map_attributes)
+      {
+        memcpy(machinePage(machine_attribute_page) + y * columns, attributes + y * map->width, width);
+      }
+    }
+
+    memset(written + machine_map_page, 1, machine_window_pages);
+    memset(written + machine_attribute_page, 1, machine_window_pages);
+  }
+}
+
+// --------------------------------
+
+// Finds the sprite collisions of the frame just run and stores them in the
+// collision registers for the guest to read in the next one. Cells are
+// taken as 8x8 pixels, as the machine sees them.
+
+void updateCollisions()
+{
+  TRACE_SCOPE("updateCollisions");
+
+  uint8_t* registers = machinePage(machine_register_page);
+  const uint8_t* table = machinePage(machine_sprite_page);
+
+  CollisionSprite sprites[sprite_count];
+
+  for(int i = 0; i < sprite_count; ++i)
+  {
+    const uint8_t* entry = table + i * sprite_bytes;
+
+    sprites[i].x = (int16_t)(entry[0] | (entry[1] << 8));
+    sprites[i].y = (int16_t)(entry[2] | (entry[3] << 8));
+    sprites[i].glyph = entry[4];
+    sprites[i].visible = (entry[sprite_flags] & sprite_flag_visible) != 0;
+  }
+
+  CollisionScene scene;
+  scene.sprites = sprites;
+  scene.sprite_count = sprite_count;
+  scene.map = machinePage(machine_map_page);
+  scene.map_size = machine_window_size;
+  scene.columns = simulation.columns.load(std::memory_order_relaxed);
+  scene.rows = simulation.rows.load(std::memory_order_relaxed);
+  scene.font_ram = machinePage(machine_font_page);
+  scene.scroll_x = registers[vpu_scroll_x] | (registers[vpu_scroll_x + 1] << 8);
+  scene.scroll_y = registers[vpu_scroll_y] | (registers[vpu_scroll_y + 1] << 8);
+
+  Collisions& collisions = machine.collisions;
+  detectCollisions(collisions, scene);
+
+  const int pairs = std::min((int)collisions.pairs.size() / 2, max_collision_pairs);
+
+  for(int i = 0; i < 4; ++i)
+  {
+    registers[vpu_sprite_collisions + i] = (collisions.sprites >> (i * 8)) & 0xFF;
+    registers[vpu_background_collisions + i] = (collisions.background >> (i * 8)) & 0xFF;
+  }
+
+  registers[vpu_collision_pair_count] = pairs;
+  if(pairs) { memcpy(registers + vpu_collision_pairs, collisions.pairs.data(), pairs * 2); }
+}
+
+// --------------------------------
+
+// Runs one frame worth of guest code
+
+void runMachine()
+{
+  TRACE_SCOPE("runMachine");
+
+  machine.input_count = latchInput(machinePage(machine_input_page), machine.input_timestamps, input_latch_timestamps);
+
+  if(!machine.running) { return; }
+
+  uint8_t* registers = machinePage(machine_register_page);
+
+  registers[vpu_frame]++;
+  registers[vpu_columns] = std::min(simulation.columns.load(std::memory_order_relaxed), 255);
+  registers[vpu_rows] = std::min(simulation.rows.load(std::memory_order_relaxed), 255);
+
+  if(registers[vpu_control] & vpu_control_frame_nmi) { triggerNMI(machine.cpu); }
+
+  machine.frame_cycles = runCPU(machine.cpu, machine.cycles_per_frame);
+
+  updateCollisions();
+  syncSoundWrites();
+}
+
+// --------------------------------
+
+void publishMachineFrame()
+{
+  MachineFrame& frame = backBuffer(simulation.frames);
+
+  captureMachineFrame(frame);
+  frame.sequence = ++simulation.published;
+
+  memset(machine.cpu.written_pages, 0, sizeof(machine.cpu.written_pages));
+
+  publishBackBuffer(simulation.frames);
+}
+
+// --------------------------------
+
+// Runs the machine at 60 frames per second of wall clock time, independent of
+// the display refresh. After falling more than a few frames behind it drops
+// the backlog instead of trying to catch up.
+
+void simulationThread()
+{
+  setTraceThreadName("simulation");
+
+  typedef std::chrono::steady_clock Clock;
+
+  const Clock::duration frame_time = std::chrono::microseconds(1000000 / 60);
+  Clock::time_point next_frame = Clock::now();
+
+  while(!simulation.quit.load(std::memory_order_relaxed))
+  {
+    runMachine();
+    publishMachineFrame();
+
+    next_frame += frame_time;
+
+    const Clock::time_point now = Clock::now();
+    if(now > next_frame + 4 * frame_time) { next_frame = now; }
+
+    std::unique_lock<std::mutex> lock(simulation.latch_mutex);
+
+    simulation.latch_requested = false;
+    simulation.next_frame = next_frame;
+    simulation.latch_changed.notify_all();
+
+    // With late latching a due frame waits up to half a frame for the render
+    // thread, so the machine keeps time when nothing is drawn
+
+    const bool late = late_input_latch.load(std::memory_order_relaxed);
+
+    simulation.latch_changed.wait_until(lock, late ? next_frame + frame_time / 2 : next_frame, [&]()
+    {
+      return simulation.latch_requested || simulation.quit.load(std::memory_order_relaxed);
+    });
+  }
+}
+
+// --------------------------------
+
+// The render thread waits at most this long for the frame it woke, so heavy
+// guest code costs a frame of latency rather than render time. The browser
+// main thread does not wait at all.
+
+#if defined(__EMSCRIPTEN__) && !defined(RETRO_RENDER_THREAD)
+const std::chrono::microseconds late_latch_wait(0);
+#else
+const std::chrono::microseconds late_latch_wait(2000);
+#endif
+
+// --------------------------------
+
+// Render thread, right after polling input. A machine frame that is due is
+// started now, on the input just queued. If it is published within
+// late_latch_wait syncMachineFrame() picks it up, otherwise the next
+// render does.
+
+void latchMachineFrame()
+{
+  std::unique_lock<std::mutex> lock(simulation.latch_mutex);
+
+  if(!simulation.started || std::chrono::steady_clock::now() < simulation.next_frame) { return; }
+
+  simulation.latch_requested = true;
+  simulation.latch_changed.notify_all();
+
+  if(late_latch_wait.count() == 0) { return; }
+
+  simulation.latch_changed.wait_for(lock, late_latch_wait, []() { return !simulation.latch_requested; });
+}
+
+// --------------------------------
+
+void startSimulation()
+{
+  {
+    std::lock_guard<std::mutex> lock(simulation.latch_mutex);
+    simulation.quit.store(false);
+    simulation.latch_requested = false;
+    simulation.next_frame = std::chrono::steady_clock::now();
+    simulation.started = true;
+  }
+
+  simulation.thread = std::thread(simulationThread);
+}
+
+// --------------------------------
+
+void stopSimulation()
+{
+  {
+    std::lock_guard<std::mutex> lock(simulation.latch_mutex);
+    simulation.quit.store(true);
+    simulation.started = false;
+    simulation.latch_changed.notify_all();
+  }
+
+  if(simulation.thread.joinable()) { simulation.thread.join(); }
+}
+
+// --------------------------------
+
+// Converts an image, stretched to _columns x _rows cells, into character art
+// with the font and palette set in char_art
+
+bool loadCharArt(const char* _filename, uint8_t* _cells, uint8_t* _attributes, int _columns, int _rows)
+{
+  SDL_Surface* image = IMG_Load(_filename);
+
+  if(!image)
+  {
+    printf("Failed to load %s, due to %s\n", _filename, IMG_GetError());
+    return false;
+  }
+
+  SDL_Surface* rgb = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_RGB24, 0);
+  SDL_Surface* scaled = SDL_CreateRGBSurfaceWithFormat(0, _columns * char_art_block, _rows * char_art_block, 24, SDL_PIXELFORMAT_RGB24);
+
+  SDL_FreeSurface(image);
+
+  const bool ok = rgb && scaled && SDL_BlitScaled(rgb, nullptr, scaled, nullptr) == 0;
+
+  if(ok)
+  {
+    // Worker threads cannot be started and joined from the browser main thread
+
+#ifdef __EMSCRIPTEN__
+    const int threads = 1;
+#else
+    const int threads = std::thread::hardware_concurrency();
+#endif
+
+    const CharArtImage pixels = { (const uint8_t*)scaled->pixels, scaled->w, scaled->h, scaled->pitch };
+    convertCharArt(char_art, pixels, _cells, _attributes, _columns, threads);
+  }
+  else
+  {
+    printf("Failed to scale %s\n", _filename);
+  }
+
+  if(rgb) { SDL_FreeSurface(rgb); }
+  if(scaled) { SDL_FreeSurface(scaled); }
+
+  return ok;
+}
+
+// --------------------------------
+
+// --art shows an image converted to character art in the machine map and
+// colour RAM, with the machine font and palette. Must be called before the
+// simulation thread starts.
+
+void applyCharArt(const char* _filename)
+{
+  const int columns = simulation.columns.load() > 0 ? simulation.columns.load() : 40;
+  const int rows = std::min(simulation.rows.load() > 0 ? simulation.rows.load() : 30, machine_window_size / columns);
+
+  setCharArtFont(char_art, machinePage(machine_font_page));
+  setCharArtPalette(char_art, machinePage(machine_register_page) + vpu_palette);
+
+  if(!loadCharArt(_filename, machinePage(machine_map_page), machinePage(machine_attribute_page), columns, rows)) { return; }
+
+  memset(machine.cpu.written_pages + machine_map_page, 1, machine_window_pages);
+  memset(machine.cpu.written_pages + machine_attribute_page, 1, machine_window_pages);
+}
+
+// --------------------------------
+
+// Loads the character art and the startup program over the bundle assets,
+// then starts the machine.
+//
+// Natively loadBundle() calls this before it returns, so the simulation is
+// running before the deferred startup stages have made the VPU and window.
+// That is only safe because nothing here touches GL state: publishing a
+// machine frame is plain memory. No GL work may be added here.
+
+void bundleLoaded(Bundle* _bundle)
+{
+  if(_bundle) { applyBundle(*_bundle); }
+  if(startup_art_filename) { applyCharArt(startup_art_filename); }
+
+  assets.store(_bundle, std::memory_order_release);
+
+  if(startup_program_filename) { loadProgram(startup_program_filename); }
+
+  startSimulation();
+}
+
+// --------------------------------
+
+// Picks up the latest machine frame without waiting for the simulation thread
+
+void syncMachineFrame()
+{
+  TRACE_SCOPE("syncMachineFrame");
+
+  if(!acquireFrontBuffer(simulation.frames)) { return; }
+
+  const MachineFrame& frame = frontBuffer(simulation.frames);
+
+  // Pages written in frames that were dropped in between are not flagged
+
+  // Frames are still taken during playback, to keep the status and input timing
+
+  if(!session.player.active) { applyMachineFrame(frame, frame.sequence != simulation.applied + 1); }
+  simulation.applied = frame.sequence;
+
+  recordFrame(session.recorder, frame.sequence, frame.memory);
+
+  simulation.input_count = frame.input_count;
+  memcpy(simulation.input_timestamps, frame.input_timestamps, frame.input_count * sizeof(uint32_t));
+}
+
+// --------------------------------
+
+bool initWindow(int _width, int _height)
+{
+  setWindowSize(_width, _height);
+
+  window.sdl_window = SDL_CreateWindow("Retro", 
+      SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+      window.width, window.height, 
+      SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_SHOWN);
+
+  if(!window.sdl_window)
+  {
+    printf("Failed to create SDL window\n");
+    return false;
+  }
+
+  window.id = SDL_GetWindowID(window.sdl_window);
+
+  return true;
+}
+
+// --------------------------------
+
+bool buildDisplayProgram()
+{
+  char defines[64] = "";
+
+  if(indexed_display) { strncat(defines, "#define INDEXED\n", sizeof(defines) - strlen(defines) - 1); }
+  if(display.scaling == scaling_integer) { strncat(defines, "#define NEAREST\n", sizeof(defines) - strlen(defines) - 1); }
+  if(display.scaling == scaling_prescale) { strncat(defines, "#define PRESCALE\n", sizeof(defines) - strlen(defines) - 1); }
+
+  display.program = getProgramVariant(pixel_upscale_vs, pixel_upscale_fs, defines);
+
+  if(!display.program) { return false; }
+
+  useProgram(display.program);
+
+  GLint screen_sampler_location = glGetUniformLocation(display.program, "screen_sampler");
+  setUniform1i(screen_sampler_location, display.texture_unit);
+
+  GLint palette_sampler_location = glGetUniformLocation(display.program, "palette_sampler");
+  setUniform1i(palette_sampler_location, display.palette_texture_unit);
+
+  display.screen_size_location = glGetUniformLocation(display.program, "screen_size");
+  setUniform2f(display.screen_size_location, display.width, display.height);
+
+  display.prescale_location = glGetUniformLocation(display.program, "prescale");
+  setUniform2f(display.prescale_location, display.prescale, display.prescale);
+
+  return true;
+}
+
+// --------------------------------
+
+// Integer textures cannot be filtered, the indexed upscale pass filters the
+// resolved colours itself
+
+void resizeDisplayTexture()
+{
+  if(indexed_display)
+  {
+    resizeTexture(display.texture_unit, display.texture, display.width, display.height, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE);
+  }
+  else
+  {
+    resizeTexture(display.texture_unit, display.texture, display.width, display.height, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE);
+  }
+
+  const GLint filter = indexed_display ? GL_NEAREST : GL_LINEAR;
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+
+  vpu.redraw_all = true;
+}
+
+// --------------------------------
+
+void updateDisplayPalette()
+{
+  if(!indexed_display) { return; }
+
+  uint8_t palette[display_palette_entries * 3];
+  memset(palette, 0, sizeof(palette));
+
+  memcpy(palette, &vpu.registers[vpu_palette], 16 * 3);
+  copyConsolePalettes(palette + console_first_index * 3);
+
+  selectTexture(display.palette_texture_unit, display.palette_texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, display_palette_entries, 1, GL_RGB, GL_UNSIGNED_BYTE, palette);
+}
+
+// --------------------------------
+
+bool initDisplay(int _width, int _height)
+{
+  setDisplaySize(_width, _height);
+
+  display.vao = createVertexArray("display quad");
+  display.vbo = createBuffer(GL_ARRAY_BUFFER, 4 * 4 * sizeof(GLfloat), nullptr, GL_STATIC_DRAW, "display quad");
+
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (const void*)(2 * sizeof(GLfloat)));
+
+  display.texture_unit = acquireTextureUnit();
+  display.palette_texture_unit = acquireTextureUnit();
+
+  if(display.texture_unit == no_texture_unit || display.palette_texture_unit == no_texture_unit) { return false; }
+
+  if(!buildDisplayProgram()) { return false; }
+
+  display.texture = createTexture(display.texture_unit, display.width, display.height, nullptr, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, GL_LINEAR, "display");
+
+  if(!display.texture) { return false; }
+
+  resizeDisplayTexture();
+
+  display.palette_texture = createTexture(display.palette_texture_unit, display_palette_entries, 1, nullptr, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, GL_NEAREST, "display palette");
+
+  if(!display.palette_texture) { return false; }
+
+  return true;
+}
+
+// --------------------------------
+
+void showDisplay()
+{
+  TRACE_SCOPE("showDisplay");
+
+  bindFramebuffer(0);
+  setViewport(0, 0, window.width, window.height);
+  const uint8_t* border = &vpu.registers[vpu_palette + (vpu.registers[vpu_border] & 0x0F) * 3];
+  setClearColor(border[0] / 255.0f, border[1] / 255.0f, border[2] / 255.0f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  useProgram(display.program);
+  bindVertexArray(display.vao);
+  bindTexture(display.texture_unit, display.texture);
+  if(indexed_display) { bindTexture(display.palette_texture_unit, display.palette_texture); }
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+// --------------------------------
+
+void destroyDisplay()
+{
+  deleteBuffer(display.vbo);
+  deleteVertexArray(display.vao);
+  deleteTexture(display.texture);
+  deleteTexture(display.palette_texture);
+
+  releaseTextureUnit(display.texture_unit);
+  releaseTextureUnit(display.palette_texture_unit);
+}
+
+// --------------------------------
+
+void updateDisplayVBO()
+{
+  const float fit = std::min((float)window.width / display.width, (float)window.height / display.height);
+  const int multiple = (int)fit;
+
+  const int scaling = (scaling_mode == scaling_integer && multiple < 1) ? scaling_fit : scaling_mode;
+
+  float width = display.width * fit;
+  float height = display.height * fit;
+
+  if(scaling == scaling_integer)
+  {
+    width = display.width * multiple;
+    height = display.height * multiple;
+  }
+  else if(scaling == scaling_stretch)
+  {
+    width = window.width;
+    height = window.height;
+  }
+  else if(window.width > 320)
+  {
+    width *= 0.95f;
+    height *= 0.95f;
+  }
+
+  // Whole multiples start on a window pixel, so each window pixel centre
+  // falls inside one screen pixel
+
+  float left = (window.width - width) * 0.5f;
+  float top = (window.height - height) * 0.5f;
+
+  if(scaling == scaling_integer)
+  {
+    left = floorf(left);
+    top = floorf(top);
+  }
+
+  const GLfloat x0 = left / window.width * 2.0f - 1.0f;
+  const GLfloat x1 = (left + width) / window.width * 2.0f - 1.0f;
+  const GLfloat y0 = 1.0f - top / window.height * 2.0f;
+  const GLfloat y1 = 1.0f - (top + height) / window.height * 2.0f;
+
+  const GLfloat vertices[16] =
+  {
+    x1, y0, 1.0f, 0.0f,
+    x0, y0, 0.0f, 0.0f,
+    x1, y1, 1.0f, 1.0f,
+    x0, y1, 0.0f, 1.0f,
+  };
+
+  bindBuffer(GL_ARRAY_BUFFER, display.vbo);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+
+  display.prescale = std::max((int)(width / display.width), 1);
+
+  if(scaling != display.scaling)
+  {
+    display.scaling = scaling;
+    buildDisplayProgram();
+  }
+  else
+  {
+    useProgram(display.program);
+    setUniform2f(display.prescale_location, display.prescale, display.prescale);
+  }
+}
+
+// --------------------------------
+
+void resizeWindow(int _width, int _height)
+{
+  setWindowSize(_width, _height);
+
+  updateDisplayVBO();
+
+  printf("Window: %4d x %4d\n", window.width, window.height);
+}
+
+// --------------------------------
+
+// Releases the glyph cache slots held by a wide map before it is cleared
+
+void clearMap()
+{
+  if(!vpu.map) { return; }
+
+  const int cell_count = display.cell_width * display.cell_height;
+
+  if(vpu.text_mode.wide_map)
+  {
+    const uint16_t* cells = (const uint16_t*)vpu.map;
+    for(int i = 0; i < cell_count; ++i) { releaseGlyph(cells[i]); }
+  }
+
+  memset(vpu.map, 0, cell_count * mapCellBytes());
+}
+
+// --------------------------------
+
+void resizeDisplay(int _width, int _height)
+{
+  clearMap();
+
+  setDisplaySize(_width, _height);
+
+  updateDisplayVBO();
+
+  useProgram(vpu.program);
+  setUniform2f(vpu.screen_size_location, display.width, display.height);
+
+  if(vpu.sprite_program)
+  {
+    useProgram(vpu.sprite_program);
+    setUniform2f(vpu.sprite_screen_size_location, display.width, display.height);
+  }
+
+  useProgram(display.program);
+  setUniform2f(display.screen_size_location, display.width, display.height);
+
+  resizeDisplayTexture();
+
+  vpu.map = (uint8_t*)realloc(vpu.map, mapAllocationBytes());
+  memset(vpu.map, 0, mapAllocationBytes());
+
+  vpu.attributes = (uint8_t*)realloc(vpu.attributes, attributeAllocationBytes());
+  memset(vpu.attributes, default_attribute, attributeAllocationBytes());
+
+  vpu.drawn_map = (uint8_t*)realloc(vpu.drawn_map, mapAllocationBytes());
+  vpu.drawn_attributes = (uint8_t*)realloc(vpu.drawn_attributes, attributeAllocationBytes());
+
+  free(vpu.damage);
+  vpu.damage = (uint8_t*)calloc(screenColumns() * screenRows(), 1);
+  clearDirtyRows(vpu.damaged_rows);
+  vpu.damaged_cells = 0;
+
+  applyMachineFrame(frontBuffer(simulation.frames), true);
+
+  if(ui_visible) { setUISize(display.cell_width, display.cell_height, default_attribute); }
+
+  resizeTexture(vpu.map_texture_unit, vpu.map_texture, display.cell_width, display.cell_height, mapInternalFormat(), GL_RED_INTEGER, mapType(), vpu.map);
+  resizeTexture(vpu.attribute_texture_unit, vpu.attribute_texture, display.cell_width, display.cell_height, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, vpu.attributes);
+
+  clearDirtyRows(vpu.map_dirty);
+  clearDirtyRows(vpu.attributes_dirty);
+  clearDirtyRows(vpu.redraw_rows);
+  clearDirtyRows(vpu.texture_rows);
+
+  printf("Display: %4d x %4d\n", display.width, display.height);
+}
+
+// --------------------------------
+
+static bool isPowerOfTwo(int _n) { return _n > 0 && (_n & (_n - 1)) == 0; }
+
+static int log2i(int _n)
+{
+  int shift = 0;
+  while(_n >>= 1) { ++shift; }
+  return shift;
+}
+
+// _x / _n, _x % _n and _x * _n as GLSL expressions. Power-of-two cases are
+// written as shifts and masks so they stay that way whatever the driver does.
+
+static void divideExpression(char* _out, size_t _size, const char* _x, int _n)
+{
+  if(isPowerOfTwo(_n)) { snprintf(_out, _size, "((%s) >> %dU)", _x, log2i(_n)); }
+  else                 { snprintf(_out, _size, "((%s) / %dU)", _x, _n); }
+}
+
+static void moduloExpression(char* _out, size_t _size, const char* _x, int _n)
+{
+  if(isPowerOfTwo(_n)) { snprintf(_out, _size, "((%s) & 0x%XU)", _x, _n - 1); }
+  else                 { snprintf(_out, _size, "((%s) %% %dU)", _x, _n); }
+}
+
+static void multiplyExpression(char* _out, size_t _size, const char* _x, int _n)
+{
+  if(isPowerOfTwo(_n)) { snprintf(_out, _size, "((%s) << %dU)", _x, log2i(_n)); }
+  else                 { snprintf(_out, _size, "((%s) * %dU)", _x, _n); }
+}
+
+// --------------------------------
+
+void textModeDefines(const TextMode& _mode, char* _defines, size_t _size)
+{
+  char cell_x[64], cell_y[64], glyph_x[64], glyph_y[64];
+  char atlas_column[64], atlas_row[64], atlas_x[160], atlas_y[160];
+
+  divideExpression(cell_x, sizeof(cell_x), "x", _mode.glyph_width);
+  divideExpression(cell_y, sizeof(cell_y), "y", _mode.glyph_height);
+  moduloExpression(glyph_x, sizeof(glyph_x), "x", _mode.glyph_width);
+  moduloExpression(glyph_y, sizeof(glyph_y), "y", _mode.glyph_height);
+
+  moduloExpression(atlas_column, sizeof(atlas_column), "g", _mode.atlas_columns);
+  divideExpression(atlas_row, sizeof(atlas_row), "g", _mode.atlas_columns);
+  multiplyExpression(atlas_x, sizeof(atlas_x), atlas_column, _mode.glyph_width);
+  multiplyExpression(atlas_y, sizeof(atlas_y), atlas_row, _mode.glyph_height);
+
+  snprintf(_defines, _size,
+      "#define CELL_X(x) %s\n"
+      "#define CELL_Y(y) %s\n"
+      "#define GLYPH_X(x) %s\n"
+      "#define GLYPH_Y(y) %s\n"
+      "#define ATLAS_X(g) %s\n"
+      "#define ATLAS_Y(g) %s\n",
+      cell_x, cell_y, glyph_x, glyph_y, atlas_x, atlas_y);
+}
+
+// The glyph an animation table entry with frames shows at a machine frame.
+// Durations of 0 count as 1.
+
+int animationGlyph(const uint8_t* _entry, uint32_t _time)
+{
+  const int frames = std::min<int>(_entry[1], animation_frames);
+
+  uint32_t total = 0;
+  for(int i = 0; i < frames; ++i) { total += std::max<int>(_entry[3 + i * 2], 1); }
+
+  uint32_t t = _time % total;
+
+  for(int i = 0; i < frames; ++i)
+  {
+    const uint32_t duration = std::max<int>(_entry[3 + i * 2], 1);
+
+    if(t < duration) { return _entry[2 + i * 2]; }
+    t -= duration;
+  }
+
+  return _entry[0];
+}
+
+// --------------------------------
+
+void markAnimatedGlyphs(const uint8_t* _animations)
+{
+  for(int i = 0; i < animation_count; ++i)
+  {
+    const uint8_t* entry = _animations + i * animation_bytes;
+
+    if(entry[1]) { vpu.redraw_glyphs[entry[0] >> 6] |= 1ULL << (entry[0] & 63); }
+  }
+}
+
+// --------------------------------
+
+// Rebuilds the animation texture when the table in the registers changed.
+// Entries are written last to first so the first one for a glyph wins.
+
+void updateAnimationTable()
+{
+  const uint8_t* animations = vpu.registers + vpu_animations;
+
+  if(!vpu.animations_dirty && !memcmp(animations, vpu.animations, sizeof(vpu.animations))) { return; }
+
+  markAnimatedGlyphs(vpu.animations);
+  memcpy(vpu.animations, animations, sizeof(vpu.animations));
+  markAnimatedGlyphs(vpu.animations);
+
+  uint16_t table[(1 + animation_frames) * 256 * 2] = {};
+
+  for(int i = animation_count - 1; i >= 0 && !vpu.text_mode.wide_map; --i)
+  {
+    const uint8_t* entry = vpu.animations + i * animation_bytes;
+    const int glyph = entry[0];
+    const int frames = std::min<int>(entry[1], animation_frames);
+
+    if(!frames) { continue; }
+
+    int total = 0;
+
+    for(int frame = 0; frame < animation_frames; ++frame)
+    {
+      uint16_t* texel = table + ((1 + frame) * 256 + glyph) * 2;
+      const int duration = frame < frames ? std::max<int>(entry[3 + frame * 2], 1) : 0;
+
+      texel[0] = frame < frames ? entry[2 + frame * 2] : 0;
+      texel[1] = duration;
+      total += duration;
+    }
+
+    table[glyph * 2] = frames;
+    table[glyph * 2 + 1] = total;
+  }
+
+  selectTexture(vpu.animation_texture_unit, vpu.animation_texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 1 + animation_frames, GL_RG_INTEGER, GL_UNSIGNED_SHORT, table);
+
+  vpu.animations_dirty = false;
+}
+
+// --------------------------------
+
+// Applies the register file to the VPU program. Scroll offsets wrap around
+// the map.
+
+void updateVPURegisters()
+{
+  const uint8_t* registers = vpu.registers;
+
+  const int map_pixels_x = display.cell_width * vpu.text_mode.glyph_width;
+  const int map_pixels_y = display.cell_height * vpu.text_mode.glyph_height;
+
+  const int scroll_x = registers[vpu_scroll_x] | (registers[vpu_scroll_x + 1] << 8);
+  const int scroll_y = registers[vpu_scroll_y] | (registers[vpu_scroll_y + 1] << 8);
+
+  GLfloat palette[16 * 3];
+
+  for(int i = 0; i < 16 * 3; ++i) { palette[i] = registers[vpu_palette + i] / 255.0f; }
+
+  // Indexed display colours are looked up after the VPU pass
+
+  const bool palette_changed = memcmp(vpu.palette, registers + vpu_palette, sizeof(vpu.palette)) != 0;
+
+  if(scroll_x % map_pixels_x != vpu.scroll_x || scroll_y % map_pixels_y != vpu.scroll_y || (palette_changed && !indexed_display))
+  {
+    vpu.redraw_all = true;
+  }
+
+  vpu.scroll_x = scroll_x % map_pixels_x;
+  vpu.scroll_y = scroll_y % map_pixels_y;
+  memcpy(vpu.palette, registers + vpu_palette, sizeof(vpu.palette));
+
+  useProgram(vpu.program);
+  setUniform2i(vpu.map_pixels_location, map_pixels_x, map_pixels_y);
+  setUniform2i(vpu.scroll_location, vpu.scroll_x, vpu.scroll_y);
+  setUniform3fv(vpu.palette_location, 16, palette);
+
+  if(vpu.sprite_program)
+  {
+    useProgram(vpu.sprite_program);
+    setUniform3fv(vpu.sprite_palette_location, 16, palette);
+  }
+
+  // The frame counter makes the registers dirty every frame, the palette
+  // texture is only uploaded when a colour changed
+
+  if(palette_changed) { updateDisplayPalette(); }
+  updateAnimationTable();
+
+  vpu.registers_dirty = false;
+}
+
+// --------------------------------
+
+void vpuProgramDefines(char* _defines, int _size)
+{
+  textModeDefines(vpu.text_mode, _defines, _size);
+
+  if(indexed_display) { strncat(_defines, "#define INDEXED\n", _size - strlen(_defines) - 1); }
+
+  char animation_define[64];
+  snprintf(animation_define, sizeof(animation_define), "#define ANIMATION_FRAMES %d\n", animation_frames);
+  strncat(_defines, animation_define, _size - strlen(_defines) - 1);
+}
+
+// --------------------------------
+
+// Sprites have a program of their own, built when sprites are first shown
+// so that a machine without them never compiles it
+
+bool buildSpriteProgram()
+{
+  TRACE_SCOPE("buildSpriteProgram");
+
+  if(vpu.sprite_program_failed) { return false; }
+
+  char defines[1024];
+  vpuProgramDefines(defines, sizeof(defines));
+
+  vpu.sprite_program = getProgramVariant(sprite_vs, sprite_fs, defines);
+
+  // A failure is not retried every frame
+
+  if(!vpu.sprite_program)
+  {
+    vpu.sprite_program_failed = true;
+    return false;
+  }
+
+  useProgram(vpu.sprite_program);
+
+  GLint sprite_font_sampler_location = glGetUniformLocation(vpu.sprite_program, "font_sampler");
+  setUniform1i(sprite_font_sampler_location, vpu.font_texture_unit);
+
+  vpu.sprite_screen_size_location = glGetUniformLocation(vpu.sprite_program, "screen_size");
+  setUniform2f(vpu.sprite_screen_size_location, display.width, display.height);
+
+  vpu.sprite_glyph_size_location = glGetUniformLocation(vpu.sprite_program, "glyph_size");
+  setUniform2f(vpu.sprite_glyph_size_location, vpu.text_mode.glyph_width, vpu.text_mode.glyph_height);
+
+  GLfloat palette[16 * 3];
+  for(int i = 0; i < 16 * 3; ++i) { palette[i] = vpu.palette[i] / 255.0f; }
+
+  vpu.sprite_palette_location = glGetUniformLocation(vpu.sprite_program, "palette");
+  setUniform3fv(vpu.sprite_palette_location, 16, palette);
+
+  return true;
+}
+
+// --------------------------------
+
+bool buildVPUProgram()
+{
+  TRACE_SCOPE("buildVPUProgram");
+
+  char defines[1024];
+  vpuProgramDefines(defines, sizeof(defines));
+
+  vpu.program = getProgramVariant(text_mode_vs, text_mode_fs, defines);
+
+  if(!vpu.program) { return false; }
+
+  useProgram(vpu.program);
+
+  GLint font_sampler_location = glGetUniformLocation(vpu.program, "font_sampler");
+  setUniform1i(font_sampler_location, vpu.font_texture_unit);
+
+  GLint map_sampler_location = glGetUniformLocation(vpu.program, "map_sampler");
+  setUniform1i(map_sampler_location, vpu.map_texture_unit);
+
+  GLint attribute_sampler_location = glGetUniformLocation(vpu.program, "attribute_sampler");
+  setUniform1i(attribute_sampler_location, vpu.attribute_texture_unit);
+
+  vpu.screen_size_location = glGetUniformLocation(vpu.program, "screen_size");
+  setUniform2f(vpu.screen_size_location, display.width, display.height);
+
+  vpu.palette_location = glGetUniformLocation(vpu.program, "palette");
+  vpu.scroll_location = glGetUniformLocation(vpu.program, "scroll");
+  vpu.map_pixels_location = glGetUniformLocation(vpu.program, "map_pixels");
+
+  vpu.glyph_size_location = glGetUniformLocation(vpu.program, "glyph_size");
+  setUniform2f(vpu.glyph_size_location, vpu.text_mode.glyph_width, vpu.text_mode.glyph_height);
+
+  GLint animation_sampler_location = glGetUniformLocation(vpu.program, "animation_sampler");
+  setUniform1i(animation_sampler_location, vpu.animation_texture_unit);
+
+  vpu.animation_time_location = glGetUniformLocation(vpu.program, "animation_time");
+
+  // Made again for the new defines by the next frame with sprites
+
+  vpu.sprite_program = 0;
+  vpu.sprite_program_failed = false;
+
+  // The table is built for the map width of the text mode
+
+  vpu.animations_dirty = true;
+
+  updateVPURegisters();
+
+  vpu.redraw_all = true;
+
+  return true;
+}
+
+// --------------------------------
+
+// The font atlas in the asset bundle is uploaded as it is, without expanding
+// the font RAM, while the VPU still has the font and text mode it was made
+// from
+
+GLuint loadVPUFont()
+{
+  const Bundle* bundle = assets.load(std::memory_order_acquire);
+  const BundleEntry* atlas = bundle ? findBundleEntry(*bundle, "font atlas", bundle_texture) : nullptr;
+
+  const TextMode& mode = vpu.text_mode;
+  const bool default_layout = mode.glyph_width == default_text_mode.glyph_width && mode.glyph_height == default_text_mode.glyph_height &&
+      mode.atlas_columns == default_text_mode.atlas_columns && mode.atlas_rows == default_text_mode.atlas_rows;
+
+  if(atlas && default_layout && atlas->format == GL_R8 && atlas->width == fontAtlasWidth(mode) && atlas->height == fontAtlasHeight(mode))
+  {
+    uint8_t builtin_font[font_ram_size];
+    copyBuiltinFont(builtin_font);
+
+    if(memcmp(vpu.font_ram, builtin_font, font_ram_size) == 0) { return loadBundleTexture(vpu.font_texture_unit, *bundle, "font atlas"); }
+  }
+
+  return loadFont(vpu.font_texture_unit, mode, vpu.font_ram);
+}
+
+// --------------------------------
+
+bool initVPU()
+{
+  // Redraw rectangles are the instance attributes of the text mode quads
+
+  vpu.vao = createVertexArray("VPU rects");
+  vpu.vbo = createBuffer(GL_ARRAY_BUFFER, sizeof(VPURect), nullptr, GL_STREAM_DRAW, "VPU rects");
+
+  glEnableVertexAttribArray(0);
+  glVertexAttribIPointer(0, 4, GL_UNSIGNED_SHORT, sizeof(VPURect), 0);
+  glVertexAttribDivisor(0, 1);
+
+  vpu.font_texture_unit = acquireTextureUnit();
+  vpu.map_texture_unit = acquireTextureUnit();
+  vpu.attribute_texture_unit = acquireTextureUnit();
+  vpu.animation_texture_unit = acquireTextureUnit();
+
+  if(vpu.font_texture_unit == no_texture_unit || vpu.map_texture_unit == no_texture_unit || vpu.attribute_texture_unit == no_texture_unit || vpu.animation_texture_unit == no_texture_unit) { return false; }
+
+  // Filled in by buildVPUProgram()
+
+  vpu.animation_texture = createTexture(vpu.animation_texture_unit, 256, 1 + animation_frames, nullptr, GL_RG16UI, GL_RG_INTEGER, GL_UNSIGNED_SHORT, GL_NEAREST, "VPU animations");
+  if(!vpu.animation_texture) { return false; }
+
+  vpu.map = (uint8_t*)calloc(mapAllocationBytes(), 1);
+  vpu.attributes = (uint8_t*)malloc(attributeAllocationBytes());
+  memset(vpu.attributes, default_attribute, attributeAllocationBytes());
+
+  clearDirtyRows(vpu.map_dirty);
+  clearDirtyRows(vpu.attributes_dirty);
+
+  applyMachineFrame(frontBuffer(simulation.frames), true);
+
+  vpu.drawn_map = (uint8_t*)calloc(mapAllocationBytes(), 1);
+  vpu.drawn_attributes = (uint8_t*)calloc(attributeAllocationBytes(), 1);
+  vpu.damage = (uint8_t*)calloc(screenColumns() * screenRows(), 1);
+
+  clearDirtyRows(vpu.redraw_rows);
+  clearDirtyRows(vpu.texture_rows);
+  clearDirtyRows(vpu.damaged_rows);
+  vpu.damaged_cells = 0;
+
+  if(!buildVPUProgram()) { return false; }
+
+  vpu.font_texture = loadVPUFont();
+  if(!vpu.font_texture) { return false; }
+
+  vpu.map_texture = createTexture(vpu.map_texture_unit, display.cell_width, display.cell_height, vpu.map, mapInternalFormat(), GL_RED_INTEGER, mapType(), GL_NEAREST, "VPU map");
+  if(!vpu.map_texture) { return false; }
+
+  vpu.attribute_texture = createTexture(vpu.attribute_texture_unit, display.cell_width, display.cell_height, vpu.attributes, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, GL_NEAREST, "VPU attributes");
+  if(!vpu.attribute_texture) { return false; }
+
+  clearDirtyRows(vpu.map_dirty);
+  clearDirtyRows(vpu.attributes_dirty);
+  memset(vpu.font_dirty, 0, sizeof(vpu.font_dirty));
+  memset(vpu.redraw_glyphs, 0, sizeof(vpu.redraw_glyphs));
+
+  // Sprite table entries are the instance attributes of the sprite quads
+
+  vpu.sprite_vao = createVertexArray("VPU sprites");
+  vpu.sprite_vbo = createBuffer(GL_ARRAY_BUFFER, sizeof(vpu.sprites), nullptr, GL_DYNAMIC_DRAW, "VPU sprites");
+
+  glEnableVertexAttribArray(0);
+  glVertexAttribIPointer(0, 4, GL_UNSIGNED_SHORT, sprite_bytes, 0);
+  glVertexAttribDivisor(0, 1);
+
+  vpu.fbo = createFramebuffer("VPU");
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, display.texture, 0);
+  GLenum DrawBuffers[1] = {GL_COLOR_ATTACHMENT0};
+  glDrawBuffers(1, DrawBuffers);
+  if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+  {
+    printf("Failed to create Framebuffer\n");
+    return false;
+  }
+  bindFramebuffer(0);
+
+  return true;
+}
+
+// --------------------------------
+
+// Uploads the VPU state that changed since the last frame
+
+void uploadVPU()
+{
+  TRACE_SCOPE("uploadVPU");
+
+  const int cell_bytes = mapCellBytes();
+  const DirtyRows& map_rows = vpu.map_dirty;
+  const DirtyRows& attribute_rows = vpu.attributes_dirty;
+
+  if(map_rows.first <= map_rows.last)
+  {
+    selectTexture(vpu.map_texture_unit, vpu.map_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, map_rows.first, display.cell_width, map_rows.last - map_rows.first + 1,
+        GL_RED_INTEGER, mapType(), vpu.map + map_rows.first * display.cell_width * cell_bytes);
+  }
+
+  if(attribute_rows.first <= attribute_rows.last)
+  {
+    selectTexture(vpu.attribute_texture_unit, vpu.attribute_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, attribute_rows.first, display.cell_width, attribute_rows.last - attribute_rows.first + 1,
+        GL_RED_INTEGER, GL_UNSIGNED_BYTE, vpu.attributes + attribute_rows.first * display.cell_width);
+  }
+
+  markRowsDirty(vpu.redraw_rows, map_rows.first, map_rows.last);
+  markRowsDirty(vpu.redraw_rows, attribute_rows.first, attribute_rows.last);
+
+  clearDirtyRows(vpu.map_dirty);
+  clearDirtyRows(vpu.attributes_dirty);
+
+  // A wide map draws from the glyph cache, font RAM is not shown
+
+  if(!vpu.text_mode.wide_map)
+  {
+    const int redefined = updateFontGlyphs(vpu.font_texture_unit, vpu.font_texture, vpu.text_mode, vpu.font_ram, vpu.font_dirty);
+
+    if(redefined)
+    {
+      for(int i = 0; i < glyph_mask_words; ++i) { vpu.redraw_glyphs[i] |= vpu.font_dirty[i]; }
+      vpu.redefined_glyphs = redefined;
+    }
+  }
+
+  memset(vpu.font_dirty, 0, sizeof(vpu.font_dirty));
+
+  if(vpu.registers_dirty) { updateVPURegisters(); }
+  if(consolePalettesChanged()) { updateDisplayPalette(); }
+
+  if(vpu.sprites_dirty)
+  {
+    bindBuffer(GL_ARRAY_BUFFER, vpu.sprite_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vpu.sprites), vpu.sprites);
+
+    vpu.visible_sprites = 0;
+
+    for(int i = 0; i < sprite_count; ++i)
+    {
+      if(vpu.sprites[i * sprite_bytes + sprite_flags] & sprite_flag_visible) { ++vpu.visible_sprites; }
+    }
+
+    vpu.sprites_dirty = false;
+  }
+}
+
+// --------------------------------
+
+// Marks the screen cells covering a rectangle of display pixels
+
+void damagePixels(int _x, int _y, int _width, int _height)
+{
+  const int x0 = std::max(_x, 0);
+  const int y0 = std::max(_y, 0);
+  const int x1 = std::min(_x + _width, display.width);
+  const int y1 = std::min(_y + _height, display.height);
+
+  if(x0 >= x1 || y0 >= y1) { return; }
+
+  const int columns = screenColumns();
+  const int first_row = y0 / vpu.text_mode.glyph_height;
+  const int last_row = (y1 - 1) / vpu.text_mode.glyph_height;
+
+  for(int y = first_row; y <= last_row; ++y)
+  {
+    for(int x = x0 / vpu.text_mode.glyph_width; x <= (x1 - 1) / vpu.text_mode.glyph_width; ++x)
+    {
+      uint8_t& damage = vpu.damage[y * columns + x];
+      vpu.damaged_cells += !damage;
+      damage = 1;
+    }
+  }
+
+  if(vpu.damaged_rows.first > vpu.damaged_rows.last)
+  {
+    vpu.damaged_rows.first = first_row;
+    vpu.damaged_rows.last = last_row;
+  }
+  else
+  {
+    vpu.damaged_rows.first = std::min(vpu.damaged_rows.first, first_row);
+    vpu.damaged_rows.last = std::max(vpu.damaged_rows.last, last_row);
+  }
+}
+
+// --------------------------------
+
+// The scrolled map wraps, so a map cell can show on both sides of the seam
+
+void damageMapCell(int _x, int _y)
+{
+  const int map_pixels_x = display.cell_width * vpu.text_mode.glyph_width;
+  const int map_pixels_y = display.cell_height * vpu.text_mode.glyph_height;
+
+  const int x = _x * vpu.text_mode.glyph_width - vpu.scroll_x;
+  const int y = _y * vpu.text_mode.glyph_height - vpu.scroll_y;
+
+  for(int wrap_y = -1; wrap_y <= 1; ++wrap_y)
+  {
+    for(int wrap_x = -1; wrap_x <= 1; ++wrap_x)
+    {
+      damagePixels(x + wrap_x * map_pixels_x, y + wrap_y * map_pixels_y, vpu.text_mode.glyph_width, vpu.text_mode.glyph_height);
+    }
+  }
+}
+
+// --------------------------------
+
+void damageSprite(const uint8_t* _sprite)
+{
+  if(!(_sprite[sprite_flags] & sprite_flag_visible)) { return; }
+
+  const int x = (int16_t)(_sprite[0] | (_sprite[1] << 8));
+  const int y = (int16_t)(_sprite[2] | (_sprite[3] << 8));
+
+  damagePixels(x, y, vpu.text_mode.glyph_width, vpu.text_mode.glyph_height);
+}
+
+// --------------------------------
+
+// Animated glyphs that moved on to another frame since the frame drawn
+// count as redefined
+
+void findAnimationDamage()
+{
+  if(vpu.animation_time == vpu.drawn_animation_time) { return; }
+
+  for(int i = 0; i < animation_count; ++i)
+  {
+    const uint8_t* entry = vpu.animations + i * animation_bytes;
+
+    if(entry[1] && animationGlyph(entry, vpu.animation_time) != animationGlyph(entry, vpu.drawn_animation_time))
+    {
+      vpu.redraw_glyphs[entry[0] >> 6] |= 1ULL << (entry[0] & 63);
+    }
+  }
+}
+
+// --------------------------------
+
+// Cells and sprites showing a redefined glyph. Only an 8-bit map shows font
+// RAM.
+
+void findGlyphDamage()
+{
+  uint64_t any = 0;
+  for(int i = 0; i < glyph_mask_words; ++i) { any |= vpu.redraw_glyphs[i]; }
+
+  if(!any || vpu.text_mode.wide_map) { return; }
+
+  for(int y = 0; y < display.cell_height; ++y)
+  {
+    const uint8_t* map = vpu.map + y * display.cell_width;
+
+    for(int x = 0; x < display.cell_width; ++x)
+    {
+      if(glyphChanged(vpu.redraw_glyphs, map[x])) { damageMapCell(x, y); }
+    }
+  }
+
+  for(int i = 0; i < sprite_count; ++i)
+  {
+    const uint8_t* sprite = vpu.sprites + i * sprite_bytes;
+
+    if(glyphChanged(vpu.redraw_glyphs, sprite[4])) { damageSprite(sprite); }
+  }
+}
+
+// --------------------------------
+
+// Compares the map rows that changed and the sprite table with what was
+// drawn, marking the screen cells to draw again
+
+void findDamage()
+{
+  const int cell_bytes = mapCellBytes();
+  const int row_bytes = display.cell_width * cell_bytes;
+
+  DirtyRows rows = vpu.redraw_rows;
+  markRowsDirty(rows, vpu.texture_rows.first, vpu.texture_rows.last);
+
+  for(int y = rows.first; y <= rows.last; ++y)
+  {
+    const bool whole = y >= vpu.texture_rows.first && y <= vpu.texture_rows.last;
+
+    const uint8_t* map = vpu.map + y * row_bytes;
+    const uint8_t* attributes = vpu.attributes + y * display.cell_width;
+    uint8_t* drawn_map = vpu.drawn_map + y * row_bytes;
+    uint8_t* drawn_attributes = vpu.drawn_attributes + y * display.cell_width;
+
+    if(!whole && !memcmp(map, drawn_map, row_bytes) && !memcmp(attributes, drawn_attributes, display.cell_width)) { continue; }
+
+    for(int x = 0; x < display.cell_width; ++x)
+    {
+      if(whole || memcmp(map + x * cell_bytes, drawn_map + x * cell_bytes, cell_bytes) || attributes[x] != drawn_attributes[x])
+      {
+        damageMapCell(x, y);
+      }
+    }
+
+    memcpy(drawn_map, map, row_bytes);
+    memcpy(drawn_attributes, attributes, display.cell_width);
+  }
+
+  findAnimationDamage();
+  findGlyphDamage();
+
+  if(!memcmp(vpu.sprites, vpu.drawn_sprites, sizeof(vpu.sprites))) { return; }
+
+  for(int i = 0; i < sprite_count; ++i)
+  {
+    const uint8_t* sprite = vpu.sprites + i * sprite_bytes;
+    const uint8_t* drawn_sprite = vpu.drawn_sprites + i * sprite_bytes;
+
+    if(!memcmp(sprite, drawn_sprite, sprite_bytes)) { continue; }
+
+    damageSprite(drawn_sprite);
+    damageSprite(sprite);
+  }
+
+  memcpy(vpu.drawn_sprites, vpu.sprites, sizeof(vpu.sprites));
+}
+
+// --------------------------------
+
+// Turns the damaged screen cells into runs along each row, and runs of the
+// same span on consecutive rows into one rectangle. Clears the damage.
+
+void buildRedrawRects()
+{
+  const int columns = screenColumns();
+
+  if(vpu.damaged_rows.first > vpu.damaged_rows.last) { return; }
+
+  // Every rectangle has a damaged cell of its own, and a row has fewer runs
+  // than columns
+
+  vpu.rects = arenaArray<VPURect>(frame_arena, (vpu.damaged_rows.last - vpu.damaged_rows.first + 1) * columns);
+  vpu.rect_count = 0;
+
+  // Rectangles reaching down to the previous row, and to this one, in x order
+
+  int* open = arenaArray<int>(frame_arena, columns);
+  int* next_open = arenaArray<int>(frame_arena, columns);
+  int open_count = 0;
+
+  for(int y = vpu.damaged_rows.first; y <= vpu.damaged_rows.last; ++y)
+  {
+    uint8_t* damage = vpu.damage + y * columns;
+    int above = 0;
+    int next_open_count = 0;
+
+    for(int x = 0; x < columns; ++x)
+    {
+      if(!damage[x]) { continue; }
+
+      int end = x;
+      while(end < columns && damage[end]) { damage[end++] = 0; }
+
+      while(above < open_count && vpu.rects[open[above]].x < x) { ++above; }
+
+      if(above < open_count && vpu.rects[open[above]].x == x && vpu.rects[open[above]].width == end - x)
+      {
+        ++vpu.rects[open[above]].height;
+        next_open[next_open_count++] = open[above];
+      }
+      else
+      {
+        const VPURect rect = { (uint16_t)x, (uint16_t)y, (uint16_t)(end - x), 1 };
+        next_open[next_open_count++] = vpu.rect_count;
+        vpu.rects[vpu.rect_count++] = rect;
+      }
+
+      x = end;
+    }
+
+    std::swap(open, next_open);
+    open_count = next_open_count;
+  }
+}
+
+// --------------------------------
+
+// The whole screen is drawn when what is drawn no longer matches the display
+// texture, or when more than half of it changed.
+//
+// The display texture stays bound to its unit while it is the render target.
+// The VPU program never samples that unit, so this is not a feedback loop.
+
+void renderVPU()
+{
+  TRACE_SCOPE("renderVPU");
+
+  const unsigned int glyph_uploads = glyphCacheStats().uploads;
+  const unsigned int consoles_uncovered = consoleStats().uncovered;
+
+  if(!partial_redraw || glyph_uploads != vpu.glyph_uploads || consoles_uncovered != vpu.consoles_uncovered) { vpu.redraw_all = true; }
+
+  vpu.glyph_uploads = glyph_uploads;
+  vpu.consoles_uncovered = consoles_uncovered;
+
+  const int screen_columns = screenColumns();
+  const int screen_cells = screen_columns * screenRows();
+
+  vpu.rect_count = 0;
+
+  if(!vpu.redraw_all)
+  {
+    findDamage();
+    vpu.redraw_all = vpu.damaged_cells * 2 > screen_cells;
+  }
+
+  if(vpu.redraw_all)
+  {
+    if(vpu.damaged_rows.first <= vpu.damaged_rows.last)
+    {
+      memset(vpu.damage + vpu.damaged_rows.first * screen_columns, 0, (vpu.damaged_rows.last - vpu.damaged_rows.first + 1) * screen_columns);
+    }
+
+    memcpy(vpu.drawn_map, vpu.map, display.cell_width * display.cell_height * mapCellBytes());
+    memcpy(vpu.drawn_attributes, vpu.attributes, display.cell_width * display.cell_height);
+    memcpy(vpu.drawn_sprites, vpu.sprites, sizeof(vpu.sprites));
+
+    const VPURect screen = { 0, 0, (uint16_t)screen_columns, (uint16_t)screenRows() };
+    vpu.rects = arenaArray<VPURect>(frame_arena, 1);
+    vpu.rects[vpu.rect_count++] = screen;
+    vpu.redrawn_cells = screen_cells;
+  }
+  else
+  {
+    buildRedrawRects();
+    vpu.redrawn_cells = vpu.damaged_cells;
+  }
+
+  clearDirtyRows(vpu.redraw_rows);
+  clearDirtyRows(vpu.texture_rows);
+  clearDirtyRows(vpu.damaged_rows);
+  vpu.damaged_cells = 0;
+  vpu.redraw_all = false;
+  memset(vpu.redraw_glyphs, 0, sizeof(vpu.redraw_glyphs));
+  vpu.drawn_animation_time = vpu.animation_time;
+
+  if(!vpu.rect_count) { return; }
+
+  bindFramebuffer(vpu.fbo);
+  setViewport(0, 0, display.width, display.height);
+
+  bufferData(GL_ARRAY_BUFFER, vpu.vbo, vpu.rect_count * sizeof(VPURect), vpu.rects, GL_STREAM_DRAW);
+
+  useProgram(vpu.program);
+  setUniform1ui(vpu.animation_time_location, vpu.animation_time);
+  bindVertexArray(vpu.vao);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, vpu.rect_count);
+
+  // Sprites are drawn over the cells they cover whether or not those were
+  // drawn again, which leaves the pixels they already had unchanged
+
+  if(!vpu.visible_sprites) { return; }
+  if(!vpu.sprite_program && !buildSpriteProgram()) { return; }
+
+  useProgram(vpu.sprite_program);
+  bindVertexArray(vpu.sprite_vao);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, sprite_count);
+}
+
+// --------------------------------
+
+void destroyVPU()
+{
+  deleteBuffer(vpu.vbo);
+  deleteVertexArray(vpu.vao);
+  deleteTexture(vpu.font_texture);
+  deleteTexture(vpu.map_texture);
+  deleteTexture(vpu.attribute_texture);
+  deleteTexture(vpu.animation_texture);
+  deleteFramebuffer(vpu.fbo);
+  deleteBuffer(vpu.sprite_vbo);
+  deleteVertexArray(vpu.sprite_vao);
+
+  releaseTextureUnit(vpu.font_texture_unit);
+  releaseTextureUnit(vpu.map_texture_unit);
+  releaseTextureUnit(vpu.attribute_texture_unit);
+  releaseTextureUnit(vpu.animation_texture_unit);
+
+  free(vpu.map);
+  vpu.map = nullptr;
+
+  free(vpu.attributes);
+  vpu.attributes = nullptr;
+
+  free(vpu.drawn_map);
+  vpu.drawn_map = nullptr;
+
+  free(vpu.drawn_attributes);
+  vpu.drawn_attributes = nullptr;
+
+  free(vpu.damage);
+  vpu.damage = nullptr;
+
+  destroyGlyphCache();
+}
+
+// --------------------------------
+
+// The glyph font in the asset bundle is used in place, the font file is the
+// fallback
+
+bool loadUnicodeFont()
+{
+  const Bundle* bundle = assets.load(std::memory_order_acquire);
+  const BundleEntry* entry = bundle ? findBundleEntry(*bundle, "unicode", bundle_glyph_font) : nullptr;
+
+  if(entry) { return loadGlyphFontMemory(bundleData(*bundle, *entry), entry->size); }
+
+  return loadGlyphFont(unicode_font_filename);
+}
+
+// --------------------------------
+
+// Switches glyph cell size and atlas layout. The character map is resized to
+// fit the display and cleared.
+
+bool setTextMode(const TextMode& _mode)
+{
+  clearMap();
+
+  free(vpu.map);
+  vpu.map = nullptr;
+
+  vpu.text_mode = _mode;
+
+  if(!buildVPUProgram()) { return false; }
+
+  deleteTexture(vpu.font_texture);
+
+  if(vpu.text_mode.wide_map)
+  {
+    static bool unicode_font_loaded = loadUnicodeFont();
+    (void)unicode_font_loaded;
+
+    vpu.font_texture = initGlyphCache(vpu.font_texture_unit, vpu.text_mode);
+  }
+  else
+  {
+    destroyGlyphCache();
+    vpu.font_texture = loadVPUFont();
+  }
+
+  if(!vpu.font_texture) { return false; }
+
+  resizeDisplay(display.width, display.height);
+
+  return true;
+}
+
+// --------------------------------
+
+// Writes UTF-8 text into the character map at a cell position, clipped to
+// the row. In an 8-bit map code points above 255 are shown as '?'.
+
+void writeText(int _x, int _y, const char* _text)
+{
+  if(_x < 0 || _y < 0 || _x >= display.cell_width || _y >= display.cell_height) { return; }
+
+  const int first_x = _x;
+  const int cell_bytes = mapCellBytes();
+  uint8_t* row = vpu.map + _y * display.cell_width * cell_bytes;
+
+  while(*_text && _x < display.cell_width)
+  {
+    const uint32_t codepoint = decodeUTF8(_text);
+
+    if(vpu.text_mode.wide_map)
+    {
+      uint16_t* cell = (uint16_t*)row + _x;
+      const uint16_t slot = acquireGlyph(codepoint);
+      releaseGlyph(*cell);
+      *cell = slot;
+    }
+    else
+    {
+      row[_x] = codepoint < 256 ? codepoint : '?';
+    }
+
+    ++_x;
+  }
+
+  if(_x == first_x) { return; }
+
+  selectTexture(vpu.map_texture_unit, vpu.map_texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, first_x, _y, _x - first_x, 1, GL_RED_INTEGER, mapType(), row + first_x * cell_bytes);
+
+  markRowsDirty(vpu.texture_rows, _y, _y);
+}
+
+// --------------------------------
+
+// Writes a line of ASCII text over a row of the character map without
+// touching the shadow map, padded with spaces. Passing nullptr restores the
+// row from the shadow map. ASCII has the same value in 8 and 16-bit maps.
+
+void overlayPrint(int _row, const char* _text)
+{
+  if(_row >= display.cell_height) { return; }
+
+  const int cell_bytes = mapCellBytes();
+  uint16_t line[display.cell_width];
+
+  if(_text)
+  {
+    for(int i = 0; i < display.cell_width; ++i)
+    {
+      const uint8_t c = *_text ? (uint8_t)*_text++ & 0x7F : ' ';
+
+      if(cell_bytes == 2) { line[i] = c; }
+      else { ((uint8_t*)line)[i] = c; }
+    }
+  }
+  else
+  {
+    memcpy(line, vpu.map + _row * display.cell_width * cell_bytes, display.cell_width * cell_bytes);
+  }
+
+  selectTexture(vpu.map_texture_unit, vpu.map_texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, _row, display.cell_width, 1, GL_RED_INTEGER, mapType(), line);
+
+  markRowsDirty(vpu.texture_rows, _row, _row);
+}
+
+// --------------------------------
+
+void toggleOverlay()
+{
+  overlay.visible = !overlay.visible;
+  overlay.frames_until_refresh = 0;
+
+  if(overlay.visible) { printGPUResources(); }
+
+  if(!overlay.visible)
+  {
+    for(int row = 0; row < overlay.rows; ++row) { overlayPrint(row, nullptr); }
+    overlay.rows = 0;
+  }
+}
+
+// --------------------------------
+
+// 8x8 built-in, 8x16 VGA style, 6x8 compact and 8x16 Unicode cells.
+// The Unicode atlas is 1024 x 1024 with room for 8192 resident glyphs.
+
+const TextMode text_modes[] =
+{
+  { 8,  8,  16, 16, false },
+  { 8, 16,  16, 16, false },
+  { 6,  8,  16, 16, false },
+  { 8, 16, 128, 64, true  },
+};
+
+void cycleTextMode()
+{
+  static int text_mode_index = 0;
+
+  text_mode_index = (text_mode_index + 1) % (sizeof(text_modes) / sizeof(text_modes[0]));
+
+  const TextMode& mode = text_modes[text_mode_index];
+
+  if(setTextMode(mode))
+  {
+    printf("Text mode: %d x %d cells\n", mode.glyph_width, mode.glyph_height);
+  }
+}
+
+// --------------------------------
+
+void updateOverlay()
+{
+  if(!overlay.visible || overlay.frames_until_refresh-- > 0) { return; }
+
+  overlay.frames_until_refresh = 15;
+
+  char text[64];
+  int row = 0;
+
+  snprintf(text, sizeof(text), "GL %u issued %u skipped%s", overlay.gl_calls.issued, overlay.gl_calls.skipped, indexed_display ? " indexed" : "");
+  overlayPrint(row++, text);
+
+  GPUMemoryStats gpu = gpuMemoryStats();
+  snprintf(text, sizeof(text), "GPU %u KB tex %u KB buf %d units", (unsigned int)(gpu.bytes[gpu_texture] / 1024), (unsigned int)(gpu.bytes[gpu_buffer] / 1024), gpu.texture_units);
+  overlayPrint(row++, text);
+
+  if(gpu.budget)
+  {
+    snprintf(text, sizeof(text), "GPU %u/%u KB %u evicted %u over", (unsigned int)(gpu.total / 1024), (unsigned int)(gpu.budget / 1024), gpu.evictions, gpu.over_budget);
+    overlayPrint(row++, text);
+  }
+
+  snprintf(text, sizeof(text), "VPU %d cells %d rects %d glyphs%s", vpu.redrawn_cells, vpu.rect_count, vpu.redefined_glyphs, partial_redraw ? " partial" : "");
+  overlayPrint(row++, text);
+
+  if(simulation.running)
+  {
+    snprintf(text, sizeof(text), "CPU %d/%d cycles%s", simulation.frame_cycles, machine.cycles_per_frame, simulation.waiting ? " idle" : "");
+    overlayPrint(row++, text);
+  }
+
+  if(vpu.text_mode.wide_map)
+  {
+    GlyphCacheStats glyphs = glyphCacheStats();
+    snprintf(text, sizeof(text), "Glyphs %u resident %u evicted %u uploads", glyphs.resident, glyphs.evictions, glyphs.uploads);
+    overlayPrint(row++, text);
+  }
+
+  if(heap_counting_built)
+  {
+    snprintf(text, sizeof(text), "Arena %u/%u KB %u heap allocs", (unsigned int)(frame_arena.peak / 1024), (unsigned int)(frame_arena.capacity / 1024), frame_heap.last.allocations);
+  }
+  else
+  {
+    snprintf(text, sizeof(text), "Arena %u/%u KB %u grows", (unsigned int)(frame_arena.peak / 1024), (unsigned int)(frame_arena.capacity / 1024), frame_arena.grows);
+  }
+
+  overlayPrint(row++, text);
+
+  InputLatency latency = inputLatency();
+
+  if(latency.samples)
+  {
+    snprintf(text, sizeof(text), "Input p50 %.0f p95 %.0f p99 %.0f ms%s", latency.p50, latency.p95, latency.p99, late_input_latch ? " late" : "");
+    overlayPrint(row++, text);
+  }
+
+  if(session.recorder.active)
+  {
+    snprintf(text, sizeof(text), "Rec %u frames %u records %u KB", session.recorder.frames, session.recorder.records, (unsigned int)(session.recorder.data.size() / 1024));
+    overlayPrint(row++, text);
+  }
+
+  if(session.player.active)
+  {
+    snprintf(text, sizeof(text), "Play %u/%u %dx %d records", session.player.frame, session.player.frame_count, session_speeds[session.speed], session.applied);
+    overlayPrint(row++, text);
+  }
+
+  if(ui_visible)
+  {
+    UIStats stats = uiStats();
+    snprintf(text, sizeof(text), "UI %u layouts %u rects %u cells", stats.layouts, stats.batches, stats.cells);
+    overlayPrint(row++, text);
+  }
+
+  if(dashboard.visible)
+  {
+    ConsoleStats consoles = consoleStats();
+    snprintf(text, sizeof(text), "Consoles %u open %u layers uploaded", consoles.open, consoles.uploaded_layers);
+    overlayPrint(row++, text);
+  }
+
+  AudioStats audio = audioStats();
+
+  if(audio.callbacks)
+  {
+    snprintf(text, sizeof(text), "Audio %d Hz %d samples %u underruns", audio.sample_rate, audio.buffer_samples, audio.underruns);
+    overlayPrint(row++, text);
+  }
+
+  for(int i = row; i < overlay.rows; ++i) { overlayPrint(i, nullptr); }
+  overlay.rows = row;
+}
+
+// --------------------------------
+
+// Copies a rectangle composed by the UI into the map and colour RAM shadows
+
+void writeUIRect(const UIRect& _rect, const uint8_t* _cells, const uint8_t* _attributes, int _pitch)
+{
+  for(int y = 0; y < _rect.height; ++y)
+  {
+    const int cell = (_rect.y + y) * display.cell_width + _rect.x;
+
+    if(vpu.text_mode.wide_map)
+    {
+      uint16_t* cells = (uint16_t*)vpu.map + cell;
+
+      for(int x = 0; x < _rect.width; ++x)
+      {
+        releaseGlyph(cells[x]);
+        cells[x] = _cells[y * _pitch + x];
+      }
+    }
+    else
+    {
+      memcpy(vpu.map + cell, _cells + y * _pitch, _rect.width);
+    }
+
+    memcpy(vpu.attributes + cell, _attributes + y * _pitch, _rect.width);
+  }
+
+  markRowsDirty(vpu.map_dirty, _rect.y, _rect.y + _rect.height - 1);
+  markRowsDirty(vpu.attributes_dirty, _rect.y, _rect.y + _rect.height - 1);
+}
+
+// --------------------------------
+
+// F7 shows a help screen built from UI panels. Hiding it gives the map back
+// to the machine.
+
+void toggleHelp()
+{
+  ui_visible = !ui_visible;
+
+  if(!ui_visible)
+  {
+    destroyPanels();
+
+    clearMap();
+    memset(vpu.attributes, default_attribute, attributeAllocationBytes());
+    markRowsDirty(vpu.map_dirty, 0, display.cell_height - 1);
+    markRowsDirty(vpu.attributes_dirty, 0, display.cell_height - 1);
+
+    applyMachineFrame(frontBuffer(simulation.frames), true);
+    return;
+  }
+
+  setUISize(display.cell_width, display.cell_height, default_attribute);
+
+  const int keys = createPanel(1, 1, 30, 16, 0);
+  setPanelStyle(keys, 0x61, 0x6D, true);
+  setPanelTitle(keys, "Keys");
+  setPanelText(keys,
+      "F1  Overlay\n"
+      "F2  Text mode\n"
+      "F3  Late input latching\n"
+      "F4  Console dashboard\n"
+      "F5  Indexed display\n"
+      "F6  Trace capture\n"
+      "F7  This help\n"
+      "F8  Record session\n"
+      "F9  Play session\n"
+      "F10 Playback speed\n"
+      "F11 Partial redraw\n"
+      "F12 Scaling mode", ui_align_left);
+
+  const int about = createPanel(14, 9, 24, 9, 1);
+  setPanelStyle(about, 0xB1, 0xBD, true);
+  setPanelTitle(about, "Retro");
+  setPanelText(about,
+      "A 6502 at 1 MHz with a character mapped VPU, sprites, a sound chip and an asset bundle loader.\n\n"
+      "Press F7 to return", ui_align_centre);
+}
+
+// --------------------------------
+
+// F4 opens dashboard_grid x dashboard_grid consoles, alternating between the
+// built-in font and the machine font and between two palettes, so the cost
+// of many panes can be compared with one in the overlay
+
+void toggleDashboard()
+{
+  dashboard.visible = !dashboard.visible;
+
+  if(!dashboard.visible)
+  {
+    for(int i = 0; i < dashboard.pane_count; ++i) { closeConsole(dashboard.panes[i]); }
+    dashboard.pane_count = 0;
+    return;
+  }
+
+  setConsoleFont(1, vpu.font_ram);
+
+  const int pane_width = display.width / dashboard_grid;
+  const int pane_height = (display.height - dashboard_top) / dashboard_grid;
+  const int columns = std::max(1, std::min(pane_width / 8, console_columns));
+  const int rows = std::max(1, std::min(pane_height / 8, console_rows));
+
+  for(int i = 0; i < dashboard_grid * dashboard_grid; ++i)
+  {
+    const int pane = openConsole((i % dashboard_grid) * pane_width, dashboard_top + (i / dashboard_grid) * pane_height, columns, rows);
+    if(pane < 0) { break; }
+
+    setConsoleStyle(pane, (i / dashboard_grid) & 1, i & 1);
+    clearConsole(pane, default_attribute);
+
+    char title[8];
+    snprintf(title, sizeof(title), "%02d", i);
+    printConsole(pane, 0, 0, title, 0xE6);
+
+    dashboard.panes[dashboard.pane_count++] = pane;
+  }
+}
+
+// --------------------------------
+
+// Every pane changes every frame, all of them go up in one upload
+
+void updateDashboard()
+{
+  if(!dashboard.visible) { return; }
+
+  ++dashboard.frame;
+
+  for(int i = 0; i < dashboard.pane_count; ++i)
+  {
+    char text[16];
+    snprintf(text, sizeof(text), "%05u", (dashboard.frame + i * 997) % 100000);
+    printConsole(dashboard.panes[i], 0, 1, text, default_attribute);
+  }
+}
+
+// --------------------------------
+
+// F5 switches the display texture between RGB8 colours and R8UI palette
+// indices. The display texture keeps its FBO attachment when it is
+// respecified.
+
+void toggleIndexedDisplay()
+{
+  indexed_display = !indexed_display;
+
+  resizeDisplayTexture();
+
+  if(!buildDisplayProgram() || !buildVPUProgram() || !setConsoleIndexed(indexed_display))
+  {
+    printf("Failed to switch the display format\n");
+    return;
+  }
+
+  updateDisplayPalette();
+
+  printf("Indexed display %s\n", indexed_display ? "on" : "off");
+}
+
+// --------------------------------
+
+// F6 starts a trace capture, and again stops it and saves the trace. On the
+// web the file is offered as a download.
+
+void toggleTrace()
+{
+  if(!tracing())
+  {
+    startTrace();
+    printf("Trace started\n");
+    return;
+  }
+
+  stopTrace();
+
+  std::string json;
+  const int events = writeTraceJSON(json);
+
+#if defined(RETRO_RENDER_THREAD)
+  emscripten_sync_run_in_main_runtime_thread(EM_FUNC_SIG_VII, saveFile, trace_filename, json.c_str());
+#elif defined(__EMSCRIPTEN__)
+  saveFile(trace_filename, json.c_str());
+#else
+  FILE* file = fopen(trace_filename, "w");
+
+  if(!file)
+  {
+    printf("Failed to write %s\n", trace_filename);
+    return;
+  }
+
+  fwrite(json.data(), 1, json.size(), file);
+  fclose(file);
+#endif
+
+  printf("Trace: %d events written to %s\n", events, trace_filename);
+}
+
+// --------------------------------
+
+// Shows the window of the session player through the same path as a machine
+// frame, only the pages playback changed are copied into the shadows
+
+void showPlaybackFrame()
+{
+  MachineFrame& frame = session.frame;
+  SessionPlayer& player = session.player;
+
+  memcpy(frame.memory, player.window.data(), sizeof(frame.memory));
+  memcpy(frame.written_pages, player.changed_pages.data(), sizeof(frame.written_pages));
+  memset(player.changed_pages.data(), 0, player.changed_pages.size());
+
+  frame.sequence = player.frame;
+  frame.cycles = simulation.frame_cycles;
+  frame.running = simulation.running;
+  frame.waiting = simulation.waiting;
+
+  applyMachineFrame(frame, false);
+}
+
+// --------------------------------
+
+// Advances playback by the frames of one machine frame times the speed. It
+// stops on the last frame until F9 is pressed.
+
+void stepPlayback()
+{
+  if(!session.player.active) { return; }
+
+  TRACE_SCOPE("stepPlayback");
+
+  session.applied = seekPlayback(session.player, session.player.frame + session_speeds[session.speed]);
+  showPlaybackFrame();
+}
+
+// --------------------------------
+
+void seekSession(int _frames)
+{
+  if(!session.player.active) { return; }
+
+  const int64_t frame = std::max<int64_t>(0, (int64_t)session.player.frame + _frames);
+
+  session.applied = seekPlayback(session.player, frame);
+  showPlaybackFrame();
+}
+
+// --------------------------------
+
+void cycleSessionSpeed()
+{
+  session.speed = (session.speed + 1) % (sizeof(session_speeds) / sizeof(session_speeds[0]));
+
+  printf("Playback speed %dx\n", session_speeds[session.speed]);
+}
+
+// --------------------------------
+
+// F8 starts recording the machine frames shown, and again stops and saves
+// the session. On the web the file is offered as a download.
+
+void toggleRecording()
+{
+  if(session.player.active)
+  {
+    printf("Stop the playback first\n");
+    return;
+  }
+
+  if(!session.recorder.active)
+  {
+    startRecording(session.recorder, sizeof(session.frame.memory));
+    printf("Recording started\n");
+    return;
+  }
+
+  const uint32_t frames = session.recorder.frames;
+  const uint32_t records = session.recorder.records;
+
+  stopRecording(session.recorder, session.last);
+
+  if(!records)
+  {
+    session.last.clear();
+    printf("Nothing was recorded\n");
+    return;
+  }
+
+#if defined(RETRO_RENDER_THREAD)
+  emscripten_sync_run_in_main_runtime_thread(EM_FUNC_SIG_VIII, saveBinaryFile, session_filename, session.last.data(), (int)session.last.size());
+#elif defined(__EMSCRIPTEN__)
+  saveBinaryFile(session_filename, session.last.data(), session.last.size());
+#else
+  if(!writeSession(session_filename, session.last)) { return; }
+#endif
+
+  printf("Session: %u frames in %u records, %u bytes written to %s\n", frames, records, (unsigned int)session.last.size(), session_filename);
+}
+
+// --------------------------------
+
+bool startPlayback()
+{
+  std::vector<uint8_t> data = session.last;
+
+  if(!openPlayback(session.player, data)) { return false; }
+
+  if(session.player.window_size != (int)sizeof(session.frame.memory))
+  {
+    printf("Session recording is for a different machine\n");
+    closePlayback(session.player);
+    return false;
+  }
+
+  showPlaybackFrame();
+
+  printf("Playing back %u frames\n", session.player.frame_count);
+
+  return true;
+}
+
+// --------------------------------
+
+// F9 plays back the last recording, or the one saved natively, instead of
+// the machine. Stopping gives the shadows back to the machine.
+
+void togglePlayback()
+{
+  if(session.player.active)
+  {
+    closePlayback(session.player);
+    applyMachineFrame(frontBuffer(simulation.frames), true);
+
+    printf("Playback stopped\n");
+    return;
+  }
+
+  if(session.recorder.active)
+  {
+    printf("Stop the recording first\n");
+    return;
+  }
+
+  if(session.last.empty() && !loadSession(session_filename, session.last)) { return; }
+
+  startPlayback();
+}
+
+// --------------------------------
+
+// F12
+
+void cycleScalingMode()
+{
+  scaling_mode = (scaling_mode + 1) % scaling_mode_count;
+
+  updateDisplayVBO();
+
+  printf("Scaling: %s\n", scaling_mode_names[scaling_mode]);
+}
+
+// --------------------------------
+
+// F11 draws the whole screen every frame, to compare
+
+void togglePartialRedraw()
+{
+  partial_redraw = !partial_redraw;
+
+  printf("Partial redraw %s\n", partial_redraw ? "on" : "off");
+}
+
+// --------------------------------
+
+void toggleLateInputLatch()
+{
+  late_input_latch = !late_input_latch;
+
+  printf("Late input latching %s\n", late_input_latch ? "on" : "off");
+}
+
+// --------------------------------
+
+double startupMilliseconds(uint64_t _from)
+{
+  return (traceNow() - _from) / 1000000.0;
+}
+
+// --------------------------------
+
+void beginStartup()
+{
+  startup_profile.start = traceNow();
+  startup_profile.stage_start = startup_profile.start;
+
+#ifdef __EMSCRIPTEN__
+  startup_profile.page_ms = emscripten_get_now();
+#endif
+}
+
+// --------------------------------
+
+void endStartupStage(const char* _name)
+{
+  StartupProfile& profile = startup_profile;
+
+  if(profile.stage_count < startup_max_stages)
+  {
+    profile.stages[profile.stage_count].name = _name;
+    profile.stages[profile.stage_count].ms = startupMilliseconds(profile.stage_start);
+    ++profile.stage_count;
+  }
+
+  profile.stage_start = traceNow();
+}
+
+// --------------------------------
+
+void printStartupReport()
+{
+  const StartupProfile& profile = startup_profile;
+
+  printf("Startup:");
+
+  for(int i = 0; i < profile.stage_count; ++i)
+  {
+    printf("%s %s %.1f", i ? "," : "", profile.stages[i].name, profile.stages[i].ms);
+  }
+
+  printf(" ms\n");
+
+  if(profile.page_ms > 0.0) { printf("Page load to main %.1f ms, ", profile.page_ms); }
+
+  printf("first frame at %.1f ms, ready at %.1f ms\n", profile.first_frame_ms, profile.ready_ms);
+}
+
+// --------------------------------
+
+// A cleared screen, shown while startup has stages left
+
+void showStartupFrame()
+{
+  bindFramebuffer(0);
+  setViewport(0, 0, window.width, window.height);
+  setClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+#ifndef RETRO_RENDER_THREAD
+  SDL_GL_SwapWindow(window.sdl_window);
+#endif
+
+  if(!startup_profile.first_frame_ms) { startup_profile.first_frame_ms = startupMilliseconds(startup_profile.start); }
+}
+
+// --------------------------------
+
+bool initSDL(void)
+{
+  if(SDL_Init(SDL_INIT_VIDEO) != 0) {
+    printf("Failed to initialize SDL:  %s\n", SDL_GetError());
+    return false;
+  }
+
+  if(!initWindow(640, 480)) { return false; }
+
+  return true;
+}
+
+// --------------------------------
+
+bool initOpenGL(void)
+{
+#ifdef RETRO_RENDER_THREAD
+  EmscriptenWebGLContextAttributes attributes;
+  emscripten_webgl_init_context_attributes(&attributes);
+  attributes.majorVersion = 2;
+  attributes.minorVersion = 0;
+
+  EMSCRIPTEN_WEBGL_CONTEXT_HANDLE context = emscripten_webgl_create_context("#canvas", &attributes);
+
+  if(context <= 0 || emscripten_webgl_make_context_current(context) != EMSCRIPTEN_RESULT_SUCCESS)
+#else
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+  SDL_GL_SetSwapInterval(1);
+  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+
+  SDL_GLContext context = SDL_GL_CreateContext(window.sdl_window);
+
+  if(!context)
+#endif
+  {
+    printf("Failed to create the OpenGL context\n");
+    return false;
+  }
+
+  printf("%s\n",glGetString(GL_VERSION));
+  printf("%s\n",glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+  resetGLState();
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  endStartupStage("GL context");
+
+  showStartupFrame();
+  endStartupStage("first frame");
+
+  return true;
+}
+
+// --------------------------------
+
+bool initDisplayStage()
+{
+  vpu.text_mode = default_text_mode;
+
+  return initDisplay(320, 240);
+}
+
+// --------------------------------
+
+// Console GL objects are made when the first console opens
+
+bool initConsoleStage()
+{
+  for(GLuint& unit : console_texture_units)
+  {
+    unit = acquireTextureUnit();
+    if(unit == no_texture_unit) { return false; }
+  }
+
+  if(!initConsoles(console_texture_units[0], console_texture_units[1], console_texture_units[2])) { return false; }
+
+  // Palette 0 is the default palette, palette 1 a green phosphor ramp
+
+  uint8_t phosphor[16 * 3];
+
+  for(int i = 0; i < 16; ++i)
+  {
+    phosphor[i * 3 + 0] = i * 4;
+    phosphor[i * 3 + 1] = i * 17;
+    phosphor[i * 3 + 2] = i * 6;
+  }
+
+  setConsolePalette(0, default_palette);
+  setConsolePalette(1, phosphor);
+
+  return true;
+}
+
+// --------------------------------
+
+bool initWindowStage()
+{
+  updateDisplayPalette();
+
+  resizeWindow(640, 480);
+
+  // --replay
+
+  if(!session.last.empty() && !startPlayback()) { return false; }
+
+  return true;
+}
+
+// --------------------------------
+
+struct DeferredStage
+{
+  const char* name;
+  bool        (*run)();
+};
+
+const DeferredStage deferred_stages[] =
+{
+  { "display",  initDisplayStage },
+  { "VPU",      initVPU },
+  { "consoles", initConsoleStage },
+  { "window",   initWindowStage },
+};
+
+const int deferred_stage_count = sizeof(deferred_stages) / sizeof(deferred_stages[0]);
+
+// --------------------------------
+
+// Runs the stages left that fit in this frame. Returns true once startup is
+// done, false with a cleared screen shown until then. A stage that fails
+// ends the program.
+
+bool continueStartup()
+{
+  StartupProfile& profile = startup_profile;
+
+  if(profile.ready) { return true; }
+
+  TRACE_SCOPE("continueStartup");
+
+  const uint64_t frame_start = traceNow();
+
+  profile.stage_start = frame_start;
+
+  while(profile.next_deferred < deferred_stage_count && startupMilliseconds(frame_start) < startup_frame_budget_ms)
+  {
+    const DeferredStage& stage = deferred_stages[profile.next_deferred++];
+
+    if(!stage.run())
+    {
+      printf("Startup stage %s failed\n", stage.name);
+
+      running = false;
+#ifdef __EMSCRIPTEN__
+      emscripten_cancel_main_loop();
+#endif
+      return false;
+    }
+
+    endStartupStage(stage.name);
+  }
+
+  if(profile.next_deferred < deferred_stage_count)
+  {
+    showStartupFrame();
+    return false;
+  }
+
+  profile.ready = true;
+  profile.ready_ms = startupMilliseconds(profile.start);
+
+  printStartupReport();
+
+  return true;
+}
+
+// --------------------------------
+
+bool startup(void)
+{
+  initMachine();
+  endStartupStage("machine");
+
+  if(!initSDL()) { return false; }
+  endStartupStage("SDL");
+
+  // The machine runs without sound when there is no audio device
+
+  initAudio();
+  endStartupStage("audio");
+
+#ifndef RETRO_RENDER_THREAD
+  if(!initOpenGL()) { return false; }
+#endif
+
+  // saveFile("game", "The time has come the Walrus said, to talk of many things.");
+  // chooseFile();
+
+  return true;
+}
+
+// --------------------------------
+
+bool nextEvent(SDL_Event& _event)
+{
+#ifdef RETRO_RENDER_THREAD
+  return popRingBuffer(event_queue.events, _event);
+#else
+  return SDL_PollEvent(&_event) != 0;
+#endif
+}
+
+// --------------------------------
+
+void pollEvents(void)
+{
+  TRACE_SCOPE("pollEvents");
+
+  SDL_Event event;
+
+  while(nextEvent(event))
+  {
+    queueInput(event);
+
+    switch (event.type)
+    {
+      case SDL_QUIT:
+        running = false;
 #ifdef __EMSCRIPTEN__
         emscripten_cancel_main_loop();
 #endif
@@ -486,18 +3268,200 @@ void update(void)
           }
           break;
         }
+
+      case SDL_KEYDOWN:
+        if(event.key.repeat) { break; }
+        if(event.key.keysym.sym == SDLK_F1) { toggleOverlay(); }
+        if(event.key.keysym.sym == SDLK_F2) { cycleTextMode(); }
+        if(event.key.keysym.sym == SDLK_F3) { toggleLateInputLatch(); }
+        if(event.key.keysym.sym == SDLK_F4) { toggleDashboard(); }
+        if(event.key.keysym.sym == SDLK_F5) { toggleIndexedDisplay(); }
+        if(event.key.keysym.sym == SDLK_F6) { toggleTrace(); }
+        if(event.key.keysym.sym == SDLK_F7) { toggleHelp(); }
+        if(event.key.keysym.sym == SDLK_F8) { toggleRecording(); }
+        if(event.key.keysym.sym == SDLK_F9) { togglePlayback(); }
+        if(event.key.keysym.sym == SDLK_F10) { cycleSessionSpeed(); }
+        if(event.key.keysym.sym == SDLK_F11) { togglePartialRedraw(); }
+        if(event.key.keysym.sym == SDLK_F12) { cycleScalingMode(); }
+        if(event.key.keysym.sym == SDLK_PAGEUP) { seekSession(-session_seek_frames); }
+        if(event.key.keysym.sym == SDLK_PAGEDOWN) { seekSession(session_seek_frames); }
+        break;
+    }
+  }
+}
+
+// --------------------------------
+
+void render(void)
+{
+  TRACE_SCOPE("render");
+
+  updateOverlay();
+  flushGlyphUploads();
+
+  // Late latching: input is polled right before the VPU pass, and a machine
+  // frame that is due is started on it
+
+  if(late_input_latch)
+  {
+    pollEvents();
+    latchMachineFrame();
+  }
+
+  syncMachineFrame();
+  stepPlayback();
+  if(ui_visible) { composeUI(writeUIRect); }
+  uploadVPU();
+  updateDashboard();
+  uploadConsoles();
+
+  renderVPU();
+  renderConsoles(display.width, display.height);
+  showDisplay();
+
+  overlay.gl_calls = endGLFrame();
+
+  traceCounter("GL calls issued", overlay.gl_calls.issued);
+  traceCounter("GL calls skipped", overlay.gl_calls.skipped);
+  traceCounter("CPU cycles", simulation.frame_cycles);
+  traceCounter("Input events", simulation.input_count);
+
+  // The render thread presents when its main loop callback returns
+
+#ifndef RETRO_RENDER_THREAD
+  {
+    TRACE_SCOPE("swap");
+    SDL_GL_SwapWindow(window.sdl_window);
+  }
+#endif
+
+  recordInputLatency(simulation.input_timestamps, simulation.input_count, SDL_GetTicks());
+  simulation.input_count = 0;
+}
+
+// --------------------------------
+
+// Frame scratch memory is let go, and a frame past the warm up that used
+// the heap is reported, at most once a second
+
+void endFrameMemory()
+{
+  resetArena(frame_arena);
+
+  frame_heap.last = endHeapCount();
+
+  if(++frame_heap.frames <= heap_warmup_frames || !frame_heap.last.allocations) { return; }
+
+  ++frame_heap.allocating_frames;
+
+  if(frame_heap.frames - frame_heap.reported < 60) { return; }
+
+  frame_heap.reported = frame_heap.frames;
+
+  printf("Frame %u: %u heap allocations, %u bytes, %u frames allocated so far\n", frame_heap.frames, frame_heap.last.allocations,
+      (unsigned int)frame_heap.last.bytes, frame_heap.allocating_frames);
+}
+
+// --------------------------------
+
+void update(void)
+{
+  TRACE_SCOPE("update");
+
+  beginHeapCount();
+
+  if(continueStartup())
+  {
+    if(!late_input_latch) { pollEvents(); }
+
+    render();
+  }
+
+  endFrameMemory();
+}
+
+// --------------------------------
+
+#ifdef RETRO_RENDER_THREAD
+
+// Main thread loop: SDL registers its DOM event handlers on the main thread,
+// so events are polled here and handed to the render thread
+
+void pumpEvents(void)
+{
+  SDL_Event event;
+
+  while(SDL_PollEvent(&event))
+  {
+    if(!pushRingBuffer(event_queue.events, event))
+    {
+      printf("Event queue full, %u events dropped\n", ++event_queue.dropped);
     }
+
+    if(event.type == SDL_QUIT) { emscripten_cancel_main_loop(); }
+  }
+}
+
+// --------------------------------
+
+void* renderThread(void*)
+{
+  setTraceThreadName("render");
+
+  if(!initOpenGL()) { return nullptr; }
+
+  emscripten_set_main_loop(update, 0, true);
+
+  return nullptr;
+}
+
+// --------------------------------
+
+// The canvas is transferred to the new thread as an OffscreenCanvas. Canvas
+// resizes made by SDL on the main thread are proxied to it by Emscripten.
+
+bool startRenderThread(void)
+{
+  initRingBuffer(event_queue.events);
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  emscripten_pthread_attr_settransferredcanvases(&attributes, "#canvas");
+
+  pthread_t thread;
+  const int error = pthread_create(&thread, &attributes, renderThread, nullptr);
+
+  pthread_attr_destroy(&attributes);
+
+  if(error)
+  {
+    printf("Failed to start the render thread\n");
+    return false;
   }
 
-  render();
+  return true;
 }
 
+#endif
+
 // --------------------------------
 
 void shutdown(void)
 {
+  stopSimulation();
+
+  destroyAudio();
+  destroyTrace();
+
   destroyDisplay();
   destroyVPU();
+  destroyConsoles();
+  destroyProgramVariants();
+  destroyArena(frame_arena);
+
+  for(GLuint unit : console_texture_units) { releaseTextureUnit(unit); }
+
+  closeBundle(assets.load());
 
   SDL_Quit();
 }
@@ -524,11 +3488,234 @@ int loadFile(char* _data)
 
 // --------------------------------
 
+// Headless mode: runs a program for a number of seconds as fast as possible
+// and writes the sound it makes to a WAV file
+
+bool renderWAV(const char* _program_filename, const char* _wav_filename, int _seconds)
+{
+  initMachine();
+  initSoundChip(sound_sample_rate);
+
+  if(!_program_filename || !loadProgram(_program_filename)) { return false; }
+
+  const int samples_per_frame = sound_sample_rate / 60;
+  const int frames = _seconds * 60;
+  int16_t* samples = (int16_t*)malloc(frames * samples_per_frame * sizeof(int16_t));
+
+  for(int frame = 0; frame < frames; ++frame)
+  {
+    runMachine();
+    renderSound(samples + frame * samples_per_frame, samples_per_frame);
+  }
+
+  const bool ok = writeWAV(_wav_filename, samples, frames * samples_per_frame, sound_sample_rate);
+
+  free(samples);
+
+  if(ok) { printf("Wrote %d seconds of sound to %s\n", _seconds, _wav_filename); }
+
+  return ok;
+}
+
+// --------------------------------
+
+// Headless mode: runs a program for a number of seconds as fast as possible
+// and records every machine frame
+
+bool recordSessionFile(const char* _program_filename, const char* _session_filename, int _seconds)
+{
+  initMachine();
+  initSoundChip(sound_sample_rate);
+
+  if(!_program_filename || !loadProgram(_program_filename)) { return false; }
+
+  SessionRecorder recorder;
+  startRecording(recorder, machine_vpu_pages * 256);
+
+  for(int frame = 0; frame < _seconds * 60; ++frame)
+  {
+    runMachine();
+    recordFrame(recorder, frame, machinePage(machine_map_page));
+  }
+
+  std::vector<uint8_t> data;
+  stopRecording(recorder, data);
+
+  if(!writeSession(_session_filename, data)) { return false; }
+
+  printf("Wrote %d seconds, %u bytes of session to %s\n", _seconds, (unsigned int)data.size(), _session_filename);
+
+  return true;
+}
+
+// --------------------------------
+
+// Headless mode: converts numbered images (a printf pattern such as
+// clip/%04d.png, counting from 0) to character art for the default 40x30
+// cell display and records them as a session at 60 frames per second, to
+// be played back with --replay
+
+bool recordCharArtClip(const char* _pattern, const char* _session_filename)
+{
+  const int columns = 40;
+  const int rows = 30;
+
+  initMachine();
+
+  setCharArtFont(char_art, machinePage(machine_font_page));
+  setCharArtPalette(char_art, machinePage(machine_register_page) + vpu_palette);
+
+  SessionRecorder recorder;
+  startRecording(recorder, machine_vpu_pages * 256);
+
+  int frame = 0;
+  char filename[256];
+  uint64_t convert_time = 0;
+
+  for(;; ++frame)
+  {
+    snprintf(filename, sizeof(filename), _pattern, frame);
+
+    FILE* file = fopen(filename, "rb");
+    if(!file) { break; }
+    fclose(file);
+
+    const uint64_t start = traceNow();
+
+    if(!loadCharArt(filename, machinePage(machine_map_page), machinePage(machine_attribute_page), columns, rows)) { break; }
+
+    convert_time += traceNow() - start;
+
+    recordFrame(recorder, frame, machinePage(machine_map_page));
+  }
+
+  std::vector<uint8_t> data;
+  stopRecording(recorder, data);
+
+  if(!frame)
+  {
+    printf("No frames found for %s\n", _pattern);
+    return false;
+  }
+
+  if(!writeSession(_session_filename, data)) { return false; }
+
+  printf("Wrote %d frames, %u bytes of session to %s, %.2f ms per frame to load and convert\n",
+      frame, (unsigned int)data.size(), _session_filename, convert_time / 1e6 / frame);
+
+  return true;
+}
+
+// --------------------------------
+
+// Plays two sessions side by side as fast as possible and reports the frames
+// where the VPU windows differ, to compare the output of two builds. Returns
+// true when they match.
+
+bool diffSessions(const char* _filename_a, const char* _filename_b)
+{
+  std::vector<uint8_t> data_a, data_b;
+  SessionPlayer a, b;
+
+  if(!loadSession(_filename_a, data_a) || !openPlayback(a, data_a)) { return false; }
+  if(!loadSession(_filename_b, data_b) || !openPlayback(b, data_b)) { return false; }
+
+  if(a.window_size != b.window_size)
+  {
+    printf("The sessions record different windows\n");
+    return false;
+  }
+
+  const uint32_t frames = std::max(a.frame_count, b.frame_count);
+  uint32_t differing = 0;
+  int64_t first = -1;
+  int records = 0;
+
+  const uint64_t start = traceNow();
+
+  for(uint32_t frame = 0; frame < frames; ++frame)
+  {
+    records += seekPlayback(a, frame) + seekPlayback(b, frame);
+
+    if(!memcmp(a.window.data(), b.window.data(), a.window_size)) { continue; }
+
+    if(first < 0)
+    {
+      int offset = 0;
+      while(a.window[offset] == b.window[offset]) { ++offset; }
+
+      printf("First difference in frame %u at $%04X\n", frame, machine_map_page * 256 + offset);
+      first = frame;
+    }
+
+    ++differing;
+  }
+
+  const double seconds = (traceNow() - start) / 1e9;
+
+  printf("%u frames, %d records replayed in %.1f ms, %.0fx real time\n", frames, records, seconds * 1000.0, seconds > 0.0 ? frames / 60.0 / seconds : 0.0);
+  printf("%u frames differ\n", differing);
+
+  return !differing;
+}
+
+// --------------------------------
+
+// retro [program.prg] [--wav file.wav | --record file.rrec] [--seconds n]
+//       [--replay file.rrec] [--diff a.rrec b.rrec] [--art image.png]
+//       [--art-clip pattern.png file.rrec] [--scale integer|fit|stretch|prescale]
+//       [--gpu-budget MB]
+
 int main(int argc, char** argv)
 {
+  beginStartup();
+
+  const char* program_filename = nullptr;
+  const char* wav_filename = nullptr;
+  const char* record_filename = nullptr;
+  const char* replay_filename = nullptr;
+  int wav_seconds = 10;
+
+  for(int i = 1; i < argc; ++i)
+  {
+    if(!strcmp(argv[i], "--wav") && i + 1 < argc) { wav_filename = argv[++i]; }
+    else if(!strcmp(argv[i], "--seconds") && i + 1 < argc) { wav_seconds = atoi(argv[++i]); }
+    else if(!strcmp(argv[i], "--record") && i + 1 < argc) { record_filename = argv[++i]; }
+    else if(!strcmp(argv[i], "--replay") && i + 1 < argc) { replay_filename = argv[++i]; }
+    else if(!strcmp(argv[i], "--art") && i + 1 < argc) { startup_art_filename = argv[++i]; }
+    else if(!strcmp(argv[i], "--art-clip") && i + 2 < argc) { return recordCharArtClip(argv[i + 1], argv[i + 2]) ? 0 : 1; }
+    else if(!strcmp(argv[i], "--diff") && i + 2 < argc) { return diffSessions(argv[i + 1], argv[i + 2]) ? 0 : 1; }
+    else if(!strcmp(argv[i], "--scale") && i + 1 < argc)
+    {
+      const char* name = argv[++i];
+
+      for(int mode = 0; mode < scaling_mode_count; ++mode)
+      {
+        if(!strcmp(name, scaling_mode_names[mode])) { scaling_mode = mode; }
+      }
+    }
+    else if(!strcmp(argv[i], "--gpu-budget") && i + 1 < argc) { setGPUMemoryBudget((size_t)atoi(argv[++i]) << 20); }
+    else { program_filename = argv[i]; }
+  }
+
+  if(wav_filename) { return renderWAV(program_filename, wav_filename, wav_seconds) ? 0 : 1; }
+  if(record_filename) { return recordSessionFile(program_filename, record_filename, wav_seconds) ? 0 : 1; }
+  if(replay_filename && !loadSession(replay_filename, session.last)) { return 1; }
+
+  setTraceThreadName("main");
+
   if(!startup()) { return 1; }
 
-#ifdef __EMSCRIPTEN__
+  // On the web the bundle arrives while the main loop is already running
+
+  startup_program_filename = program_filename;
+  loadBundle(bundle_filename, bundleLoaded);
+
+#if defined(RETRO_RENDER_THREAD)
+  if(!startRenderThread()) { return 1; }
+
+  emscripten_set_main_loop(pumpEvents, 0, true);
+#elif defined(__EMSCRIPTEN__)
   emscripten_set_main_loop(update, 0, true);
 #else
   while(running) {
@@ -0,0 +1,68 @@
+#ifndef _ringbuffer_h_
+#define _ringbuffer_h_
+
+#include <atomic>
+#include <cstdint>
+
+// --------------------------------
+// Lock-free single producer, single consumer ring buffer
+//
+// head and tail count items pushed and popped since the start and are only
+// written by their own side, so each call is a load of the other side's
+// counter and a store of its own. _size must be a power of two.
+
+template <typename T, int _size>
+struct RingBuffer
+{
+  static_assert((_size & (_size - 1)) == 0, "Ring buffer size must be a power of two");
+
+  T items[_size];
+
+  alignas(64) std::atomic<uint32_t> head;   // Producer only
+  alignas(64) std::atomic<uint32_t> tail;   // Consumer only
+};
+
+// --------------------------------
+
+template <typename T, int _size>
+void initRingBuffer(RingBuffer<T, _size>& _ring)
+{
+  _ring.head.store(0, std::memory_order_relaxed);
+  _ring.tail.store(0, std::memory_order_relaxed);
+}
+
+// --------------------------------
+
+// Returns false and drops the item when the ring is full
+
+template <typename T, int _size>
+bool pushRingBuffer(RingBuffer<T, _size>& _ring, const T& _item)
+{
+  const uint32_t head = _ring.head.load(std::memory_order_relaxed);
+
+  if(head - _ring.tail.load(std::memory_order_acquire) == (uint32_t)_size) { return false; }
+
+  _ring.items[head & (_size - 1)] = _item;
+  _ring.head.store(head + 1, std::memory_order_release);
+
+  return true;
+}
+
+// --------------------------------
+
+template <typename T, int _size>
+bool popRingBuffer(RingBuffer<T, _size>& _ring, T& _item)
+{
+  const uint32_t tail = _ring.tail.load(std::memory_order_relaxed);
+
+  if(tail == _ring.head.load(std::memory_order_acquire)) { return false; }
+
+  _item = _ring.items[tail & (_size - 1)];
+  _ring.tail.store(tail + 1, std::memory_order_release);
+
+  return true;
+}
+
+// --------------------------------
+
+#endif
@@ -3,11 +3,11 @@
 
 // --------------------------------
 
-const char* pixel_upscale_vs =
+const char* const pixel_upscale_vs =
 R"VS(#version 300 es
 precision highp float;
-in vec2 position;
-in vec2 uv;
+layout(location = 0) in vec2 position;
+layout(location = 1) in vec2 uv;
 out vec2 pixel;
 uniform vec2 screen_size;
 void main()
@@ -19,64 +19,308 @@ void main()
 
 // --------------------------------
 
-const char* pixel_upscale_fs =
+// With INDEXED the screen holds palette indices. The four texels the
+// bilinear filter would blend are resolved through the palette first and
+// blended here, so the seams get the same filtering as RGB screens.
+//
+// The filter depends on the scaling mode: NEAREST for whole multiples,
+// where every window pixel falls inside one screen pixel, PRESCALE for a
+// nearest scale by the prescale factor followed by a bilinear one, and
+// otherwise seams antialiased over one window pixel.
+
+const char* const pixel_upscale_fs =
 R"FS(#version 300 es
 precision highp float;
 in vec2 pixel;
 out vec4 color;
 uniform vec2 screen_size;
+#ifdef PRESCALE
+uniform vec2 prescale;
+#endif
+#ifdef INDEXED
+uniform highp usampler2D screen_sampler;
+uniform highp sampler2D palette_sampler;
+
+vec3 resolve(ivec2 p)
+{
+  uint index = texelFetch(screen_sampler, clamp(p, ivec2(0), ivec2(screen_size) - 1), 0).r;
+  return texelFetch(palette_sampler, ivec2(index, 0), 0).rgb;
+}
+#else
 uniform sampler2D screen_sampler;
+#endif
 void main()
 {
+#ifdef NEAREST
+#ifdef INDEXED
+  color = vec4(resolve(ivec2(pixel)), 1.0);
+#else
+  color = texelFetch(screen_sampler, ivec2(pixel), 0);
+#endif
+#else
+#ifdef PRESCALE
+  // Blends the two screen pixels of neighbouring prescaled pixels, which
+  // are the same one except at the seams
+
+  vec2 prescaled = pixel * prescale - 0.5;
+  vec2 i = floor(prescaled);
+  vec2 a = floor(i / prescale);
+  vec2 b = floor((i + 1.0) / prescale);
+  vec2 filtered = a + 0.5 + (b - a) * (prescaled - i);
+#else
   vec2 seam = floor(pixel + 0.5);
   vec2 dudv = fwidth(pixel);
-  vec2 uv = (seam + clamp((pixel - seam) / dudv, -0.5, 0.5)) / screen_size;
+  vec2 filtered = seam + clamp((pixel - seam) / dudv, -0.5, 0.5);
+#endif
+
+#ifdef INDEXED
+  vec2 texel = filtered - 0.5;
+  vec2 f = fract(texel);
+  ivec2 p = ivec2(floor(texel));
+
+  vec3 top = mix(resolve(p), resolve(p + ivec2(1, 0)), f.x);
+  vec3 bottom = mix(resolve(p + ivec2(0, 1)), resolve(p + ivec2(1, 1)), f.x);
 
-  color = texture(screen_sampler, uv);
+  color = vec4(mix(top, bottom, f.y), 1.0);
+#else
+  color = texture(screen_sampler, filtered / screen_size);
+#endif
+#endif
 }
 )FS";
 
 // --------------------------------
 
-const char* text_mode_vs =
+// One instance per rectangle of screen cells to draw: x, y, width, height in
+// cells. The whole screen is one rectangle, clipped to the screen.
+
+const char* const text_mode_vs =
 R"VS(#version 300 es
 precision highp float;
-in vec2 position;
-in vec2 uv;
+layout(location = 0) in uvec4 rect;
 out vec2 pixel;
 uniform vec2 screen_size;
+uniform vec2 glyph_size;
 void main()
 {
-  gl_Position = vec4(position, 0.0, 1.0);
-  pixel = uv * screen_size;
+  vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+  pixel = min((vec2(rect.xy) + corner * vec2(rect.zw)) * glyph_size, screen_size);
+  gl_Position = vec4(pixel / screen_size * 2.0 - 1.0, 0.0, 1.0);
 }
 )VS";
 
 // --------------------------------
 
-const char* text_mode_fs =
+// Cell and atlas addressing is injected by textModeDefines() as
+// CELL_X/CELL_Y (pixel -> map cell), GLYPH_X/GLYPH_Y (pixel within the cell)
+// and ATLAS_X/ATLAS_Y (glyph -> top left of its tile in the font atlas).
+// With INDEXED the palette index is written instead of the colour.
+// ANIMATION_FRAMES is the number of frame rows of the glyph animation table.
+
+const char* const text_mode_fs =
 R"FS(#version 300 es
 precision highp float;
 in vec2 pixel;
+#ifdef INDEXED
+out uint color;
+#else
 out vec4 color;
+#endif
 uniform highp sampler2D font_sampler;
 uniform highp usampler2D map_sampler;
+uniform highp usampler2D attribute_sampler;
+uniform vec3 palette[16];
+uniform ivec2 scroll;
+uniform ivec2 map_pixels;
+uniform highp usampler2D animation_sampler;
+uniform uint animation_time;
 void main()
 {
-  const vec4 bg = vec4(0.28, 0.23, 0.67, 1.0);
-  const vec4 fg = vec4(0.53, 0.48, 0.87, 1.0);
+  ivec2 p = ivec2(pixel) + scroll;
+
+  if(p.x >= map_pixels.x) { p.x -= map_pixels.x; }
+  if(p.y >= map_pixels.y) { p.y -= map_pixels.y; }
+
+  uvec2 up = uvec2(p);
+  ivec2 cell_position = ivec2(CELL_X(up.x), CELL_Y(up.y));
+
+  uint cell = texelFetch(map_sampler, cell_position, 0).r;
+  uint attribute = texelFetch(attribute_sampler, cell_position, 0).r;
 
-  uint cell = texelFetch(map_sampler, ivec2(pixel) >> 3, 0).r;
+  // Animated glyphs show the frame the time falls in. Row 0 of the table
+  // holds the frame count and total duration, the rows below the frames.
 
-  uint cell_x = (cell & 0x0FU) << 3;
-  uint cell_y = (cell & 0xF0U) >> 1;
+  if(cell < 256U)
+  {
+    uvec2 animation = texelFetch(animation_sampler, ivec2(cell, 0), 0).rg;
 
-  uint pixel_x = uint(pixel.x) & 0x07U;
-  uint pixel_y = uint(pixel.y) & 0x07U;
+    if(animation.x != 0U)
+    {
+      uint t = animation_time % animation.y;
 
-  float c = texelFetch(font_sampler, ivec2(cell_x + pixel_x, cell_y + pixel_y), 0).r;
+      for(int i = 1; i <= ANIMATION_FRAMES; ++i)
+      {
+        uvec2 frame = texelFetch(animation_sampler, ivec2(cell, i), 0).rg;
+        if(t < frame.y) { cell = frame.x; break; }
+        t -= frame.y;
+      }
+    }
+  }
+
+  uint atlas_x = ATLAS_X(cell) + GLYPH_X(up.x);
+  uint atlas_y = ATLAS_Y(cell) + GLYPH_Y(up.y);
+
+  float c = texelFetch(font_sampler, ivec2(atlas_x, atlas_y), 0).r;
+
+#ifdef INDEXED
+  color = c < 0.5 ? attribute >> 4 : attribute & 0x0FU;
+#else
+  color = vec4(mix(palette[attribute >> 4], palette[attribute & 0x0FU], c), 1.0);
+#endif
+}
+)FS";
+
+// --------------------------------
+
+// One instance per sprite table entry, read straight from the table as four
+// little endian 16 bit words: x, y, glyph | colour << 8, flags. Hidden
+// sprites are moved outside the clip volume.
+
+const char* const sprite_vs =
+R"VS(#version 300 es
+precision highp float;
+layout(location = 0) in uvec4 sprite;
+out vec2 glyph_pixel;
+flat out uint glyph;
+flat out uint colour;
+uniform vec2 screen_size;
+uniform vec2 glyph_size;
+void main()
+{
+  if((sprite.w & 1U) == 0U)
+  {
+    gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+    return;
+  }
+
+  vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+  vec2 origin = vec2(sprite.xy) - vec2(greaterThanEqual(sprite.xy, uvec2(0x8000U))) * 65536.0;
+  vec2 position = origin + corner * glyph_size;
+
+  gl_Position = vec4(position / screen_size * 2.0 - 1.0, 0.0, 1.0);
+  glyph_pixel = corner * glyph_size;
+  glyph = sprite.z & 0xFFU;
+  colour = (sprite.z >> 8) & 0x0FU;
+}
+)VS";
+
+// --------------------------------
 
-  color = mix(bg, fg, c);
+const char* const sprite_fs =
+R"FS(#version 300 es
+precision highp float;
+in vec2 glyph_pixel;
+flat in uint glyph;
+flat in uint colour;
+#ifdef INDEXED
+out uint color;
+#else
+out vec4 color;
+#endif
+uniform highp sampler2D font_sampler;
+uniform vec3 palette[16];
+void main()
+{
+  uvec2 g = uvec2(glyph_pixel);
+
+  float c = texelFetch(font_sampler, ivec2(ATLAS_X(glyph) + g.x, ATLAS_Y(glyph) + g.y), 0).r;
+
+  if(c < 0.5) { discard; }
+
+#ifdef INDEXED
+  color = colour;
+#else
+  color = vec4(palette[colour], 1.0);
+#endif
+}
+)FS";
+
+// --------------------------------
+
+// One instance per console: its rectangle as x, y in display pixels and
+// columns, rows in 8x8 cells, then its map layer, font layer, palette and
+// flags. Closed consoles are moved outside the clip volume.
+
+const char* const console_vs =
+R"VS(#version 300 es
+precision highp float;
+layout(location = 0) in ivec4 rect;
+layout(location = 1) in uvec4 style;
+out vec2 cell_pixel;
+flat out uint layer;
+flat out uint font;
+flat out uint palette_base;
+uniform vec2 screen_size;
+void main()
+{
+  if((style.w & 1U) == 0U)
+  {
+    gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+    return;
+  }
+
+  vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+  vec2 size = vec2(rect.zw) * 8.0;
+  vec2 position = vec2(rect.xy) + corner * size;
+
+  gl_Position = vec4(position / screen_size * 2.0 - 1.0, 0.0, 1.0);
+  cell_pixel = corner * size;
+  layer = style.x;
+  font = style.y;
+  palette_base = style.z * 16U;
+}
+)VS";
+
+// --------------------------------
+
+// Consoles use 8x8 cells and the 16 x 16 glyph atlas of the default text
+// mode. PALETTE_ENTRIES is injected, 16 per console palette. With INDEXED
+// the console palettes are entries FIRST_INDEX onwards of the display
+// palette.
+
+const char* const console_fs =
+R"FS(#version 300 es
+precision highp float;
+in vec2 cell_pixel;
+flat in uint layer;
+flat in uint font;
+flat in uint palette_base;
+#ifdef INDEXED
+out uint color;
+#else
+out vec4 color;
+#endif
+uniform highp sampler2DArray font_sampler;
+uniform highp usampler2DArray map_sampler;
+uniform highp usampler2DArray attribute_sampler;
+uniform vec3 palettes[PALETTE_ENTRIES];
+void main()
+{
+  uvec2 p = uvec2(cell_pixel);
+  ivec3 cell_position = ivec3(p >> 3U, layer);
+
+  uint cell = texelFetch(map_sampler, cell_position, 0).r;
+  uint attribute = texelFetch(attribute_sampler, cell_position, 0).r;
+
+  uvec2 atlas = ((uvec2(cell & 0x0FU, cell >> 4U)) << 3U) | (p & 7U);
+
+  float c = texelFetch(font_sampler, ivec3(atlas, font), 0).r;
+
+#ifdef INDEXED
+  color = FIRST_INDEX + palette_base + (c < 0.5 ? attribute >> 4 : attribute & 0x0FU);
+#else
+  color = vec4(mix(palettes[palette_base + (attribute >> 4)], palettes[palette_base + (attribute & 0x0FU)], c), 1.0);
+#endif
 }
 )FS";
 
@@ -0,0 +1,226 @@
+#include <cinttypes>
+#include <cstdio>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+
+// --------------------------------
+
+enum TraceEventType
+{
+  trace_span,
+  trace_counter,
+};
+
+struct TraceEvent
+{
+  const char* name;
+  uint64_t    start;
+  int64_t     value;      // End of a span, value of a counter
+  int         type;
+};
+
+// Written only by its own thread. count is published with release so the
+// thread writing the JSON sees complete events.
+
+struct TraceBuffer
+{
+  TraceEvent            events[trace_events_per_thread];
+  std::atomic<uint64_t> count;
+
+  const char*           name;
+  int                   id;
+};
+
+struct Trace
+{
+  std::mutex                mutex;     // Guards buffers
+  std::vector<TraceBuffer*> buffers;   // Kept when threads exit, until destroyTrace()
+
+  uint64_t start;
+  uint64_t stop;
+};
+
+std::atomic<bool> trace_capturing(false);
+
+Trace trace;
+
+thread_local TraceBuffer* trace_buffer = nullptr;
+thread_local const char* trace_thread_name = nullptr;
+
+// --------------------------------
+
+uint64_t traceNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// --------------------------------
+
+void setTraceThreadName(const char* _name)
+{
+  trace_thread_name = _name;
+}
+
+// --------------------------------
+
+TraceBuffer* reserveTraceBuffer(const char* _name)
+{
+  TraceBuffer* buffer = new TraceBuffer;
+  buffer->count.store(0, std::memory_order_relaxed);
+  buffer->name = _name;
+
+  std::lock_guard<std::mutex> lock(trace.mutex);
+
+  buffer->id = trace.buffers.size() + 1;
+  trace.buffers.push_back(buffer);
+
+  return buffer;
+}
+
+// --------------------------------
+
+void claimTraceBuffer(TraceBuffer* _buffer)
+{
+  trace_buffer = _buffer;
+}
+
+// --------------------------------
+
+// The buffer of a thread is created by its first event, unless it claimed one
+
+static TraceBuffer* threadBuffer()
+{
+  if(!trace_buffer) { trace_buffer = reserveTraceBuffer(trace_thread_name); }
+
+  return trace_buffer;
+}
+
+// --------------------------------
+
+static void record(const char* _name, uint64_t _start, int64_t _value, int _type)
+{
+  TraceBuffer* buffer = threadBuffer();
+
+  const uint64_t count = buffer->count.load(std::memory_order_relaxed);
+  TraceEvent& event = buffer->events[count % trace_events_per_thread];
+
+  event.name = _name;
+  event.start = _start;
+  event.value = _value;
+  event.type = _type;
+
+  buffer->count.store(count + 1, std::memory_order_release);
+}
+
+// --------------------------------
+
+void traceSpan(const char* _name, uint64_t _start, uint64_t _end)
+{
+  if(!tracing()) { return; }
+
+  record(_name, _start, _end, trace_span);
+}
+
+// --------------------------------
+
+void traceCounter(const char* _name, int64_t _value)
+{
+  if(!tracing()) { return; }
+
+  record(_name, traceNow(), _value, trace_counter);
+}
+
+// --------------------------------
+
+void startTrace()
+{
+  trace.start = traceNow();
+  trace.stop = UINT64_MAX;
+
+  trace_capturing.store(true, std::memory_order_relaxed);
+}
+
+// --------------------------------
+
+void stopTrace()
+{
+  trace_capturing.store(false, std::memory_order_relaxed);
+
+  trace.stop = traceNow();
+}
+
+// --------------------------------
+
+void destroyTrace()
+{
+  stopTrace();
+
+  std::lock_guard<std::mutex> lock(trace.mutex);
+
+  for(TraceBuffer* buffer : trace.buffers) { delete buffer; }
+  trace.buffers.clear();
+
+  trace_buffer = nullptr;
+}
+
+// --------------------------------
+
+// Buffers keep events from earlier captures, only those inside the last one
+// are written. A thread that saw the capture running may still be writing
+// one event into the oldest slot, so that slot is skipped.
+
+int writeTraceJSON(std::string& _json)
+{
+  std::lock_guard<std::mutex> lock(trace.mutex);
+
+  char line[256];
+  int written = 0;
+
+  _json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  for(const TraceBuffer* buffer : trace.buffers)
+  {
+    if(buffer->name)
+    {
+      snprintf(line, sizeof(line), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", buffer->id, buffer->name);
+      _json += line;
+    }
+
+    const uint64_t count = buffer->count.load(std::memory_order_acquire);
+    const uint64_t first = count >= (uint64_t)trace_events_per_thread ? count - trace_events_per_thread + 1 : 0;
+
+    for(uint64_t i = first; i < count; ++i)
+    {
+      const TraceEvent& event = buffer->events[i % trace_events_per_thread];
+
+      if(event.start < trace.start || event.start > trace.stop) { continue; }
+
+      const double ts = (event.start - trace.start) / 1000.0;
+
+      if(event.type == trace_span)
+      {
+        snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+            event.name, buffer->id, ts, (event.value - event.start) / 1000.0);
+      }
+      else
+      {
+        snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%" PRId64 "}},\n",
+            event.name, buffer->id, ts, event.value);
+      }
+
+      _json += line;
+      ++written;
+    }
+  }
+
+  // Drop the trailing comma
+
+  if(_json.size() > 2 && _json[_json.size() - 2] == ',') { _json.erase(_json.size() - 2, 1); }
+
+  _json += "]}\n";
+
+  return written;
+}
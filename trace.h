@@ -0,0 +1,68 @@
+#ifndef _trace_h_
+#define _trace_h_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// --------------------------------
+// Frame tracing
+//
+// Spans and counters are recorded into a ring buffer per thread while a
+// capture is running, and written out as Chrome trace event JSON, which
+// chrome://tracing and ui.perfetto.dev load. When no capture is running a
+// span costs one relaxed atomic load.
+//
+// Names must be string literals without quotes or backslashes, the events
+// keep the pointer.
+
+const int trace_events_per_thread = 16384;   // The newest ones are kept
+
+extern std::atomic<bool> trace_capturing;
+
+inline bool tracing() { return trace_capturing.load(std::memory_order_relaxed); }
+
+uint64_t traceNow();                           // Nanoseconds, steady clock
+
+void setTraceThreadName(const char* _name);
+
+// A thread's buffer is made by its first event, which allocates and locks.
+// A thread that must do neither, like the audio callback, is given one made
+// ahead of time and claims it, which only sets a thread local.
+
+struct TraceBuffer;
+
+TraceBuffer* reserveTraceBuffer(const char* _name);
+void claimTraceBuffer(TraceBuffer* _buffer);
+
+void traceSpan(const char* _name, uint64_t _start, uint64_t _end);
+void traceCounter(const char* _name, int64_t _value);
+
+void startTrace();
+void stopTrace();
+
+// Frees every buffer, once the threads that traced have stopped
+
+void destroyTrace();
+
+// Events of the last capture, from every thread. Returns the number of
+// events written.
+
+int writeTraceJSON(std::string& _json);
+
+// Records the enclosing scope as a span
+
+struct TraceScope
+{
+  const char* name;
+  uint64_t    start;
+
+  explicit TraceScope(const char* _name) : name(_name), start(tracing() ? traceNow() : 0) {}
+  ~TraceScope() { if(start) { traceSpan(name, start, traceNow()); } }
+};
+
+#define TRACE_CONCAT_(_a, _b) _a##_b
+#define TRACE_CONCAT(_a, _b) TRACE_CONCAT_(_a, _b)
+#define TRACE_SCOPE(_name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(_name)
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef _triplebuffer_h_
+#define _triplebuffer_h_
+
+#include <atomic>
+#include <cstdint>
+
+// --------------------------------
+// Lock-free triple buffer
+//
+// One producer and one consumer thread each own a buffer and swap it with the
+// shared middle buffer through a single atomic exchange, so neither side ever
+// waits. The consumer always picks up the most recently published buffer;
+// buffers published in between are dropped.
+
+const uint8_t triple_buffer_index = 0x03;
+const uint8_t triple_buffer_fresh = 0x04;   // The middle buffer has not been consumed yet
+
+template <typename T>
+struct TripleBuffer
+{
+  T buffers[3];
+
+  uint8_t back;                             // Producer only
+  uint8_t front;                            // Consumer only
+
+  alignas(64) std::atomic<uint8_t> middle;
+};
+
+// --------------------------------
+
+template <typename T>
+void initTripleBuffer(TripleBuffer<T>& _buffer)
+{
+  _buffer.back = 0;
+  _buffer.front = 1;
+  _buffer.middle.store(2, std::memory_order_relaxed);
+}
+
+// --------------------------------
+
+template <typename T>
+T& backBuffer(TripleBuffer<T>& _buffer) { return _buffer.buffers[_buffer.back]; }
+
+template <typename T>
+const T& frontBuffer(const TripleBuffer<T>& _buffer) { return _buffer.buffers[_buffer.front]; }
+
+// --------------------------------
+
+template <typename T>
+void publishBackBuffer(TripleBuffer<T>& _buffer)
+{
+  const uint8_t old_middle = _buffer.middle.exchange(_buffer.back | triple_buffer_fresh, std::memory_order_acq_rel);
+  _buffer.back = old_middle & triple_buffer_index;
+}
+
+// --------------------------------
+
+// Returns false and keeps the current front buffer when nothing new was
+// published
+
+template <typename T>
+bool acquireFrontBuffer(TripleBuffer<T>& _buffer)
+{
+  if(!(_buffer.middle.load(std::memory_order_relaxed) & triple_buffer_fresh)) { return false; }
+
+  const uint8_t old_middle = _buffer.middle.exchange(_buffer.front, std::memory_order_acq_rel);
+  _buffer.front = old_middle & triple_buffer_index;
+
+  return true;
+}
+
+// --------------------------------
+
+#endif
@@ -0,0 +1,498 @@
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "font.h"
+#include "trace.h"
+#include "ui.h"
+
+// --------------------------------
+
+struct UIPanel
+{
+  bool        in_use;
+  bool        visible;
+  bool        border;
+  bool        layout_dirty;
+
+  UIRect      rect;
+  int         z;
+  uint8_t     attribute;
+  uint8_t     border_attribute;
+  UIAlign     align;
+
+  std::string title;
+  std::string text;
+
+  // The laid out panel, rect.width x rect.height
+
+  std::vector<uint8_t> cells;
+  std::vector<uint8_t> attributes;
+};
+
+struct UI
+{
+  int     columns;
+  int     rows;
+  uint8_t background_attribute;
+
+  UIPanel panels[ui_max_panels];
+
+  // The composed screen
+
+  std::vector<uint8_t> cells;
+  std::vector<uint8_t> attributes;
+
+  std::vector<UIRect> damage;
+
+  UIStats stats;
+};
+
+UI ui;
+
+// --------------------------------
+
+static bool isPanel(int _panel)
+{
+  return _panel >= 0 && _panel < ui_max_panels && ui.panels[_panel].in_use;
+}
+
+// --------------------------------
+
+static bool clipRect(UIRect& _rect, const UIRect& _clip)
+{
+  const int x0 = std::max(_rect.x, _clip.x);
+  const int y0 = std::max(_rect.y, _clip.y);
+  const int x1 = std::min(_rect.x + _rect.width, _clip.x + _clip.width);
+  const int y1 = std::min(_rect.y + _rect.height, _clip.y + _clip.height);
+
+  _rect.x = x0;
+  _rect.y = y0;
+  _rect.width = x1 - x0;
+  _rect.height = y1 - y0;
+
+  return _rect.width > 0 && _rect.height > 0;
+}
+
+// --------------------------------
+
+static bool touches(const UIRect& _a, const UIRect& _b)
+{
+  return _a.x <= _b.x + _b.width && _b.x <= _a.x + _a.width && _a.y <= _b.y + _b.height && _b.y <= _a.y + _a.height;
+}
+
+// --------------------------------
+
+static void addDamage(const UIRect& _rect)
+{
+  UIRect rect = _rect;
+  const UIRect screen = { 0, 0, ui.columns, ui.rows };
+
+  if(clipRect(rect, screen)) { ui.damage.push_back(rect); }
+}
+
+// --------------------------------
+
+void setUISize(int _columns, int _rows, uint8_t _background_attribute)
+{
+  ui.columns = _columns;
+  ui.rows = _rows;
+  ui.background_attribute = _background_attribute;
+
+  ui.cells.assign(_columns * _rows, ' ');
+  ui.attributes.assign(_columns * _rows, _background_attribute);
+
+  ui.damage.clear();
+  addDamage({ 0, 0, _columns, _rows });
+}
+
+// --------------------------------
+
+int createPanel(int _x, int _y, int _width, int _height, int _z)
+{
+  for(int i = 0; i < ui_max_panels; ++i)
+  {
+    UIPanel& panel = ui.panels[i];
+
+    if(panel.in_use) { continue; }
+
+    panel.in_use = true;
+    panel.visible = true;
+    panel.border = true;
+    panel.layout_dirty = true;
+    panel.rect = { _x, _y, std::max(_width, 1), std::max(_height, 1) };
+    panel.z = _z;
+    panel.attribute = 0x01;
+    panel.border_attribute = 0x01;
+    panel.align = ui_align_left;
+    panel.title.clear();
+    panel.text.clear();
+
+    addDamage(panel.rect);
+
+    return i;
+  }
+
+  return -1;
+}
+
+// --------------------------------
+
+void destroyPanel(int _panel)
+{
+  if(!isPanel(_panel)) { return; }
+
+  UIPanel& panel = ui.panels[_panel];
+
+  if(panel.visible) { addDamage(panel.rect); }
+
+  panel.in_use = false;
+  panel.cells.clear();
+  panel.attributes.clear();
+}
+
+// --------------------------------
+
+void destroyPanels()
+{
+  for(int i = 0; i < ui_max_panels; ++i) { destroyPanel(i); }
+}
+
+// --------------------------------
+
+void movePanel(int _panel, int _x, int _y)
+{
+  if(!isPanel(_panel)) { return; }
+
+  UIPanel& panel = ui.panels[_panel];
+
+  if(panel.visible) { addDamage(panel.rect); }
+
+  panel.rect.x = _x;
+  panel.rect.y = _y;
+
+  if(panel.visible) { addDamage(panel.rect); }
+}
+
+// --------------------------------
+
+void resizePanel(int _panel, int _width, int _height)
+{
+  if(!isPanel(_panel)) { return; }
+
+  UIPanel& panel = ui.panels[_panel];
+
+  if(panel.visible) { addDamage(panel.rect); }
+
+  panel.rect.width = std::max(_width, 1);
+  panel.rect.height = std::max(_height, 1);
+  panel.layout_dirty = true;
+
+  if(panel.visible) { addDamage(panel.rect); }
+}
+
+// --------------------------------
+
+void setPanelZ(int _panel, int _z)
+{
+  if(!isPanel(_panel) || ui.panels[_panel].z == _z) { return; }
+
+  ui.panels[_panel].z = _z;
+
+  if(ui.panels[_panel].visible) { addDamage(ui.panels[_panel].rect); }
+}
+
+// --------------------------------
+
+void showPanel(int _panel, bool _visible)
+{
+  if(!isPanel(_panel) || ui.panels[_panel].visible == _visible) { return; }
+
+  ui.panels[_panel].visible = _visible;
+
+  addDamage(ui.panels[_panel].rect);
+}
+
+// --------------------------------
+
+static void changePanel(UIPanel& _panel)
+{
+  _panel.layout_dirty = true;
+
+  if(_panel.visible) { addDamage(_panel.rect); }
+}
+
+// --------------------------------
+
+void setPanelStyle(int _panel, uint8_t _attribute, uint8_t _border_attribute, bool _border)
+{
+  if(!isPanel(_panel)) { return; }
+
+  UIPanel& panel = ui.panels[_panel];
+
+  panel.attribute = _attribute;
+  panel.border_attribute = _border_attribute;
+  panel.border = _border;
+
+  changePanel(panel);
+}
+
+// --------------------------------
+
+void setPanelTitle(int _panel, const char* _title)
+{
+  if(!isPanel(_panel) || ui.panels[_panel].title == _title) { return; }
+
+  ui.panels[_panel].title = _title;
+
+  changePanel(ui.panels[_panel]);
+}
+
+// --------------------------------
+
+void setPanelText(int _panel, const char* _text, UIAlign _align)
+{
+  if(!isPanel(_panel)) { return; }
+
+  UIPanel& panel = ui.panels[_panel];
+
+  if(panel.text == _text && panel.align == _align) { return; }
+
+  panel.text = _text;
+  panel.align = _align;
+
+  changePanel(panel);
+}
+
+// --------------------------------
+
+static void putLine(UIPanel& _panel, const UIRect& _area, int _row, const char* _line, int _length)
+{
+  int x = 0;
+
+  if(_panel.align == ui_align_centre) { x = (_area.width - _length) / 2; }
+  if(_panel.align == ui_align_right)  { x = _area.width - _length; }
+
+  uint8_t* cells = &_panel.cells[(_area.y + _row) * _panel.rect.width + _area.x + x];
+
+  for(int i = 0; i < _length; ++i) { cells[i] = _line[i] & 0x7F; }
+}
+
+// --------------------------------
+
+// Greedy word wrap of the text into the area, lines past the bottom are
+// dropped
+
+static void layoutText(UIPanel& _panel, const UIRect& _area)
+{
+  if(_area.width <= 0 || _area.height <= 0) { return; }
+
+  const char* text = _panel.text.c_str();
+  int row = 0;
+
+  while(*text && row < _area.height)
+  {
+    const char* end = text + strcspn(text, "\n");
+
+    // One paragraph
+
+    const char* p = text;
+
+    do
+    {
+      while(p < end && *p == ' ') { ++p; }
+
+      const char* line = p;
+      const char* line_end = p;
+
+      while(p < end)
+      {
+        const char* word_end = p;
+        while(word_end < end && *word_end != ' ') { ++word_end; }
+
+        if(word_end - line > _area.width)
+        {
+          // A word that does not fit an empty line is broken
+
+          if(line_end == line) { line_end = p = line + _area.width; }
+          break;
+        }
+
+        line_end = p = word_end;
+        while(p < end && *p == ' ') { ++p; }
+      }
+
+      putLine(_panel, _area, row++, line, line_end - line);
+    }
+    while(p < end && row < _area.height);
+
+    text = *end ? end + 1 : end;
+  }
+}
+
+// --------------------------------
+
+static void layoutPanel(UIPanel& _panel)
+{
+  const int width = _panel.rect.width;
+  const int height = _panel.rect.height;
+
+  _panel.cells.assign(width * height, ' ');
+  _panel.attributes.assign(width * height, _panel.attribute);
+
+  UIRect area = { 0, 0, width, height };
+
+  if(_panel.border && width >= 2 && height >= 2)
+  {
+    uint8_t* cells = _panel.cells.data();
+    uint8_t* attributes = _panel.attributes.data();
+
+    for(int x = 0; x < width; ++x)
+    {
+      cells[x] = cells[(height - 1) * width + x] = glyph_box_horizontal;
+      attributes[x] = attributes[(height - 1) * width + x] = _panel.border_attribute;
+    }
+
+    for(int y = 0; y < height; ++y)
+    {
+      cells[y * width] = cells[y * width + width - 1] = glyph_box_vertical;
+      attributes[y * width] = attributes[y * width + width - 1] = _panel.border_attribute;
+    }
+
+    cells[0] = glyph_box_top_left;
+    cells[width - 1] = glyph_box_top_right;
+    cells[(height - 1) * width] = glyph_box_bottom_left;
+    cells[height * width - 1] = glyph_box_bottom_right;
+
+    // The title sits in the top border, clipped to fit between the corners
+
+    const int title_length = std::min((int)_panel.title.size(), width - 4);
+
+    if(title_length > 0)
+    {
+      const int title_x = (width - title_length) / 2;
+
+      cells[title_x - 1] = ' ';
+      cells[title_x + title_length] = ' ';
+      for(int i = 0; i < title_length; ++i) { cells[title_x + i] = _panel.title[i] & 0x7F; }
+    }
+
+    area = { 1, 1, width - 2, height - 2 };
+  }
+
+  layoutText(_panel, area);
+
+  _panel.layout_dirty = false;
+  ++ui.stats.layouts;
+}
+
+// --------------------------------
+
+// Overlapping and touching damage is merged, so every cell is written once
+// and neighbouring edits go out as one rectangle
+
+static void mergeDamage()
+{
+  std::vector<UIRect>& damage = ui.damage;
+
+  for(bool merged = true; merged;)
+  {
+    merged = false;
+
+    for(size_t i = 0; i < damage.size() && !merged; ++i)
+    {
+      for(size_t j = i + 1; j < damage.size(); ++j)
+      {
+        if(!touches(damage[i], damage[j])) { continue; }
+
+        const int x0 = std::min(damage[i].x, damage[j].x);
+        const int y0 = std::min(damage[i].y, damage[j].y);
+        const int x1 = std::max(damage[i].x + damage[i].width, damage[j].x + damage[j].width);
+        const int y1 = std::max(damage[i].y + damage[i].height, damage[j].y + damage[j].height);
+
+        damage[i] = { x0, y0, x1 - x0, y1 - y0 };
+        damage.erase(damage.begin() + j);
+
+        merged = true;
+        break;
+      }
+    }
+  }
+}
+
+// --------------------------------
+
+int composeUI(UIWrite _write)
+{
+  if(ui.damage.empty()) { return 0; }
+
+  ui.stats.layouts = 0;
+  ui.stats.batches = 0;
+  ui.stats.cells = 0;
+
+  TRACE_SCOPE("composeUI");
+
+  // Visible panels, bottom to top
+
+  int order[ui_max_panels];
+  int panel_count = 0;
+
+  for(int i = 0; i < ui_max_panels; ++i)
+  {
+    UIPanel& panel = ui.panels[i];
+
+    if(!panel.in_use || !panel.visible) { continue; }
+
+    if(panel.layout_dirty) { layoutPanel(panel); }
+
+    order[panel_count++] = i;
+  }
+
+  std::stable_sort(order, order + panel_count, [](int _a, int _b) { return ui.panels[_a].z < ui.panels[_b].z; });
+
+  mergeDamage();
+
+  for(const UIRect& rect : ui.damage)
+  {
+    for(int y = rect.y; y < rect.y + rect.height; ++y)
+    {
+      memset(&ui.cells[y * ui.columns + rect.x], ' ', rect.width);
+      memset(&ui.attributes[y * ui.columns + rect.x], ui.background_attribute, rect.width);
+    }
+
+    for(int i = 0; i < panel_count; ++i)
+    {
+      const UIPanel& panel = ui.panels[order[i]];
+
+      UIRect visible = panel.rect;
+      if(!clipRect(visible, rect)) { continue; }
+
+      for(int y = visible.y; y < visible.y + visible.height; ++y)
+      {
+        const int source = (y - panel.rect.y) * panel.rect.width + visible.x - panel.rect.x;
+
+        memcpy(&ui.cells[y * ui.columns + visible.x], &panel.cells[source], visible.width);
+        memcpy(&ui.attributes[y * ui.columns + visible.x], &panel.attributes[source], visible.width);
+      }
+    }
+
+    const int offset = rect.y * ui.columns + rect.x;
+
+    _write(rect, &ui.cells[offset], &ui.attributes[offset], ui.columns);
+
+    ++ui.stats.batches;
+    ui.stats.cells += rect.width * rect.height;
+  }
+
+  ui.damage.clear();
+
+  return ui.stats.batches;
+}
+
+// --------------------------------
+
+UIStats uiStats()
+{
+  return ui.stats;
+}
@@ -0,0 +1,73 @@
+#ifndef _ui_h_
+#define _ui_h_
+
+#include <cstdint>
+
+// --------------------------------
+// Text UI layout
+//
+// Panels are rectangles of cells with an optional box border and title and
+// a word wrapped, aligned text body, clipped to the panel. composeUI()
+// stacks the visible panels by z (then creation order) over a background
+// and hands every changed area to a UIWrite callback as one rectangle.
+//
+// Layout is incremental: a panel is only laid out again when its text,
+// title, style or size changes. Moving, restacking or hiding a panel only
+// recomposes the cells it covered and covers.
+
+const int ui_max_panels = 32;
+
+enum UIAlign
+{
+  ui_align_left,
+  ui_align_centre,
+  ui_align_right,
+};
+
+struct UIRect
+{
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+struct UIStats
+{
+  unsigned int layouts;         // In the last composeUI() that wrote anything
+  unsigned int batches;
+  unsigned int cells;
+};
+
+// A rectangle of composed cells, glyphs and attributes _pitch cells apart
+
+typedef void (*UIWrite)(const UIRect& _rect, const uint8_t* _cells, const uint8_t* _attributes, int _pitch);
+
+// Sets the screen size in cells, the whole screen is composed again
+
+void setUISize(int _columns, int _rows, uint8_t _background_attribute);
+
+// Returns the panel number, or -1 when all are in use
+
+int createPanel(int _x, int _y, int _width, int _height, int _z);
+void destroyPanel(int _panel);
+void destroyPanels();
+
+void movePanel(int _panel, int _x, int _y);
+void resizePanel(int _panel, int _width, int _height);
+void setPanelZ(int _panel, int _z);
+void showPanel(int _panel, bool _visible);
+
+void setPanelStyle(int _panel, uint8_t _attribute, uint8_t _border_attribute, bool _border);
+void setPanelTitle(int _panel, const char* _title);
+
+// ASCII text. Paragraphs are separated by '\n' and words by spaces, words
+// longer than a line are broken.
+
+void setPanelText(int _panel, const char* _text, UIAlign _align);
+
+int composeUI(UIWrite _write);    // Returns the number of rectangles written
+
+UIStats uiStats();
+
+#endif